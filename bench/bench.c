@@ -0,0 +1,277 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Whole ROM benchmark, run by make bench. Every ROM is run headless for a
+   fixed number of emulated CPU cycles, several times, and the median run is
+   reported as one JSON line per ROM plus a total line. With --baseline, the
+   lines saved earlier by --save are compared against and the exit code is
+   1 if any ROM got slower per instruction by more than --threshold percent.
+
+   A ROM that stops the emulated CPU (an unimplemented opcode) is powered up
+   again and keeps going, so every ROM runs for the same number of cycles.
+   The time spent powering up is left out, it isn't emulation. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "def.h"
+#include "6502.h"
+#include "nes.h"
+#include "rom.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// NTSC, 341 * 262 PPU dots a frame at 3 dots a cycle
+#define FRAME_CYCLES (341.0 * 262.0 / 3.0)
+
+struct result {
+  const char* rom;
+  u64 cycles;
+  u64 instructions;
+  u64 restarts;
+  u32 reps;
+  double seconds;       // median of the reps
+  double min_seconds;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// one run of at least budget cycles on a fresh NES, returns the seconds
+static double bench_run(struct rom_image* img, u64 budget, struct result* r)
+{
+  struct NES* nes = nes_create();
+  nes_load_rom_image(nes, img);
+  nes_powerup(nes);
+  nes->is_active = true;
+
+  u64 cycles = 0, instructions = 0, restarts = 0;
+  u32 ticks = nes->cpu->ticks;
+  double start = now(), restarting = 0;
+
+  while(cycles < budget) {
+    nes_tick(nes);
+    ++instructions;
+
+    cycles += (u32)(nes->cpu->ticks - ticks);
+    ticks = nes->cpu->ticks;
+
+    if(!nes->is_active) {
+      double stopped = now();
+
+      nes_powerup(nes);
+      nes->is_active = true;
+      ticks = nes->cpu->ticks;
+      ++restarts;
+
+      restarting += now() - stopped;
+    }
+  }
+
+  double seconds = now() - start - restarting;
+  nes_free(nes);
+
+  r->cycles = cycles;
+  r->instructions = instructions;
+  r->restarts = restarts;
+  return seconds;
+}
+
+static bool bench_rom(const char* path, u64 budget, u32 reps, struct result* r)
+{
+  FILE* fp = fopen(path, "rb");
+  if(!fp) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return false;
+  }
+
+  struct rom_image* img = rom_image_load_file(fp);
+  fclose(fp);
+
+  if(!img) {
+    fprintf(stderr, "Can't load %s\n", path);
+    return false;
+  }
+
+  double* seconds = malloc(reps * sizeof(double));
+
+  // the first run only warms up caches and the page cache
+  bench_run(img, budget / 10, r);
+
+  for(u32 i = 0; i < reps; ++i) {
+    seconds[i] = bench_run(img, budget, r);
+  }
+
+  qsort(seconds, reps, sizeof(double), compare_double);
+
+  r->rom = path;
+  r->reps = reps;
+  r->seconds = seconds[reps / 2];
+  r->min_seconds = seconds[0];
+
+  free(seconds);
+  rom_image_release(img);
+
+  return true;
+}
+
+static double ns_per_instr(struct result* r, double seconds)
+{
+  return r->instructions ? seconds * 1e9 / r->instructions : 0;
+}
+
+// ns_per_instr of rom in a file written by --save, or 0
+static double baseline_lookup(FILE* fp, const char* rom)
+{
+  char line[1024], key[512];
+  snprintf(key, sizeof(key), "\"rom\":\"%s\"", rom);
+
+  rewind(fp);
+
+  while(fgets(line, sizeof(line), fp)) {
+    char* p = strstr(line, key);
+    if(!p || (p[strlen(key)] != ',' && p[strlen(key)] != '}')) continue;
+
+    p = strstr(line, "\"ns_per_instr\":");
+    if(p) return strtod(p + strlen("\"ns_per_instr\":"), NULL);
+  }
+
+  return 0;
+}
+
+// prints r as one JSON line, returns true if it's slower than the baseline
+// by more than threshold percent
+static bool report(FILE* out, struct result* r, FILE* baseline, double threshold,
+                   long peak_rss)
+{
+  double ns = ns_per_instr(r, r->seconds);
+  bool regressed = false;
+
+  fprintf(out, "{\"rom\":\"%s\",\"cycles\":%llu,\"instructions\":%llu,\"frames\":%.1f,"
+          "\"restarts\":%llu,\"reps\":%u,\"seconds\":%.6f,\"mips\":%.3f,\"fps\":%.1f,"
+          "\"ns_per_instr\":%.3f,\"min_ns_per_instr\":%.3f",
+          r->rom, (unsigned long long)r->cycles, (unsigned long long)r->instructions,
+          r->cycles / FRAME_CYCLES, (unsigned long long)r->restarts, r->reps, r->seconds,
+          r->instructions / r->seconds * 1e-6, r->cycles / FRAME_CYCLES / r->seconds,
+          ns, ns_per_instr(r, r->min_seconds));
+
+  if(peak_rss) fprintf(out, ",\"peak_rss_kb\":%ld", peak_rss);
+
+  double base = baseline ? baseline_lookup(baseline, r->rom) : 0;
+
+  if(base > 0) {
+    double change = (ns / base - 1) * 100;
+    regressed = change > threshold;
+
+    fprintf(out, ",\"baseline_ns_per_instr\":%.3f,\"change_pct\":%.2f%s",
+            base, change, regressed ? ",\"regression\":true" : "");
+  }
+
+  fprintf(out, "}\n");
+  return regressed;
+}
+
+static int usage(void)
+{
+  fprintf(stderr,
+          "Usage: bench [options] NESROM...\n"
+          "  --cycles N           emulated CPU cycles per run (default 5000000)\n"
+          "  --reps R             timed runs per ROM, the median is reported (default 5)\n"
+          "  --save FILE          also write the results to FILE as a baseline\n"
+          "  --baseline FILE      compare against a saved baseline\n"
+          "  --threshold PCT      slowdown that counts as a regression (default 5)\n");
+  return 2;
+}
+
+int main(int argc, char** argv)
+{
+  u64 budget = 5000000;
+  u32 reps = 5;
+  double threshold = 5;
+  const char* save = NULL;
+  FILE* baseline = NULL;
+  int first = 1;
+
+  for(; first < argc && !strncmp(argv[first], "--", 2); ++first) {
+    if(first + 1 >= argc) return usage();
+
+    if(!strcmp(argv[first], "--cycles")) {
+      budget = strtoull(argv[++first], NULL, 10);
+    } else if(!strcmp(argv[first], "--reps")) {
+      reps = atoi(argv[++first]);
+    } else if(!strcmp(argv[first], "--threshold")) {
+      threshold = strtod(argv[++first], NULL);
+    } else if(!strcmp(argv[first], "--save")) {
+      save = argv[++first];
+    } else if(!strcmp(argv[first], "--baseline")) {
+      if(!(baseline = fopen(argv[++first], "r"))) {
+        fprintf(stderr, "Can't open baseline %s\n", argv[first]);
+        return 2;
+      }
+    } else {
+      return usage();
+    }
+  }
+
+  if(first >= argc || !budget || !reps) return usage();
+
+  FILE* out = save ? fopen(save, "w") : NULL;
+  if(save && !out) {
+    fprintf(stderr, "Can't write %s\n", save);
+    return 2;
+  }
+
+  struct result total = { .rom = "total", .reps = reps };
+  bool regressed = false;
+
+  for(int i = first; i < argc; ++i) {
+    struct result r;
+    if(!bench_rom(argv[i], budget, reps, &r)) return 2;
+
+    regressed |= report(stdout, &r, baseline, threshold, 0);
+    if(out) report(out, &r, NULL, 0, 0);
+
+    total.cycles += r.cycles;
+    total.instructions += r.instructions;
+    total.restarts += r.restarts;
+    total.seconds += r.seconds;
+    total.min_seconds += r.min_seconds;
+  }
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  regressed |= report(stdout, &total, baseline, threshold, ru.ru_maxrss);
+  if(out) report(out, &total, NULL, 0, ru.ru_maxrss);
+
+  if(out) fclose(out);
+  if(baseline) fclose(baseline);
+
+  return regressed ? 1 : 0;
+}
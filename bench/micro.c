@@ -0,0 +1,385 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Subsystem microbenchmarks, run by make bench-micro. Each benchmark runs
+   one piece of the emulator in isolation (CPU dispatch on a synthetic
+   instruction stream, bus accesses per region, mapper bank switches, PPU
+   scanlines, APU audio) on its own NES. The number of operations per
+   repetition is calibrated to --time milliseconds, one repetition warms up,
+   and then --reps are timed. One JSON line per benchmark reports the median
+   ns per operation with min, mean and standard deviation, so a change in
+   one component stands out from the noise of whole ROM runs. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "def.h"
+#include "6502.h"
+#include "2C02.h"
+#include "apu.h"
+#include "ines.h"
+#include "mapper.h"
+#include "nes.h"
+#include "rom.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PRG_BANK 0x4000
+
+struct fixture {
+  struct NES* nes;
+  u8* image;           // the iNES image, borrowed by the NES
+};
+
+struct micro {
+  const char* name;
+  const char* unit;    // what one operation is
+  bool (*setup)(struct fixture* f, const struct micro* m);
+  void (*run)(struct fixture* f, const struct micro* m, u64 n);
+
+  enum rom_mapper mapper;
+  u16 addr;            // bus benchmarks
+  const u8* code;      // cpu benchmarks, looped with a JMP
+  u8 code_size;
+};
+
+static volatile u8 sink;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// an iNES image with CHR RAM and prg_banks 16K PRG banks, each starting
+// with code (followed by a JMP back to it) and the vectors pointing there
+static u8* build_image(enum rom_mapper mapper, u32 prg_banks, const u8* code, u8 code_size,
+                       u32* size)
+{
+  *size = 16 + prg_banks * PRG_BANK;
+  u8* image = calloc(*size, 1);
+
+  memcpy(image, INES_HEADER, 4);
+  image[4] = prg_banks;
+  image[6] = (mapper & 0xF) << 4;
+  image[7] = mapper & 0xF0;
+
+  for(u32 i = 0; i < prg_banks; ++i) {
+    u8* bank = image + 16 + i * PRG_BANK;
+    u16 start = i + 1 == prg_banks ? 0xC000 : 0x8000;
+
+    memcpy(bank, code, code_size);
+    bank[code_size] = 0x4C;
+    bank[code_size + 1] = start & 0xFF;
+    bank[code_size + 2] = start >> 8;
+
+    for(int v = 0; v < 3; ++v) {
+      bank[PRG_BANK - 6 + v * 2] = start & 0xFF;
+      bank[PRG_BANK - 5 + v * 2] = start >> 8;
+    }
+  }
+
+  return image;
+}
+
+static bool setup_nes(struct fixture* f, const struct micro* m)
+{
+  static const u8 nop = 0xEA;
+  u32 size, banks = m->mapper == NROM ? 1 : 8;
+
+  f->image = m->code ? build_image(m->mapper, banks, m->code, m->code_size, &size)
+                     : build_image(m->mapper, banks, &nop, 1, &size);
+  f->nes = nes_create();
+
+  if(!nes_load_rom_buffer(f->nes, f->image, size)) return false;
+
+  nes_powerup(f->nes);
+  f->nes->is_active = true;
+  return true;
+}
+
+static void cpu_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  struct _6502* cpu = f->nes->cpu;
+
+  for(u64 i = 0; i < n; ++i) cpu_6502_tick(cpu);
+}
+
+static void fetch_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  u8 acc = 0;
+
+  for(u64 i = 0; i < n; ++i) acc += nes_fetch_memory(f->nes, m->addr + (i & 7));
+  sink = acc;
+}
+
+static void set_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  for(u64 i = 0; i < n; ++i) nes_set_memory(f->nes, m->addr + (i & 7), i);
+}
+
+// one PRG bank switch is five serial writes on MMC1
+static void mmc1_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  struct mapper* map = f->nes->rom->map;
+
+  for(u64 i = 0; i < n; ++i) {
+    u8 bank = i & 7;
+    for(int b = 0; b < 5; ++b) mapper_set_memory(map, 0xE000, bank >> b);
+  }
+}
+
+static void axrom_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  struct mapper* map = f->nes->rom->map;
+
+  for(u64 i = 0; i < n; ++i) mapper_set_memory(map, 0x8000, i & 7);
+}
+
+// rendering on, with something in the pattern tables, nametables and OAM
+static bool setup_ppu(struct fixture* f, const struct micro* m)
+{
+  if(!setup_nes(f, m)) return false;
+
+  struct NES* nes = f->nes;
+  struct _2C02* ppu = nes->ppu;
+
+  nes_set_memory(nes, 0x2006, 0x00);
+  nes_set_memory(nes, 0x2006, 0x00);
+  for(u32 i = 0; i < 0x3000; ++i) nes_set_memory(nes, 0x2007, i * 7 + (i >> 8));
+
+  for(u32 i = 0; i < 0x20; ++i) ppu->palette[i] = i * 3 & 0x3F;
+  for(u32 i = 0; i < 0x100; ++i) ppu->oam[i] = i * 37;
+
+  nes_set_memory(nes, 0x2000, 0x08);
+  nes_set_memory(nes, 0x2001, 0x1E);
+  return true;
+}
+
+static void ppu_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  for(u64 i = 0; i < n; ++i) ppu_2C02_run(f->nes->ppu, PPU_DOTS_PER_LINE);
+}
+
+// both pulses, the triangle and the noise playing
+static bool setup_apu(struct fixture* f, const struct micro* m)
+{
+  static const u8 regs[][2] = {
+    { 0x15, 0x0F },
+    { 0x00, 0xBF }, { 0x02, 0xFD }, { 0x03, 0x08 },
+    { 0x04, 0x7F }, { 0x06, 0x80 }, { 0x07, 0x09 },
+    { 0x08, 0xFF }, { 0x0A, 0x40 }, { 0x0B, 0x08 },
+    { 0x0C, 0x3F }, { 0x0E, 0x03 }, { 0x0F, 0x08 },
+  };
+
+  if(!setup_nes(f, m)) return false;
+
+  for(u32 i = 0; i < sizeof(regs) / sizeof(regs[0]); ++i)
+    nes_set_memory(f->nes, 0x4000 + regs[i][0], regs[i][1]);
+
+  return true;
+}
+
+// one operation is a second of audio, in frame sized pieces like nes_tick
+// would drain it
+static void apu_second_run(struct fixture* f, const struct micro* m, u64 n)
+{
+  struct APU* apu = f->nes->apu;
+
+  for(u64 i = 0; i < n; ++i) {
+    for(u32 c = 0; c < APU_CPU_CLOCK; c += 29780) {
+      apu_run(apu, 29780);
+      apu->sample_count = 0;
+    }
+  }
+}
+
+static const u8 code_nop[]   = { 0xEA, 0xEA, 0xEA, 0xEA, 0xEA, 0xEA, 0xEA, 0xEA };
+static const u8 code_alu[]   = { 0xA9, 0x12, 0x69, 0x34, 0x29, 0x7F, 0x49, 0x55,
+                                 0x09, 0x80, 0xC9, 0x40, 0xAA, 0xE8, 0xA8, 0xC8 };
+static const u8 code_zp[]    = { 0xA5, 0x10, 0x85, 0x11, 0xE6, 0x12, 0xA6, 0x13,
+                                 0x86, 0x14, 0xB5, 0x15, 0x95, 0x16, 0x06, 0x17 };
+static const u8 code_abs[]   = { 0xAD, 0x00, 0x03, 0x8D, 0x01, 0x03, 0xEE, 0x02, 0x03,
+                                 0xBD, 0x03, 0x03, 0x9D, 0x04, 0x03, 0xAD, 0x00, 0x80 };
+static const u8 code_ind[]   = { 0xA9, 0x00, 0x85, 0x20, 0xA9, 0x03, 0x85, 0x21,
+                                 0xB1, 0x20, 0x91, 0x20, 0xA1, 0x20, 0x81, 0x20 };
+static const u8 code_stack[] = { 0x48, 0x08, 0x68, 0x28, 0x48, 0x68, 0x08, 0x28 };
+
+#define CODE(c) .code = c, .code_size = sizeof(c)
+
+static const struct micro micros[] = {
+  { "cpu/nop",      "instr", setup_nes, cpu_run, NROM, 0, CODE(code_nop) },
+  { "cpu/alu",      "instr", setup_nes, cpu_run, NROM, 0, CODE(code_alu) },
+  { "cpu/zp",       "instr", setup_nes, cpu_run, NROM, 0, CODE(code_zp) },
+  { "cpu/abs",      "instr", setup_nes, cpu_run, NROM, 0, CODE(code_abs) },
+  { "cpu/ind",      "instr", setup_nes, cpu_run, NROM, 0, CODE(code_ind) },
+  { "cpu/stack",    "instr", setup_nes, cpu_run, NROM, 0, CODE(code_stack) },
+
+  { "fetch/ram",    "read",  setup_nes, fetch_run, NROM, 0x0300, NULL, 0 },
+  { "fetch/mirror", "read",  setup_nes, fetch_run, NROM, 0x1300, NULL, 0 },
+  { "fetch/ppu",    "read",  setup_nes, fetch_run, NROM, 0x2000, NULL, 0 },
+  { "fetch/apu",    "read",  setup_nes, fetch_run, NROM, 0x4010, NULL, 0 },
+  { "fetch/sram",   "read",  setup_nes, fetch_run, NROM, 0x6000, NULL, 0 },
+  { "fetch/prg",    "read",  setup_nes, fetch_run, NROM, 0x8000, NULL, 0 },
+  { "set/ram",      "write", setup_nes, set_run,   NROM, 0x0300, NULL, 0 },
+  { "set/mirror",   "write", setup_nes, set_run,   NROM, 0x1300, NULL, 0 },
+  { "set/ppu",      "write", setup_nes, set_run,   NROM, 0x2003, NULL, 0 },
+  { "set/apu",      "write", setup_nes, set_run,   NROM, 0x4000, NULL, 0 },
+  { "set/sram",     "write", setup_nes, set_run,   NROM, 0x6000, NULL, 0 },
+
+  { "mapper/mmc1",  "switch", setup_nes, mmc1_run,  MMC1, 0, NULL, 0 },
+  { "mapper/axrom", "switch", setup_nes, axrom_run, AXROM, 0, NULL, 0 },
+
+  { "ppu/scanline", "line",   setup_ppu, ppu_run,        NROM, 0, NULL, 0 },
+  { "apu/second",   "second", setup_apu, apu_second_run, NROM, 0, NULL, 0 },
+};
+
+static void fixture_free(struct fixture* f)
+{
+  if(f->nes) nes_free(f->nes);
+  free(f->image);
+}
+
+static bool bench(const struct micro* m, u32 reps, double target)
+{
+  struct fixture f = { 0 };
+
+  if(!m->setup(&f, m)) {
+    fprintf(stderr, "%s: setup failed\n", m->name);
+    fixture_free(&f);
+    return false;
+  }
+
+  // grow n until one repetition takes about target seconds, which also
+  // serves as the warmup
+  u64 n = 1;
+  double t;
+
+  for(;;) {
+    double start = now();
+    m->run(&f, m, n);
+    t = now() - start;
+
+    if(t >= target / 4 || n >= (1ull << 40)) break;
+    n *= 2;
+  }
+
+  n = n * target / (t > 0 ? t : target) + 1;
+  m->run(&f, m, n);
+
+  double* ns = malloc(reps * sizeof(double));
+  double sum = 0, sq = 0;
+
+  for(u32 i = 0; i < reps; ++i) {
+    double start = now();
+    m->run(&f, m, n);
+    ns[i] = (now() - start) * 1e9 / n;
+
+    sum += ns[i];
+    sq += ns[i] * ns[i];
+  }
+
+  bool halted = !f.nes->is_active;
+  fixture_free(&f);
+
+  if(halted) {
+    fprintf(stderr, "%s: the CPU stopped, the stream has an unimplemented opcode\n", m->name);
+    free(ns);
+    return false;
+  }
+
+  qsort(ns, reps, sizeof(double), compare_double);
+
+  double mean = sum / reps;
+  double stddev = sqrt(fmax(sq / reps - mean * mean, 0));
+
+  printf("{\"bench\":\"%s\",\"unit\":\"%s\",\"ops\":%llu,\"reps\":%u,\"ns_per_op\":%.3f,"
+         "\"min\":%.3f,\"mean\":%.3f,\"stddev\":%.3f,\"rsd_pct\":%.2f}\n",
+         m->name, m->unit, (unsigned long long)n, reps, ns[reps / 2],
+         ns[0], mean, stddev, mean > 0 ? stddev / mean * 100 : 0);
+  fflush(stdout);
+
+  free(ns);
+  return true;
+}
+
+static int usage(void)
+{
+  fprintf(stderr,
+          "Usage: micro [options] [NAME...]\n"
+          "  --reps R             timed repetitions per benchmark (default 11)\n"
+          "  --time MS            length of one repetition (default 50)\n"
+          "  --list               print the benchmark names\n"
+          "Only the benchmarks whose names start with one of the NAMEs are run.\n");
+  return 2;
+}
+
+static bool selected(const struct micro* m, int argc, char** argv, int first)
+{
+  if(first >= argc) return true;
+
+  for(int i = first; i < argc; ++i) {
+    if(!strncmp(m->name, argv[i], strlen(argv[i]))) return true;
+  }
+
+  return false;
+}
+
+int main(int argc, char** argv)
+{
+  u32 reps = 11;
+  double target = 0.05;
+  int first = 1;
+  int count = sizeof(micros) / sizeof(micros[0]);
+
+  for(; first < argc && !strncmp(argv[first], "--", 2); ++first) {
+    if(!strcmp(argv[first], "--list")) {
+      for(int i = 0; i < count; ++i) printf("%-14s %s\n", micros[i].name, micros[i].unit);
+      return 0;
+    }
+
+    if(first + 1 >= argc) return usage();
+
+    if(!strcmp(argv[first], "--reps")) {
+      reps = atoi(argv[++first]);
+    } else if(!strcmp(argv[first], "--time")) {
+      target = atof(argv[++first]) * 1e-3;
+    } else {
+      return usage();
+    }
+  }
+
+  if(!reps || target <= 0) return usage();
+
+  int ret = 0;
+
+  for(int i = 0; i < count; ++i) {
+    if(selected(&micros[i], argc, argv, first) && !bench(&micros[i], reps, target))
+      ret = 1;
+  }
+
+  return ret;
+}
@@ -25,6 +25,8 @@
 
 #include "def.h"
 
+struct obs;
+
 struct NES;
 
 /*
@@ -71,32 +73,32 @@ struct NES;
   7     -   PPU memory read/write port.
 */
 
-struct ppu_control_register {   // 0x2000
-  int nametable    : 2; // scroll name table selection (0 = $2000; 1 = $2400; 2 = $2800; 3 = $2C00)
-  int increment    : 1; // 0: increment by 1,  1: increment by 32
-  int sprite_table : 1; // 0: $0000; 1: $1000; ignored in 8x16 mode
-  int pattern      : 1; // 0: $0000; 1: $1000
-  int sprite_size  : 1; // 0: 8x8; 1: 8x16
-  int unused       : 1; // ignored
-  int nmi          : 1; // 0: off; 1: on
+struct __attribute__ ((packed)) ppu_control_register {   // 0x2000
+  unsigned nametable    : 2; // scroll name table selection (0 = $2000; 1 = $2400; 2 = $2800; 3 = $2C00)
+  unsigned increment    : 1; // 0: increment by 1,  1: increment by 32
+  unsigned sprite_table : 1; // 0: $0000; 1: $1000; ignored in 8x16 mode
+  unsigned pattern      : 1; // 0: $0000; 1: $1000
+  unsigned sprite_size  : 1; // 0: 8x8; 1: 8x16
+  unsigned unused       : 1; // ignored
+  unsigned nmi          : 1; // 0: off; 1: on
 };
 
-struct ppu_mask_register {      // 0x2001
-  int greyscale    : 1; // 0: normal color; 1: produce a monochrome display
-  int clip_playfield  : 1; // 1: show background in leftmost 8 pixels of screen; 0: Hide
-  int clip_object     : 1; // 1: Show sprites in leftmost 8 pixels of screen; 0: Hide
-  int show_background : 1; // 1: Show background
-  int show_sprites : 1; // 1: Show sprites
-  int red          : 1; // Intensify reds (and darken other colors)
-  int green        : 1; // Intensify greens (and darken other colors)
-  int blue         : 1; // Intensify blues (and darken other colors)
+struct __attribute__ ((packed)) ppu_mask_register {      // 0x2001
+  unsigned greyscale    : 1; // 0: normal color; 1: produce a monochrome display
+  unsigned clip_playfield  : 1; // 1: show background in leftmost 8 pixels of screen; 0: Hide
+  unsigned clip_object     : 1; // 1: Show sprites in leftmost 8 pixels of screen; 0: Hide
+  unsigned show_background : 1; // 1: Show background
+  unsigned show_sprites : 1; // 1: Show sprites
+  unsigned red          : 1; // Intensify reds (and darken other colors)
+  unsigned green        : 1; // Intensify greens (and darken other colors)
+  unsigned blue         : 1; // Intensify blues (and darken other colors)
 };
 
-struct ppu_status_register {    // 0x2002
-  int lsb       : 5; // 5 least significant bits, unused
-  int overflow  : 1; // sprite scanline overflow
-  int sprite_hit: 1; // set when sprite 0 hits nonzero background pixel
-  int vblank    : 1; // set when in vblank
+struct __attribute__ ((packed)) ppu_status_register {    // 0x2002
+  unsigned lsb       : 5; // 5 least significant bits, unused
+  unsigned overflow  : 1; // sprite scanline overflow
+  unsigned sprite_hit: 1; // set when sprite 0 hits nonzero background pixel
+  unsigned vblank    : 1; // set when in vblank
 };
 
 struct __attribute__ ((aligned)) ppu_registers {
@@ -110,21 +112,77 @@ struct __attribute__ ((aligned)) ppu_registers {
   u8                          ppu_data;    // 0x2007
 };
 
+/*
+  Frame timing (NTSC), 341 dots per scanline, 3 dots per CPU cycle
+  -----------------------------------------------------------------
+  0   - 239  visible scanlines
+  240        post-render (idle)
+  241 - 260  vertical blank, flag set and NMI raised at dot 1 of 241
+  261        pre-render, vertical blank cleared at dot 1
+*/
+#define PPU_DOTS_PER_LINE  341
+#define PPU_LINES          262
+#define PPU_VBLANK_LINE    241
+#define PPU_PRERENDER_LINE 261
+
+#define PPU_WIDTH  256
+#define PPU_HEIGHT 240
+
+// how the four logical nametables map onto the 1K pages of VRAM
+enum ppu_mirroring {
+  MIRROR_HORIZONTAL,   // $2000 = $2400, $2800 = $2C00
+  MIRROR_VERTICAL,     // $2000 = $2800, $2400 = $2C00
+  MIRROR_SINGLE_LOW,   // all four use the first page
+  MIRROR_SINGLE_HIGH,  // all four use the second page
+  MIRROR_FOUR          // cartridge provides the other 2K
+};
+
 struct _2C02 {
   struct ppu_registers r;
 
+  u16 dot;             // 0 - 340
+  u16 scanline;        // 0 - 261
+  u32 frame;           // frames since power on
+
+  // internal scroll registers, see http://wiki.nesdev.com/w/index.php/PPU_scrolling
+  u16 v;               // current VRAM address
+  u16 t;               // temporary VRAM address, top left of the screen
+  u8  x;               // fine X scroll
+  bool w;              // first / second write toggle of $2005 and $2006
+  u8  read_buffer;     // $2007 reads are delayed by one
+
+  u8  mirroring;       // enum ppu_mirroring
+  u16 nt_map[4];       // vram page of each nametable
+
+  // skip drawing into the framebuffer; sprite 0 hits and overflow are
+  // still computed since games poll them
+  bool suppress_output;
+
+  // optional downscaled copy of every finished frame, see obs.h
+  struct obs* obs;
+
+  u8* vram_pages[4];   // 1K pages of vram, see cow.h
+  u8 vram[0x1000];     // 2K on the console, 4K for four screen boards
+  u8 palette[0x20];
+  u8 oam[0x100];
+
+  // one NES color index (0 - 63) per pixel
+  u8 framebuffer[PPU_WIDTH * PPU_HEIGHT];
+
   struct NES* nes;
 };
 
 // functions
-struct _2C02* ppu_2C02_create(struct NES* nes);
-void          ppu_2C02_free(struct _2C02* ppu);
+void          ppu_2C02_init(struct _2C02* ppu, struct NES* nes);
 void          ppu_2C02_powerup(struct _2C02* ppu);
 void          ppu_2C02_reset(struct _2C02* ppu);
 
 void          ppu_2C02_tick(struct _2C02* ppu);
+void          ppu_2C02_run(struct _2C02* ppu, u32 dots);
+u32           ppu_2C02_dots_to_event(struct _2C02* ppu);
 void          ppu_2C02_set_register(struct _2C02* ppu, u8 reg, u8 val);
 u8            ppu_2C02_get_register(struct _2C02* ppu, u8 reg);
+void          ppu_2C02_set_mirroring(struct _2C02* ppu, enum ppu_mirroring mirroring);
 void          ppu_2C02_inspect(struct _2C02* ppu);
 
 #endif /* _PPU_H */
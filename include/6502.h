@@ -23,6 +23,9 @@
 
 #include "def.h"
 
+struct profile;
+struct tracebuf;
+
 /* proc status / flag register layout
    +7 6 5 4 3 2 1 0+ bit number
    +-+-+-+-+-+-+-+-+
@@ -58,10 +61,17 @@ struct registers {
   struct flag flags;    // proc status / flag
 };
 
+// devices that can hold the IRQ line, one bit each in irq_sources
+enum irq_source {
+  IRQ_APU    = 1 << 0,  // frame counter
+  IRQ_MAPPER = 1 << 1   // e.g. the MMC3 scanline counter
+};
+
 struct interrupts {
-  bool nmi;
+  bool nmi;       // edge triggered, cleared when serviced
   bool reset;
   bool brk;
+  u8 irq_sources; // level triggered, asserted while any source holds it
 
   // XXX: these are temporary until NES files are actually loaded into memory
   u16 nmi_addr;   // 0xFFFA
@@ -78,15 +88,23 @@ struct _6502 {
   struct interrupts intr; // interrupt state
   u32 ticks;
 
+  bool trace;        // print every instruction as it executes
+
+  // optional, counts the cycles of every instruction, see profile.h
+  struct profile* profile;
+
+  // optional, records the state before every instruction, see tracebuf.h
+  struct tracebuf* tracebuf;
+
   struct NES* nes;   // pointer to parent NES struct
 };
 
 // functions
-struct _6502* cpu_6502_create(struct NES* nes);
-void          cpu_6502_free(struct _6502* cpu);
+void          cpu_6502_init(struct _6502* cpu, struct NES* nes);
 void          cpu_6502_powerup(struct _6502* cpu);
 void          cpu_6502_reset(struct _6502* cpu);
 void          cpu_6502_tick(struct _6502* cpu);
+void          cpu_6502_set_irq(struct _6502* cpu, enum irq_source source, bool level);
 void          cpu_6502_inspect(struct _6502* cpu);
 
 void          cpu_6502_push_stack(struct _6502* cpu, u8 value);
@@ -95,7 +113,19 @@ u8            cpu_6502_pop_stack(struct _6502* cpu);
 static struct flag u8_to_flag(u8 u) { return *(struct flag*)&u; }
 static u8 flag_to_u8(struct flag f) { return *(u8*)&f; }
 
-// in 6502.c
-extern const u8 cycles[0x100];
+// addressing modes, as named in the comments of 6502.c
+enum cpu_mode {
+  MODE_IMP, MODE_IMM, MODE_ZP, MODE_ZPX, MODE_ZPY, MODE_IZX, MODE_IZY,
+  MODE_ABS, MODE_ABX, MODE_ABY, MODE_IND, MODE_REL
+};
+
+// in 6502.c, "???" and MODE_IMP for opcodes that aren't implemented
+extern const u8   cycles[0x100];
+extern const char opcode_names[0x100][4];
+extern const u8   opcode_modes[0x100];
+
+// instruction length in bytes, and a line of assembly like "LDA ($20),Y"
+u32           cpu_6502_length(u8 op);
+int           cpu_6502_disassemble(const u8* bytes, u16 pc, char* buf, size_t size);
 
 #endif /* _6502_H */
@@ -27,23 +27,98 @@
 
 struct NES;
 
+#define APU_CPU_CLOCK   1789773   // NTSC
+#define APU_SAMPLE_RATE 44100
+#define APU_SAMPLES     4096      // about 5 frames worth
+
+struct apu_envelope {
+  bool start;
+  bool loop;         // also the length counter halt flag
+  bool constant;
+  u8   volume;       // constant volume, or the divider period
+  u8   divider;
+  u8   decay;
+};
+
+struct apu_pulse {
+  bool enabled;
+  u8   duty;
+  u8   step;         // position in the duty sequence
+  u16  period;
+  u16  timer;
+  u8   length;
+
+  struct apu_envelope env;
+
+  bool sweep_enabled;
+  bool sweep_negate;
+  bool sweep_reload;
+  u8   sweep_period;
+  u8   sweep_shift;
+  u8   sweep_divider;
+};
+
+struct apu_triangle {
+  bool enabled;
+  bool control;      // halts the length counter, reloads the linear counter
+  u8   step;
+  u16  period;
+  u16  timer;
+  u8   length;
+  u8   linear;
+  u8   linear_reload;
+  bool linear_start;
+};
+
+struct apu_noise {
+  bool enabled;
+  bool mode;         // short (93 step) sequence
+  u16  shift;        // 15 bit LFSR
+  u16  period;
+  u16  timer;
+  u8   length;
+
+  struct apu_envelope env;
+};
+
+// plain data, so it can be saved and copied as is
 struct apu_registers {
-  int placeholder;
+  struct apu_pulse    pulse[2];
+  struct apu_triangle triangle;
+  struct apu_noise    noise;
+
+  bool five_step;    // $4017 bit 7
+  bool irq_inhibit;  // $4017 bit 6
+  bool frame_irq;    // $4015 bit 6, raised at the end of each 4 step sequence
+  u32  frame_cycle;
+  bool odd;          // pulse and noise timers tick every other CPU cycle
+  u32  sample_phase;
 };
 
 struct APU {
   struct apu_registers r;
 
+  // skip the channel timers and sampling, only the frame counter (and with
+  // it the length counters visible through $4015) keeps running
+  bool suppress_output;
+
+  // signed 16 bit mono at APU_SAMPLE_RATE, the consumer resets sample_count
+  s16 samples[APU_SAMPLES];
+  u32 sample_count;
+
   struct NES* nes;
 };
 
 // functions
-struct APU*   apu_create(struct NES* nes);
-void          apu_free(struct APU* apu);
+void          apu_init(struct APU* apu, struct NES* nes);
 void          apu_powerup(struct APU* apu);
 void          apu_reset(struct APU* apu);
 
 void          apu_tick(struct APU* apu);
+void          apu_run(struct APU* apu, u32 cycles);
+u32           apu_cycles_to_event(struct APU* apu);
+void          apu_write(struct APU* apu, u16 addr, u8 val);
+u8            apu_read_status(struct APU* apu);
 void          apu_inspect(struct APU* apu);
 
 #endif /* _APU_H */
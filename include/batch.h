@@ -0,0 +1,100 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* lockstep emulation of many instances of the same ROM */
+
+#pragma once
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "def.h"
+
+struct NES;
+
+/*
+  Instances started from the same state and fed similar input tend to
+  execute the same instruction at the same time for long stretches. A batch
+  keeps the CPU registers of N such instances as structure of arrays and,
+  each step, decodes the instruction at the first running lane's PC once
+  and executes it for every lane at that PC in one pass over the arrays
+  (see the kernels in batch.c, written so the compiler can vectorize them).
+
+  Lanes that diverged form further groups in the same round. Small groups
+  (under 1/8 of the batch), lanes with an interrupt pending or a trace
+  buffer attached, and instructions without a kernel (I/O, operands that
+  may be outside of RAM, indirect addressing, RTI, BRK, the unofficial
+  opcodes) take a normal scalar step through nes_tick instead; a group
+  without a kernel all at once. Kernel steps feed the profiler and the
+  instrument.h counters like scalar ones do, trace records are left to the
+  scalar steps since they need the PPU position. Results are the same as
+  running every instance by itself.
+
+  All instances must share one ROM image, so equal PCs in the same bank
+  mean equal instruction bytes.
+*/
+
+struct batch {
+  u32 count;
+  struct NES** nes;        // borrowed
+
+  // register file, only valid during batch_run_frame
+  u8*  a;
+  u8*  x;
+  u8*  y;
+  u8*  sp;
+  u8*  p;                  // status flags as pushed by PHP
+  u16* pc;
+
+  const u8** code;         // instruction bytes at each lane's PC, or NULL
+  u8*  group;              // 1 for lanes taking the vector step
+  u32* slot;               // bucket of each lane's code in keys/sizes
+  const u8** keys;         // distinct code pointers of the round,
+  u32* sizes;              // hashed, and how many lanes share each
+  u32  buckets;            // power of two, at least twice count
+  u8*  stepped;            // 1 for lanes that already ran this round
+  u8*  running;            // 1 until the lane finished its frame
+  u32* frame;              // PPU frame each lane started in
+  u8** ram;                // each lane's lowmem
+  u8*** banks;             // each lane's CPU page table (mapper rom_banks)
+
+  // The PPU and APU of a lane only catch up once they reach an event the
+  // CPU could notice (ppu_2C02_dots_to_event, apu_cycles_to_event), or
+  // before a scalar step
+  u32* pending;            // CPU cycles not yet run by the PPU and APU
+  u32* until;              // PPU dots until the next event
+
+  // scratch of a kernel step
+  u8*  val;                // operand
+  u16* addr;               // its offset in lowmem, for memory operands
+  u8*  extra;              // cycles on top of cycles[], 0 between steps
+  u16* at;                 // PC before the step, for the profiler
+  bool hooked;             // some lane has a profiler attached
+  u32  ram_ops;            // RAM reads and writes per lane, for instrument.h
+
+  u64 vector_steps;        // lane instructions run by the kernels
+  u64 scalar_steps;        // and by nes_tick
+};
+
+// functions
+struct batch* batch_create(struct NES** nes, u32 count);
+void          batch_free(struct batch* b);
+
+void          batch_run_frame(struct batch* b);
+
+#endif /* _BATCH_H */
@@ -0,0 +1,68 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* headless runner for blargg's test ROMs */
+
+#pragma once
+
+#ifndef _BLARGG_H
+#define _BLARGG_H
+
+#include "def.h"
+
+struct NES;
+
+/*
+  blargg's tests report through PRG RAM: once $6001 - $6003 hold the
+  signature DE B0 61, $6000 is the status ($80 while running, $81 asking
+  for a reset in 100ms or more, anything below $80 the final result, 0 for
+  passed) and $6004 on is a zero terminated text of what it printed.
+
+  The runner only looks at PRG RAM once a frame, with nothing drawn or
+  traced, until the test reports a result, the CPU stops or max_frames
+  frames have passed.
+*/
+
+#define BLARGG_TEXT 1024
+
+// zeroed results read as not run, a ROM no thread got to can't pass
+enum blargg_outcome {
+  BLARGG_NOT_RUN,
+  BLARGG_DONE,         // the test reported a result code
+  BLARGG_NO_SIGNATURE, // never wrote the signature
+  BLARGG_STOPPED,      // the CPU stopped (an unimplemented opcode)
+  BLARGG_TIMEOUT,
+  BLARGG_LOAD_FAILED
+};
+
+struct blargg_result {
+  const char* path;    // set by the caller for blargg_run_files
+  enum blargg_outcome outcome;
+  u8 code;             // $6000 at the end
+  u32 frames;
+  char text[BLARGG_TEXT];
+};
+
+// functions
+void          blargg_run(struct NES* nes, u32 max_frames, struct blargg_result* r);
+void          blargg_run_files(struct blargg_result* results, u32 count, u32 max_frames,
+                               u32 threads);
+bool          blargg_passed(struct blargg_result* r);
+const char*   blargg_describe(struct blargg_result* r);
+
+#endif /* _BLARGG_H */
@@ -0,0 +1,52 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* standard controllers on $4016 / $4017 */
+
+#pragma once
+
+#ifndef _CONTROLLER_H
+#define _CONTROLLER_H
+
+#include "def.h"
+
+struct NES;
+
+// in the order the shift register reports them
+enum controller_button {
+  BUTTON_A      = 1 << 0,
+  BUTTON_B      = 1 << 1,
+  BUTTON_SELECT = 1 << 2,
+  BUTTON_START  = 1 << 3,
+  BUTTON_UP     = 1 << 4,
+  BUTTON_DOWN   = 1 << 5,
+  BUTTON_LEFT   = 1 << 6,
+  BUTTON_RIGHT  = 1 << 7
+};
+
+/*
+  Writing 1 to bit 0 of $4016 (strobe) keeps reloading both shift registers
+  from the buttons held (nes->input), writing 0 freezes them. Each read of
+  $4016 (controller 1) or $4017 (controller 2) returns the next button in
+  bit 0, then 1s once all 8 were read. Bit 6 is open bus, usually set.
+*/
+
+// functions
+void          controller_write(struct NES* nes, u8 val);
+u8            controller_read(struct NES* nes, u8 port);
+
+#endif /* _CONTROLLER_H */
@@ -0,0 +1,80 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* copy-on-write pages shared between an instance and its forks */
+
+#pragma once
+
+#ifndef _COW_H
+#define _COW_H
+
+#include "def.h"
+
+#define COW_PAGE_SIZE 0x400
+
+// every page an instance can share, by region
+enum cow_pages {
+  COW_SRAM  = 0,       // 8 pages of PRG RAM
+  COW_VRAM  = 8,       // 4 nametables
+  COW_CHR   = 12,      // 8 pages of CHR RAM, only bound on CHR RAM boards
+  COW_PAGES = 20
+};
+
+struct cow_page {
+  u32 refs;
+  u8 data[COW_PAGE_SIZE];
+};
+
+/*
+  The 1K pages of SRAM, VRAM and CHR RAM are read through page pointers
+  (mapper sram_pages, PPU vram_pages, ROM chr_ram_banks). Normally these
+  point into the instance's own arena. cow_share moves the pages of a
+  parent into refcounted blocks and points a child's pages at the same
+  blocks. The first write to a shared page copies it back into the writer's
+  own storage (cow_write), so forks only ever copy what diverges.
+
+  Refcounts are atomic: forks may run on other threads, but a parent has to
+  be forked from one thread at a time.
+*/
+struct cow {
+  u8** slot[COW_PAGES];               // the page pointer reads go through
+  u8*  own[COW_PAGES];                // this instance's storage for it
+  struct cow_page* shared[COW_PAGES]; // or NULL if the page isn't shared
+  u32  count;                         // number of shared pages
+
+  // As every write goes through here anyway, pages are also marked dirty,
+  // so nes_state_hash only rehashes what changed since it last ran
+  u32  dirty;                         // bit per page
+  u64  hash[COW_PAGES];               // of the pages that aren't dirty
+};
+
+// functions
+void          cow_bind(struct cow* c, u32 page, u8** slot, u8* own);
+void          cow_share(struct cow* parent, struct cow* child);
+void          cow_unshare(struct cow* c, u32 page, bool copy);
+void          cow_release(struct cow* c);
+
+// the page, made private first if it was shared
+static inline u8* cow_write(struct cow* c, u32 page)
+{
+  c->dirty |= 1u << page;
+
+  if(c->shared[page]) cow_unshare(c, page, true);
+  return *c->slot[page];
+}
+
+#endif /* _COW_H */
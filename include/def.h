@@ -33,12 +33,21 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+typedef int16_t  s16;
+
 // 6502 is little endian
 static u16 create_u16(u8 lsb, u8 msb) { return (msb << 8) | lsb ; }
 
-#define LOGF(...)                                                       \
-  printf("%s:%d\t%-20s\t", __FILE__, __LINE__, __func__);               \
-  printf( __VA_ARGS__);                                                 \
-  printf("\n");
+// the library is built quiet, embedders don't want our stdout
+#ifdef NESTORAMA_QUIET
+#define LOGF(...) do { } while(0)
+#else
+// on stderr, stdout is left to traces and results other programs read
+#define LOGF(...) do {                                                  \
+    fprintf(stderr, "%s:%d\t%-20s\t", __FILE__, __LINE__, __func__);    \
+    fprintf(stderr, __VA_ARGS__);                                       \
+    fprintf(stderr, "\n");                                              \
+  } while(0)
+#endif
 
 #endif /* _DEF_H */
@@ -0,0 +1,98 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* checking the instruction trace against a golden log such as nestest.log */
+
+#pragma once
+
+#ifndef _GOLDEN_H
+#define _GOLDEN_H
+
+#include <stdio.h>
+
+#include "def.h"
+#include "tracebuf.h"
+
+struct NES;
+
+/*
+  The log is mapped and read a line at a time as trace records arrive
+  through golden_flush (the flush callback of a tracebuf), nothing is
+  formatted while they agree. Compared on every line are PC, the
+  instruction bytes, A, X, Y, P (but for bit 4, which isn't stored in the
+  register) and SP, and the CPU cycle count in logs that have one ("PPU:
+  sl,dot CYC:n", not the older "CYC:dot SL:n"). Cycles are counted from the
+  log's first line, whose PC is also where the run should start.
+
+  The first difference, the end of the log or a line that can't be parsed
+  stops the NES; golden_report then prints the lines leading up to it from
+  both the log and the trace. Records are only compared once flushed, so
+  for the NES to stop right at the difference the tracebuf should hold a
+  single record.
+*/
+
+#define GOLDEN_CONTEXT 8
+
+struct golden_line {
+  u16 pc;
+  u8  op[3];
+  u8  length;
+  u8  a, x, y, p, sp;
+  bool has_cycles;
+  u32 cycles;
+};
+
+enum golden_field {
+  GOLDEN_PC     = 1 << 0,
+  GOLDEN_BYTES  = 1 << 1,
+  GOLDEN_A      = 1 << 2,
+  GOLDEN_X      = 1 << 3,
+  GOLDEN_Y      = 1 << 4,
+  GOLDEN_P      = 1 << 5,
+  GOLDEN_SP     = 1 << 6,
+  GOLDEN_CYCLES = 1 << 7,
+  GOLDEN_PARSE  = 1 << 8   // the log line isn't in the expected format
+};
+
+struct golden {
+  const char* path;
+  const char* data;    // the mapped log
+  size_t size;
+  size_t pos;          // start of the next line
+
+  struct NES* nes;
+  struct golden_line first;
+  bool started;
+  u32 cycle_offset;    // log cycles - trace cycles
+
+  u64 lines;           // lines that matched
+  bool finished;       // every line of the log matched
+  u32 mismatch;        // enum golden_field bits of the first difference
+
+  // the last GOLDEN_CONTEXT lines on both sides, the difference last
+  size_t recent_pos[GOLDEN_CONTEXT];
+  struct trace_record recent[GOLDEN_CONTEXT];
+};
+
+// functions
+struct golden* golden_open(const char* path, struct NES* nes);
+void           golden_close(struct golden* g);
+void           golden_flush(struct tracebuf* t, void* ctx);
+bool           golden_report(struct golden* g, FILE* fp);
+
+#endif /* _GOLDEN_H */
@@ -0,0 +1,77 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* hashing of emulator memory */
+
+#pragma once
+
+#ifndef _HASH_H
+#define _HASH_H
+
+#include "def.h"
+
+#include <stddef.h>
+
+#define HASH_SEED  0xCBF29CE484222325ull
+#define HASH_PRIME 0x9E3779B97F4A7C15ull
+
+/*
+  A fast 64 bit hash, used to compare machine states between runs, builds
+  and hosts. Words are read little endian whatever the host, so the value
+  only depends on the bytes. Four independent lanes keep the multipliers
+  busy; the tail and the lanes are folded in at the end.
+*/
+
+static inline u64 hash_load64(const u8* p)
+{
+  return (u64)p[0]       | (u64)p[1] << 8  | (u64)p[2] << 16 | (u64)p[3] << 24 |
+         (u64)p[4] << 32 | (u64)p[5] << 40 | (u64)p[6] << 48 | (u64)p[7] << 56;
+}
+
+static inline u64 hash_mix(u64 h, u64 v)
+{
+  h = (h ^ v) * HASH_PRIME;
+  return h ^ (h >> 29);
+}
+
+// continue a hash by passing it as seed
+static inline u64 hash_bytes(const void* data, size_t size, u64 seed)
+{
+  const u8* p = data;
+  u64 lane[4] = { seed, seed + 1, seed + 2, seed + 3 };
+  size_t i = 0;
+
+  for(; i + 32 <= size; i += 32) {
+    for(int k = 0; k < 4; ++k)
+      lane[k] = hash_mix(lane[k], hash_load64(p + i + 8 * k));
+  }
+
+  u64 h = hash_mix(seed, size);
+
+  for(int k = 0; k < 4; ++k)
+    h = hash_mix(h, lane[k]);
+
+  for(; i + 8 <= size; i += 8)
+    h = hash_mix(h, hash_load64(p + i));
+
+  for(; i < size; ++i)
+    h = hash_mix(h, p[i]);
+
+  return h;
+}
+
+#endif /* _HASH_H */
@@ -0,0 +1,75 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Log-linear histograms, for latencies and other values with long tails */
+
+#pragma once
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdio.h>
+
+#include "def.h"
+
+/*
+  HDR style buckets over all of u64: values below 2^(HIST_BITS + 1) each
+  get their own, above that every power of two is split into 2^HIST_BITS
+  equal buckets. A bucket is then never wider than 1 / 2^HIST_BITS of its
+  values (3% with 5 bits), recording is a bit scan and an add, and the
+  size is fixed (15K), so histograms can live in the hot loop for hours.
+*/
+#define HIST_BITS    5
+#define HIST_SUB     (1 << HIST_BITS)
+#define HIST_BUCKETS ((65 - HIST_BITS) << HIST_BITS)
+
+struct histogram {
+  u64 count[HIST_BUCKETS];
+  u64 total;           // values recorded
+  u64 min, max;
+  double sum;
+};
+
+// functions
+void histogram_clear(struct histogram* h);
+u64  histogram_percentile(const struct histogram* h, double percent);
+void histogram_print(const struct histogram* h, FILE* fp, const char* name, const char* unit,
+                     double scale);
+
+static inline u32 histogram_bucket(u64 value)
+{
+  if(value < HIST_SUB) return value;
+
+  u32 magnitude = 63 - __builtin_clzll(value);   // >= HIST_BITS
+  u32 shift = magnitude - HIST_BITS;
+
+  return ((shift + 1) << HIST_BITS) + (u32)(value >> shift) - HIST_SUB;
+}
+
+static inline void histogram_record(struct histogram* h, u64 value)
+{
+  ++h->count[histogram_bucket(value)];
+
+  if(!h->total || value < h->min) h->min = value;
+  if(value > h->max) h->max = value;
+
+  ++h->total;
+  h->sum += value;
+}
+
+#endif /* _HISTOGRAM_H */
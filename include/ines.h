@@ -25,9 +25,7 @@
 
 #include "def.h"
 
-struct NES;
-struct mapper;
-struct ROM;
+struct rom_image;
 
 /*
   Header (16 bytes)
@@ -63,9 +61,9 @@ struct iNES_ROM_header {
   // remainder of 16 bit header is left zero filled
 };
 
-static u8 INES_HEADER[4] = { 0x4E, 0x45, 0x53, 0x1A };
+static const u8 INES_HEADER[4] = { 0x4E, 0x45, 0x53, 0x1A };
 
 // functions
-struct ROM*      ines_rom_load_file(FILE* f, struct ROM* nes);
+struct rom_image* ines_image_load_buffer(const u8* buf, u32 size, struct rom_image* img);
 
 #endif /* _INES_H */
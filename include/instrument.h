@@ -0,0 +1,139 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Host side instrumentation, where the emulator's own time goes */
+
+#pragma once
+
+#ifndef _INSTRUMENT_H
+#define _INSTRUMENT_H
+
+#include "def.h"
+#include "perf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+  Built with -DNESTORAMA_INSTRUMENT (make instrument, which builds
+  nestorama-instrument), every NES times its subsystems and counts what
+  they do, frame by frame. Otherwise INST(...) drops its argument, so none
+  of it is compiled in, not even the fields.
+
+  Timers read the time stamp counter where there is one and the monotonic
+  clock elsewhere; at the end of each frame they are scaled to nanoseconds
+  by clock_gettime over the whole frame. With inst.out set, each frame is
+  then written as one JSON line:
+
+  {"frame":60,"ns":{"frame":N,"cpu":N,"ppu":N,"apu":N,"dma":N},
+   "count":{"instructions":N,"bus_ram":N,"bus_ppu":N,...}}
+
+  With inst.perf set to an open struct perf, its hardware counters are
+  read along with every timer, so they are split up the same way:
+
+  "perf":{"frame":{"instructions":N,"cycles":N,"branch_misses":N,...},
+          "cpu":{...},"ppu":{...},"apu":{...},"dma":{...}}
+
+  leaving out the counters that couldn't be opened.
+
+  CPU time (and counts) include its bus calls and OAM DMA, which is also
+  timed on its own. The first, partial frame isn't written.
+*/
+#ifdef NESTORAMA_INSTRUMENT
+#define INST(...) __VA_ARGS__
+#else
+#define INST(...)
+#endif
+
+enum instrument_timer {
+  INST_TIME_CPU,
+  INST_TIME_PPU,
+  INST_TIME_APU,
+  INST_TIME_DMA,
+  INST_TIMERS
+};
+
+enum instrument_count {
+  INST_INSTRUCTIONS,
+  INST_BUS_RAM,        // CPU reads and writes of $0000 - $1FFF
+  INST_BUS_PPU,        // $2000 - $3FFF
+  INST_BUS_APU,        // $4000 - $4017, controllers included
+  INST_BUS_CART,       // $4018 - $FFFF
+  INST_SCANLINES,      // rendered, background or sprites on
+  INST_APU_SYNCS,      // times the APU caught up with the CPU
+  INST_BANK_SWITCHES,  // PRG and CHR
+  INST_DMA,            // OAM DMA transfers
+  INST_COUNTS
+};
+
+struct instrument {
+  u64 time[INST_TIMERS];     // in ticks until the frame ends
+  u64 count[INST_COUNTS];
+
+  u32 frame;
+  u64 start_ticks;           // when the frame started
+  u64 start_ns;
+
+  FILE* out;                 // JSON lines go here if set
+
+  struct perf* perf;         // hardware counters, or NULL
+  u64 perf_time[INST_TIMERS][PERF_COUNTERS];
+  u64 perf_start[PERF_COUNTERS];
+};
+
+// where the current phase started, see instrument_lap
+struct instrument_mark {
+  u64 ticks;
+  u64 perf[PERF_COUNTERS];
+};
+
+// functions
+u64  instrument_clock(void);
+void instrument_frame(struct instrument* inst, u32 frame);
+void instrument_perf_lap(struct instrument* inst, enum instrument_timer timer,
+                         struct instrument_mark* m);
+
+static inline u64 instrument_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return instrument_clock();
+#endif
+}
+
+static inline void instrument_mark(struct instrument* inst, struct instrument_mark* m)
+{
+  m->ticks = instrument_ticks();
+  if(inst->perf) perf_read(inst->perf, m->perf);
+}
+
+// adds everything since m to timer, m moves on to now
+static inline void instrument_lap(struct instrument* inst, enum instrument_timer timer,
+                                  struct instrument_mark* m)
+{
+  u64 now = instrument_ticks();
+
+  inst->time[timer] += now - m->ticks;
+  m->ticks = now;
+
+  if(inst->perf) instrument_perf_lap(inst, timer, m);
+}
+
+#endif /* _INSTRUMENT_H */
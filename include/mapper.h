@@ -24,32 +24,22 @@
 #define _MAPPER_H_
 
 #include "def.h"
+#include "instrument.h"
 
 struct ROM;
 struct NES;
 
 #define NUM_BANKS 8
+#define MAPPER_STATE_SIZE 64
 static const int ROM_BANK_SIZE = 0x2000;
 static const int VROM_BANK_SIZE = 0x0400;
 
-// for MMC1
-struct mmc1_data {
-  u8 write_count;
-  u8 chr_mode;
-  u8 reg_cache;
-  u8 regs[4];
-};
-
-// registers and data values that may be specific to a mapper
-union mapper_data {
-  struct mmc1_data mmc1;
-};
-
 // all bit representations are 7   ->  0
 enum rom_mapper {
   NROM = 0,
   MMC1 = 1,
   CNROM = 3,
+  MMC3 = 4,
 
   /* Any write to 0x8000 - 0xFFFF:
     xxxM xPPP
@@ -59,28 +49,124 @@ enum rom_mapper {
   AXROM = 7
 };
 
+struct mapper;
+
+/*
+  Each supported board provides one of these, see src/mappers/. Only init and
+  write are required, the rest may be NULL.
+
+  Registers and other per board data live in the mapper's state block (the
+  first state_size bytes of map->state), which has to be plain data: no
+  pointers, so it can be saved and copied as is.
+*/
+struct mapper_ops {
+  enum rom_mapper num;
+  const char* name;
+  u32 state_size;
+
+  // set up power on banking
+  void (*init)(struct mapper* map);
+
+  // CPU write to 0x8000 - 0xFFFF
+  void (*write)(struct mapper* map, u16 addr, u8 val);
+
+  // CPU read of 0x8000 - 0xFFFF, if NULL the bank table is read directly
+  u8   (*read)(struct mapper* map, u16 addr);
+
+  // once per rendered scanline
+  void (*scanline)(struct mapper* map);
+
+  // copy board state (state_size bytes) out of, or into if restore, buf and
+  // return the bytes used. Restoring also redoes the banking. If NULL, only
+  // the state block is copied, which is enough without bank switching.
+  u32  (*serialize)(struct mapper* map, u8* buf, bool restore);
+};
+
 struct mapper {
+  const struct mapper_ops* ops;
   enum rom_mapper num;
 
-  u8 sram[0x2000];
+  u8* rom_banks[NUM_BANKS];    // CPU page table, 8K pages of 0x0000 - 0xFFFF
+  u8* vrom_banks[NUM_BANKS];   // PPU page table, 1K pages of 0x0000 - 0x1FFF
+
+  // every bank of the cartridge, see struct rom_image
+  u8** prg_table;
+  u32  prg_mask;
+  u32  prg_count;              // banks actually on the cartridge
+  u8** chr_table;
+  u32  chr_mask;
+  u32  chr_count;
+
+  u8 state[MAPPER_STATE_SIZE] __attribute__ ((aligned (8)));
 
-  union mapper_data data;
+  u8* sram_pages[8];           // 8K PRG RAM at 0x6000 in 1K pages, see cow.h
 
-  u8* rom_banks[NUM_BANKS];
-  u8* vrom_banks[NUM_BANKS];
+  // PRG RAM enable / write protect, set by boards that have them on every
+  // sync so they follow the state block
+  bool sram_enabled;
+  bool sram_writable;
+
+  INST(u64 bank_switches;)     // since the NES last collected them
 
   struct ROM* rom;
 };
 
 // functions
-struct mapper* mapper_create(struct ROM* rom);
-void           mapper_free(struct mapper* map);
+const struct mapper_ops* mapper_find(enum rom_mapper num);
+
+void           mapper_init(struct mapper* map, struct ROM* rom, u8* sram);
 
 void           mapper_init_banks(struct mapper* map);
-void           mapper_set_rom_bank(struct mapper* map, u16 index, u16 addr, u16 size);
-void           mapper_set_vrom_bank(struct mapper* map, u16 index, u16 addr, u16 size);
 
 u8             mapper_fetch_memory(struct mapper* map, u16 addr);
 void           mapper_set_memory(struct mapper* map, u16 addr, u8 val);
+void           mapper_scanline(struct mapper* map);
+u32            mapper_serialize(struct mapper* map, u8* buf, bool restore);
+
+u8*            mapper_chr_ram(struct mapper* map, u16 addr);
+void           mapper_move_chr(struct mapper* map, u8* from, u8* to);
+
+/*
+  Bank switching. Maps bank `index` (counted in units of size, negative
+  values count from the last of the `banks` banks of page_size the
+  cartridge really has) to addr - addr + size. With the bank tables built
+  at load time this is just a few pointer stores, so boards may call it on
+  every register write.
+*/
+static inline void mapper_set_pages(u8** pages, u8** table, u32 mask, u32 banks,
+                                    u32 page_size, int index, u16 addr, u16 size)
+{
+  u32 count = size / page_size, page = addr / page_size;
+
+  // count back from the real last bank, the table is padded past it
+  if(index < 0) index += banks / count;
+
+  u32 first = (u32)index * count;
+
+  for(u32 i = 0; i < count && page + i < NUM_BANKS; ++i) {
+    pages[page + i] = table[(first + i) & mask];
+  }
+}
+
+static inline void mapper_set_rom_bank(struct mapper* map, int index, u16 addr, u16 size)
+{
+  INST(++map->bank_switches);
+  mapper_set_pages(map->rom_banks, map->prg_table, map->prg_mask, map->prg_count,
+                   ROM_BANK_SIZE, index, addr, size);
+}
+
+static inline void mapper_set_vrom_bank(struct mapper* map, int index, u16 addr, u16 size)
+{
+  INST(++map->bank_switches);
+  mapper_set_pages(map->vrom_banks, map->chr_table, map->chr_mask, map->chr_count,
+                   VROM_BANK_SIZE, index, addr, size);
+}
+
+// in src/mappers/
+extern const struct mapper_ops nrom_ops;
+extern const struct mapper_ops mmc1_ops;
+extern const struct mapper_ops cnrom_ops;
+extern const struct mapper_ops mmc3_ops;
+extern const struct mapper_ops axrom_ops;
 
 #endif /* _MAPPER_H_ */
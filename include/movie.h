@@ -0,0 +1,93 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* input movies: recorded controller input, replayed deterministically */
+
+#pragma once
+
+#ifndef _MOVIE_H
+#define _MOVIE_H
+
+#include "def.h"
+
+struct NES;
+struct rom_image;
+
+/*
+  A movie starts at power on and holds, for every frame, the buttons held on
+  both controllers and the hash of the whole machine state after the frame
+  (nes_state_hash). Playback feeds the same input and stops at the first
+  frame whose hash differs, so a desync is caught on the frame it happens.
+
+  With a checkpoint interval K, a save state is also kept every K frames
+  (the state before frame K, 2K, ...), so long movies can be verified as
+  independent segments in parallel, see verify.h.
+
+  File format, multi byte values little endian:
+
+  OFFSET  SIZE    DESCRIPTION
+  0x0000  4       magic, "NMV\x1a"
+  0x0004  2       format version (MOVIE_VERSION)
+  0x0006  2       state format version the hashes were made with
+  0x0008  8       hash of the PRG and CHR ROM
+  0x0010  4       number of frames
+  0x0014  4       checkpoint interval K, 0 for none
+  0x0018  10 * n  frames: controller 1, controller 2, state hash (8)
+
+  only with K > 0:
+          4       number of checkpoints (c)
+          c *     frame number (4, increasing, above 0), state size (4), save state
+*/
+
+#define MOVIE_MAGIC   "NMV\x1a"
+#define MOVIE_VERSION 3
+
+struct movie_frame {
+  u8  input[2];
+  u64 hash;
+};
+
+struct movie_checkpoint {
+  u32 frame;           // frames run before the state was taken
+  u32 size;
+  u8* state;
+};
+
+struct movie {
+  u64 rom_hash;
+  u32 frames;
+  u32 capacity;
+  struct movie_frame* frame;
+
+  u32 interval;        // checkpoint every this many frames, or 0
+  u32 checkpoints;
+  struct movie_checkpoint* checkpoint;
+};
+
+// functions
+struct movie* movie_create(struct NES* nes, u32 interval);
+void          movie_free(struct movie* m);
+
+bool          movie_save(struct movie* m, FILE* fp);
+struct movie* movie_load(FILE* fp);
+
+void          movie_record_frame(struct movie* m, struct NES* nes);
+bool          movie_play(struct movie* m, struct NES* nes, u32* frames);
+
+u64           movie_rom_hash(struct rom_image* img);
+
+#endif /* _MOVIE_H */
@@ -24,12 +24,15 @@
 #define _NES_H
 
 #include "def.h"
+#include "instrument.h"
 
 struct _6502;
 struct _2C02;
 struct APU;
 struct mapper;
 struct ROM;
+struct rom_image;
+struct cow;
 
 /*
   NES' page size is 256 bytes. Total of 256 pages available. (0xFFFF bytes)
@@ -60,13 +63,11 @@ struct memory {
   u8 lowmem[0x800];     // 2K internal RAM   (CPU)
   u8 apureg[0x018];     // 18B APU registers (APU)
 
-  u8 sram[0x2000];      // 8K PRG RAM (Save RAM)
-
   u32 rom_size;
-  u8* rom;              // pointer to PRG ROM
+  u8* rom;              // pointer to PRG ROM (read only, shared ROM image)
 
   u32 vrom_size;
-  u8* vrom;             // pointer to CHR ROM
+  u8* vrom;             // pointer to CHR ROM (shared) or this NES' CHR RAM
 };
 
 struct NES {
@@ -76,20 +77,57 @@ struct NES {
   struct ROM* rom;
 
   bool is_active;       // true if currently running and not killed
+  bool owns_memory;     // allocated by nes_create, not placed by the caller
+
+  u8 input[2];          // buttons held on each controller, see controller.h
+  u8 strobe;            // bit 0 of the last $4016 write
+  u8 shift[2];          // controller shift registers
 
   struct memory* mem;
+  struct cow* cow;      // pages shared with forks
+
+  INST(struct instrument inst;)
 };
 
+/*
+  An instance is one allocation (see struct nes_arena in nes.c) holding the
+  NES and all of its chips, RAM, mapper and PRG / CHR RAM, hottest state
+  first: CPU registers, lowmem, the mapper's page tables and the PPU
+  registers share a handful of adjacent cache lines. Only the ROM image is
+  shared between instances.
+
+  nes_create_in places an instance into caller memory (hugepages, shared
+  memory, ...) of at least nes_instance_size() bytes, aligned to NES_ALIGN.
+  The memory is the caller's to free after nes_free.
+
+  nes_fork makes a new instance continuing from the current state of nes.
+  Registers, lowmem, OAM, palette and the mapper registers (a few K, and
+  written all the time) are copied; SRAM, nametables and CHR RAM pages are
+  shared copy-on-write (see cow.h) with the parent and its other forks.
+  The child's framebuffer and audio buffer start out empty, and it has no
+  observation ring, profiler or trace buffer attached. Forks are
+  independent instances, freed with nes_free in any order.
+*/
+#define NES_ALIGN 64
+
 // functions
+size_t        nes_instance_size(void);
 struct NES*   nes_create(void);
+struct NES*   nes_create_in(void* mem, size_t size);
+struct NES*   nes_fork(struct NES* nes);
 void          nes_free(struct NES* nes);
+void          nes_unshare(struct NES* nes);
 void          nes_powerup(struct NES* nes);
 void          nes_reset(struct NES* nes);
 
 bool          nes_load_rom(struct NES* nes, FILE* fp);
+bool          nes_load_rom_buffer(struct NES* nes, const u8* buf, u32 size);
+bool          nes_load_rom_image(struct NES* nes, struct rom_image* img);
 void          nes_run(struct NES* nes);
+void          nes_run_frame(struct NES* nes);
 
 void          nes_tick(struct NES* nes);
+INST(void     nes_instrument_frame(struct NES* nes);)
 void          nes_inspect(struct NES* nes);
 u8            nes_fetch_memory(struct NES* nes, u16 addr);
 void          nes_set_memory(struct NES* nes, u16 addr, u8 val);
@@ -0,0 +1,118 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* embedding API, built into libnestorama.so and libnestorama.a */
+
+#pragma once
+
+#ifndef _NESTORAMA_H
+#define _NESTORAMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NESTORAMA_API_VERSION 2
+
+#define NESTORAMA_WIDTH      256
+#define NESTORAMA_HEIGHT     240
+#define NESTORAMA_RAM_SIZE   0x800
+#define NESTORAMA_AUDIO_RATE 44100
+
+// controller buttons, bit 0 is the first one read from $4016
+enum nestorama_button {
+  NESTORAMA_A      = 1 << 0,
+  NESTORAMA_B      = 1 << 1,
+  NESTORAMA_SELECT = 1 << 2,
+  NESTORAMA_START  = 1 << 3,
+  NESTORAMA_UP     = 1 << 4,
+  NESTORAMA_DOWN   = 1 << 5,
+  NESTORAMA_LEFT   = 1 << 6,
+  NESTORAMA_RIGHT  = 1 << 7
+};
+
+/*
+  One emulated console. Nothing is shared between instances, and the library
+  keeps no global state and never writes to stdout or stderr, so instances
+  may be driven from different threads.
+
+  The buffers returned below are borrowed: they belong to the instance, stay
+  at the same address for its lifetime, and their contents describe the last
+  frame until the next nestorama_step_frame or nestorama_reset.
+*/
+struct nestorama;
+
+#ifdef NESTORAMA_BUILD
+#define NESTORAMA_EXPORT __attribute__ ((visibility ("default")))
+#else
+#define NESTORAMA_EXPORT
+#endif
+
+// an iNES image, copied; returns NULL if it can't be loaded
+NESTORAMA_EXPORT struct nestorama* nestorama_create(const void* rom, size_t size);
+NESTORAMA_EXPORT void              nestorama_destroy(struct nestorama* n);
+NESTORAMA_EXPORT void              nestorama_reset(struct nestorama* n);
+
+// runs one frame with the buttons held on controller 1, returns 0 once the
+// emulated CPU stopped (an unimplemented opcode), 1 otherwise
+NESTORAMA_EXPORT int               nestorama_step_frame(struct nestorama* n, uint8_t input);
+
+// NESTORAMA_WIDTH x NESTORAMA_HEIGHT NES color indices (0 - 63), row major
+NESTORAMA_EXPORT const uint8_t*    nestorama_framebuffer(struct nestorama* n);
+
+// the NESTORAMA_RAM_SIZE bytes of internal RAM at $0000
+NESTORAMA_EXPORT const uint8_t*    nestorama_ram(struct nestorama* n);
+
+// signed 16 bit mono samples at NESTORAMA_AUDIO_RATE made during the last
+// frame, their number is stored in count
+NESTORAMA_EXPORT const int16_t*    nestorama_audio(struct nestorama* n, size_t* count);
+
+// hash of the whole machine state (CPU, RAM, SRAM, PPU, APU, mapper), equal
+// for equal states; cheap enough to take every frame, since memory pages
+// are only rehashed after being written
+NESTORAMA_EXPORT uint64_t          nestorama_state_hash(struct nestorama* n);
+
+enum nestorama_observation {
+  NESTORAMA_GRAY,      // luma 0 - 255, area averaged
+  NESTORAMA_INDEX      // NES color index 0 - 63, point sampled
+};
+
+/*
+  Observations: each frame is also scaled down to width x height (at most
+  NESTORAMA_WIDTH x NESTORAMA_HEIGHT, e.g. 84 x 84) straight from the color
+  indices and written into ring, which needs nestorama_observation_size
+  bytes and stays owned by the caller. nestorama_observation then points
+  into the ring at the last depth frames, oldest first, as one contiguous
+  depth x height x width array. Frames not produced yet are zero.
+
+  nestorama_observe with a NULL ring detaches it. Returns 0 on bad sizes.
+*/
+NESTORAMA_EXPORT size_t            nestorama_observation_size(unsigned width, unsigned height,
+                                                              unsigned depth);
+NESTORAMA_EXPORT int               nestorama_observe(struct nestorama* n, uint8_t* ring,
+                                                     unsigned width, unsigned height,
+                                                     unsigned depth, int format);
+NESTORAMA_EXPORT const uint8_t*    nestorama_observation(struct nestorama* n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NESTORAMA_H */
@@ -0,0 +1,64 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* observations: small grayscale or palette index frames for agents */
+
+#pragma once
+
+#ifndef _OBS_H
+#define _OBS_H
+
+#include "def.h"
+#include "2C02.h"
+
+enum obs_format {
+  OBS_GRAY,            // luma, area averaged
+  OBS_INDEX            // NES color index of the sample nearest the center
+};
+
+/*
+  When attached to a PPU (ppu->obs), every finished frame is scaled down
+  from the indexed framebuffer into the next slot of a caller supplied ring,
+  at the start of vblank. No RGB is ever produced: gray levels come straight
+  from a 64 entry luma table.
+
+  The ring holds 2 * depth frames of width * height bytes (obs_ring_size).
+  Each frame is written twice, depth slots apart, so the last depth frames
+  are always contiguous, oldest first, at obs_stack(). Consumers can hand
+  that pointer on as a depth x height x width array without copying.
+*/
+struct obs {
+  u8* ring;
+  u32 depth;
+  u32 width, height;
+  u8  format;          // enum obs_format
+  u64 frames;          // frames written so far
+
+  u8  luma[64];
+  void (*luma_row)(const u8* luma, const u8* src, u8* dst); // best for this CPU
+  u16 x0[PPU_WIDTH + 1];   // first source column of each output column
+  u16 y0[PPU_HEIGHT + 1];  // and row, plus the end of the last one
+};
+
+// functions
+size_t        obs_ring_size(u32 width, u32 height, u32 depth);
+bool          obs_init(struct obs* o, u8* ring, u32 width, u32 height, u32 depth,
+                       enum obs_format format);
+void          obs_push(struct obs* o, const u8* framebuffer);
+const u8*     obs_stack(struct obs* o);
+
+#endif /* _OBS_H */
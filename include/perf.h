@@ -0,0 +1,57 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Hardware performance counters of the calling thread, via perf_event_open */
+
+#pragma once
+
+#ifndef _PERF_H
+#define _PERF_H
+
+#include "def.h"
+
+enum perf_counter {
+  PERF_INSTRUCTIONS,
+  PERF_CYCLES,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,     // L1 data cache read misses
+  PERF_LLC_MISSES,     // last level cache misses
+  PERF_COUNTERS
+};
+
+/*
+  Each counter is opened on its own, user space only, so whatever the CPU
+  (or VM, or perf_event_paranoid) doesn't allow is just missing. Where the
+  kernel lets us, counters are read with rdpmc through their mmap'd page,
+  a few dozen cycles, cheap enough to read around every phase of every
+  instruction; otherwise with a read() each.
+*/
+struct perf {
+  int   fd[PERF_COUNTERS];     // -1 if it couldn't be opened
+  void* page[PERF_COUNTERS];   // struct perf_event_mmap_page, or NULL
+  u32   count;                 // counters open
+};
+
+extern const char* const perf_names[PERF_COUNTERS];
+
+// functions
+u32  perf_open(struct perf* p);
+void perf_close(struct perf* p);
+void perf_read(struct perf* p, u64* values);
+
+#endif /* _PERF_H */
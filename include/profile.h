@@ -0,0 +1,80 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Guest profiler, where the emulated game spends its CPU cycles */
+
+#pragma once
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdio.h>
+
+#include "def.h"
+#include "mapper.h"
+
+struct NES;
+
+/*
+  Every instruction adds its cycles to a counter for its address, one per
+  byte of the address space below $8000 (RAM, SRAM) and one per address and
+  PRG bank above, so the same address in different banks is told apart:
+
+  INDEX                       ADDRESS
+  0x00000 - 0x07FFF           $0000 - $7FFF
+  0x08000 + 0x8000 * b + a    $8000 | a, with 8K PRG bank b mapped there
+
+  The table is allocated zeroed and only the parts a game runs get touched.
+  Attached to cpu->profile it costs one add per instruction, detached just
+  the check for it.
+*/
+
+struct profile {
+  u64* cycles;
+  u32  size;           // entries
+
+  const u8* prg;       // the ROM image the banks are counted in
+  u32  prg_size;
+
+  u64  total;          // updated by profile_report
+
+  struct NES* nes;
+};
+
+// a ROM has to be loaded, the table size depends on it
+struct profile* profile_create(struct NES* nes);
+void            profile_free(struct profile* p);
+void            profile_clear(struct profile* p);
+
+// hot loops, routines and instructions, at most top of each
+void            profile_report(struct profile* p, FILE* fp, u32 top);
+
+static inline void profile_count(struct profile* p, struct mapper* map, u16 pc, u32 cycles)
+{
+  u32 i = pc;
+
+  if(pc & 0x8000) {
+    // banks the mapper reads some other way are counted by address
+    u32 offset = (u32)(map->rom_banks[pc >> 13] - p->prg);
+    if(offset < p->prg_size) i = 0x8000 + (offset >> 13 << 15) + (pc & 0x7FFF);
+  }
+
+  p->cycles[i] += cycles;
+}
+
+#endif /* _PROFILE_H */
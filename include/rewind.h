@@ -0,0 +1,78 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/* rewinding through a ring buffer of save state deltas */
+
+#pragma once
+
+#ifndef _REWIND_H
+#define _REWIND_H
+
+#include "def.h"
+
+struct NES;
+
+/*
+  The newest snapshot is kept as a full save state. Every older snapshot is
+  only stored as the XOR of itself with the snapshot after it, run length
+  encoded (see rewind.c). Between adjacent frames almost all of RAM, PRG
+  RAM and CHR RAM is unchanged, so those deltas are mostly zero and tend to
+  pack down to a few hundred bytes.
+
+  Stepping back XORs the newest delta into the full state and drops it.
+  When the budget runs out the oldest deltas are dropped first.
+*/
+
+struct rewind_entry {
+  u32 offset;          // into ring
+  u32 size;            // compressed size
+};
+
+struct rewind {
+  struct NES* nes;
+
+  u32 interval;        // frames between snapshots
+  u32 frames;          // frames since the last snapshot
+
+  u32 state_size;
+  bool have_current;
+  u8* current;         // newest snapshot, a full save state
+  u8* next;            // scratch for the snapshot being taken
+  u8* packed;          // scratch for its compressed delta
+
+  u8* ring;            // compressed deltas, oldest get overwritten
+  u32 ring_size;
+  u32 write_pos;
+
+  struct rewind_entry* entries; // circular, oldest at first
+  u32 max_entries;
+  u32 first;
+  u32 count;
+};
+
+// functions
+struct rewind* rewind_create(struct NES* nes, u32 budget, u32 interval);
+void           rewind_free(struct rewind* rw);
+void           rewind_clear(struct rewind* rw);
+
+void           rewind_push(struct rewind* rw);
+bool           rewind_step_back(struct rewind* rw);
+u32            rewind_frames_available(struct rewind* rw);
+
+#endif /* _REWIND_H */
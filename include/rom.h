@@ -30,6 +30,13 @@ struct mapper;
 enum rom_type { INES, NSF, NES2 };
 enum rom_format { NTSC, PAL };
 
+// where the bytes of the ROM image live
+enum rom_storage {
+  ROM_BORROWED, // caller owned buffer, must outlive the image
+  ROM_MAPPED,   // read only, private mmap of the ROM file
+  ROM_HEAP      // malloc'd copy (unmappable files, patched borrowed buffers)
+};
+
 // some generic ROM header information
 struct rom_header {
   enum rom_type type;
@@ -40,18 +47,61 @@ struct rom_header {
   u8 chr_rom_count; // blocks of CHR ROM (8KB units)
 
   bool has_prg_ram; // has 0x2000 bytes of SRAM at 0x6000
+
+  u8 mirroring;     // enum ppu_mirroring, boards with a mapper may change it
+};
+
+// The immutable part of a cartridge. Reference counted, so any number of NES
+// instances running the same game can share one copy of PRG and CHR ROM.
+struct rom_image {
+  u32 refs;
+
+  struct rom_header hdr;
+
+  // the whole file image, PRG ROM and CHR ROM point into this
+  u8* data;
+  u32 data_size;
+  enum rom_storage storage;
+
+  u32 prg_size;
+  const u8* prg;
+
+  u32 chr_size;         // 0 for boards with CHR RAM
+  const u8* chr;
+
+  const u8* trainer;    // 512 bytes loaded to 0x7000, or NULL
+
+  // Base of every 8K PRG / 1K CHR bank, built once at load. Entry counts are
+  // rounded up to a power of two (the extra entries mirror), so a bank
+  // number only needs masking.
+  u8** prg_banks;
+  u32  prg_mask;
+  u8** chr_banks;       // NULL for boards with CHR RAM
+  u32  chr_mask;
 };
 
+// A cartridge plugged into one NES, only holds per instance state
 struct ROM {
   struct rom_header hdr;
 
+  struct rom_image* img;
+  u8* chr_ram;          // 8K CHR RAM for boards without CHR ROM, or NULL
+  u8* chr_ram_banks[8]; // bank table over chr_ram
+
   struct mapper* map;
   struct NES* nes;
 };
 
 // functions
-struct ROM* rom_load_file(FILE* f, struct NES* nes);
-void        rom_free(struct ROM* rom);
+struct rom_image* rom_image_load_file(FILE* f);
+struct rom_image* rom_image_load_buffer(const u8* buf, u32 size);
+struct rom_image* rom_image_retain(struct rom_image* img);
+void              rom_image_release(struct rom_image* img);
+bool              rom_image_patch(struct rom_image* img, u32 offset, const u8* data, u32 size);
+
+void        rom_init(struct ROM* rom, struct rom_image* img, struct NES* nes,
+                     struct mapper* map, u8* sram, u8* chr_ram);
+void        rom_destroy(struct ROM* rom);
 void        rom_inspect(struct ROM* rom);
 u8          rom_fetch_memory(struct ROM* rom, u16 addr);
 void        rom_set_memory(struct ROM* rom, u16 addr, u8 val);
@@ -0,0 +1,56 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* run-ahead, hiding the input latency games build into their main loop */
+
+#pragma once
+
+#ifndef _RUNAHEAD_H
+#define _RUNAHEAD_H
+
+#include "def.h"
+
+struct NES;
+
+/*
+  Most games react to input a frame or more after reading it. Run-ahead
+  hides that delay: every frame the real frame is emulated without drawing,
+  the machine is saved, `frames` more frames are emulated with the same input
+  (silently, only the last one draws), and the saved state is restored. What
+  ends up in the framebuffer is the future the current input leads to, while
+  sound and the actual game state come from the real timeline.
+
+  Costs frames + 1 emulated frames and one save / load per displayed frame.
+*/
+
+struct runahead {
+  struct NES* nes;
+
+  u32 frames;          // how far ahead to look, 0 runs plain frames
+
+  u8* state;           // the real timeline, saved before looking ahead
+  u32 state_size;
+};
+
+// functions
+struct runahead* runahead_create(struct NES* nes, u32 frames);
+void             runahead_free(struct runahead* ra);
+
+void             runahead_run_frame(struct runahead* ra);
+
+#endif /* _RUNAHEAD_H */
@@ -0,0 +1,100 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* stepping many NES instances on a pool of worker threads */
+
+#pragma once
+
+#ifndef _RUNNER_H
+#define _RUNNER_H
+
+#include "def.h"
+
+#include <pthread.h>
+
+struct NES;
+struct rom_image;
+
+/*
+  The runner owns a number of instances of one ROM image and a fixed pool
+  of worker threads. runner_run steps every instance a number of frames
+  and returns once all of them are done.
+
+  Each instance has a home worker (instance % threads) and is queued on
+  that worker's deque, so it stays on its home worker thread with warm
+  caches (the threads aren't pinned to cores). A worker takes its own work
+  from the back of its deque, and once it runs dry steals from the front
+  of the others', which only kicks in when some instances take longer
+  than others.
+*/
+
+struct runner_deque {
+  pthread_mutex_t lock;
+  u32* tasks;          // instance indices, ring of `capacity`
+  u32 capacity;
+  u32 head;            // thieves take from here
+  u32 tail;            // the owner pushes and pops here
+};
+
+struct runner_worker {
+  struct runner* runner;
+  u32 id;
+  pthread_t thread;
+  struct runner_deque deque;
+
+  u64 steals;          // tasks taken from other workers
+};
+
+struct runner {
+  struct NES** nes;
+  u32 instances;
+
+  struct runner_worker* workers;
+  u32 threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;   // a new batch was queued
+  pthread_cond_t done;    // the last task of a batch finished
+  u32 generation;         // batches started
+  u32 frames;             // frames per instance in this batch
+  u32 pending;            // tasks left in this batch
+  bool quit;
+};
+
+/*
+  runner_for_each is the simple pool for independent jobs that each need an
+  NES for a while (a test ROM, a movie segment): threads threads each create
+  an NES, pass it to init once (if given; returning false gives the thread
+  up) and then take the indices 0 - count-1 in turn, calling task for each.
+  Without any threads it all happens on the calling thread. Returns the
+  number of tasks run, less than count only if no thread got an NES.
+*/
+typedef bool (*runner_init_fn)(struct NES* nes, void* ctx);
+typedef void (*runner_task_fn)(struct NES* nes, u32 index, void* ctx);
+
+// functions
+struct runner* runner_create(struct rom_image* img, u32 instances, u32 threads);
+void           runner_free(struct runner* r);
+
+void           runner_run(struct runner* r, u32 frames);
+u64            runner_steals(struct runner* r);
+
+u32            runner_for_each(u32 count, u32 threads, runner_init_fn init,
+                               runner_task_fn task, void* ctx);
+
+#endif /* _RUNNER_H */
@@ -0,0 +1,86 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/* save states */
+
+#pragma once
+
+#ifndef _STATE_H
+#define _STATE_H
+
+#include "def.h"
+
+struct NES;
+
+/*
+  A save state is a flat, pointer free snapshot of everything that changes
+  while a game runs. Bank pointers are never stored, boards redo their
+  banking from their registers on load. Multi byte values are little endian.
+
+  The state only stays valid for the ROM image it was taken from.
+
+  OFFSET  SIZE    DESCRIPTION
+  0x0000  4       magic, "NSTA"
+  0x0004  2       format version (STATE_VERSION)
+  0x0006  1       mapper number
+  0x0007  1       flags, bit 0: CHR RAM present, bit 1: PRG RAM enabled
+  0x0008  4       PRG ROM size
+  0x000C  4       CHR ROM size
+
+  CPU     12      a, x, y, sp, pc (2), flags, nmi, reset, brk,
+                  IRQ sources (enum irq_source), halted
+          4       ticks
+  PPU     8       PPUCTRL - PPUDATA
+          8       dot (2), scanline (2), frame (4)
+          8       v (2), t (2), fine x, write toggle, read buffer, mirroring
+  RAM     0x800   lowmem
+          0x18    APU registers
+  INPUT   4       strobe, shift registers of controller 1 and 2, pad
+  APU     20      pulse 1: enabled, duty, step, period (2), timer (2), length,
+                  envelope (6), sweep enabled, negate, reload, period,
+                  shift, divider
+          20      pulse 2, the same
+          11      triangle: enabled, control, step, period (2), timer (2),
+                  length, linear counter, reload value, reload flag
+          15      noise: enabled, mode, shift (2), period (2), timer (2),
+                  length, envelope (6)
+          12      five step, IRQ inhibit, frame IRQ, odd cycle,
+                  frame cycle (4), sample phase (4)
+                  (envelopes are start, loop, constant, volume, divider,
+                  decay)
+  mapper  1       length of the board state (n)
+          n       board state, see mapper_ops.serialize
+          0x2000  PRG RAM (SRAM)
+  VRAM    0x1000  nametables
+          0x20    palette
+          0x100   OAM
+  CHR RAM 0x2000  only if flag bit 0 is set
+*/
+
+#define STATE_MAGIC   "NSTA"
+#define STATE_VERSION 5
+
+// functions
+u32           nes_state_size(struct NES* nes);
+u32           nes_save_state(struct NES* nes, u8* buf, u32 size);
+bool          nes_load_state(struct NES* nes, const u8* buf, u32 size);
+
+u64           nes_state_hash(struct NES* nes);
+
+#endif /* _STATE_H */
@@ -0,0 +1,73 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Frame time statistics of the real-time loop */
+
+#pragma once
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+
+#include "def.h"
+#include "histogram.h"
+
+/*
+  Mean frame rates hide stutter, so the real-time loop (main's --realtime)
+  records every frame into histograms and reports their tails:
+
+  emulate  how long emulating the frame took, run-ahead included
+  present  how long after its vsync deadline the frame was handed over,
+           i.e. the wake up latency, or how late an overrun made it
+  audio    how much sound was queued after the frame was submitted, for a
+           sound device playing APU_SAMPLE_RATE samples a second once
+           STATS_AUDIO_BUFFER are queued; running dry counts as an underrun
+           and waits for the buffer to fill again
+
+  The report is printed on exit, and also sent to whoever connects to the
+  optional control socket (a UNIX stream socket, e.g. `nc -U PATH`), which
+  the loop polls once a frame.
+*/
+
+// two frames, what a frontend would buffer before it starts playing
+#define STATS_AUDIO_BUFFER (2 * 735)
+
+struct frame_stats {
+  struct histogram emulate;  // ns
+  struct histogram present;  // ns
+  struct histogram audio;    // samples
+
+  bool audio_playing;
+  u64 audio_start;           // ns, when the device last started playing
+  u64 audio_queued;          // samples submitted since
+  u64 underruns;
+
+  int listener;              // control socket or -1
+  char* path;
+};
+
+// functions
+struct frame_stats* frame_stats_create(const char* socket_path);
+void                frame_stats_free(struct frame_stats* s);
+
+void                frame_stats_audio(struct frame_stats* s, u32 samples, u64 now);
+void                frame_stats_report(struct frame_stats* s, FILE* fp);
+void                frame_stats_poll(struct frame_stats* s);
+
+#endif /* _STATS_H */
@@ -0,0 +1,68 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* buffered binary instruction trace */
+
+#pragma once
+
+#ifndef _TRACEBUF_H
+#define _TRACEBUF_H
+
+#include "def.h"
+
+/*
+  Attached to cpu->tracebuf, the CPU state before every instruction is
+  appended as a fixed size record instead of being printed. Once capacity
+  records are buffered (and on tracebuf_flush) flush is called with all of
+  them, which is where they get compared, written out or formatted; count
+  is reset after it returns.
+
+  Detached it costs one test per instruction. Forks don't inherit it and
+  run-ahead doesn't record its speculative frames.
+*/
+
+struct trace_record {
+  u32 cycles;          // cpu->ticks
+  u16 pc;
+  u16 scanline;
+  u16 dot;
+  u8  a, x, y, p, sp;
+  u8  op[3];           // the opcode and its operand bytes, 0 past its length
+};
+
+struct tracebuf;
+typedef void (*tracebuf_flush_fn)(struct tracebuf* t, void* ctx);
+
+struct tracebuf {
+  struct trace_record* records;
+  u32 count;
+  u32 capacity;
+
+  tracebuf_flush_fn flush;
+  void* ctx;
+};
+
+// functions
+struct tracebuf* tracebuf_create(u32 capacity, tracebuf_flush_fn flush, void* ctx);
+void             tracebuf_free(struct tracebuf* t);
+void             tracebuf_flush(struct tracebuf* t);
+
+// one line in the layout of nestest.log, without the memory annotations
+int              tracebuf_format(const struct trace_record* r, char* buf, size_t size);
+
+#endif /* _TRACEBUF_H */
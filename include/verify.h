@@ -0,0 +1,52 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* parallel movie verification */
+
+#pragma once
+
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+#include "def.h"
+
+struct movie;
+struct rom_image;
+
+/*
+  Splits a movie at its checkpoints into segments: power on to the first
+  checkpoint, then checkpoint to checkpoint. Threads take the segments in
+  order, each with its own NES, load the checkpoint (checking it against
+  the hash recorded for the frame before it), and replay the segment
+  checking every frame's hash, up to the hash recorded right before the
+  next checkpoint.
+
+  The result is the same as movie_play's: the number of frames that match
+  before the first desync, found no matter which segment finishes first.
+*/
+struct verify_result {
+  u32 frames;          // frames that matched before the first desync
+  u32 segments;
+  bool ok;             // all frames matched
+  bool error;          // couldn't verify at all, see the log
+};
+
+// functions
+bool          verify_movie(struct movie* m, struct rom_image* img, u32 threads,
+                           struct verify_result* result);
+
+#endif /* _VERIFY_H */
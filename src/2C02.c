@@ -17,23 +17,23 @@
 
 
 #include "2C02.h"
+#include "6502.h"
+#include "cow.h"
+#include "mapper.h"
 #include "nes.h"
+#include "obs.h"
+#include "rom.h"
 
 #include <string.h>
 
-struct _2C02* ppu_2C02_create(struct NES* nes)
+void ppu_2C02_init(struct _2C02* ppu, struct NES* nes)
 {
-  struct _2C02* ppu = malloc(sizeof(struct _2C02));
   memset(ppu, 0, sizeof(struct _2C02));
 
-  ppu->nes = nes;
-
-  return ppu;
-}
+  for(int i = 0; i < 4; ++i)
+    ppu->vram_pages[i] = ppu->vram + i * COW_PAGE_SIZE;
 
-void ppu_2C02_free(struct _2C02* ppu)
-{
-  free(ppu);
+  ppu->nes = nes;
 }
 
 // leaving powerup and reset stubs in, but reset / power on state is basically
@@ -41,7 +41,12 @@ void ppu_2C02_free(struct _2C02* ppu)
 
 void ppu_2C02_powerup(struct _2C02* ppu)
 {
-  (void)ppu;
+  ppu->dot = ppu->scanline = 0;
+  ppu->frame = 0;
+
+  memset(&ppu->r, 0, sizeof(ppu->r));
+  ppu->v = ppu->t = ppu->x = ppu->read_buffer = 0;
+  ppu->w = false;
 }
 
 void ppu_2C02_reset(struct _2C02* ppu)
@@ -52,55 +57,427 @@ void ppu_2C02_reset(struct _2C02* ppu)
 
 void ppu_2C02_tick(struct _2C02* ppu)
 {
-  (void)ppu;
-  // TODO
+  ppu_2C02_run(ppu, 1);
 }
 
-void ppu_2C02_set_register(struct _2C02* ppu, u8 reg, u8 val)
+void ppu_2C02_set_mirroring(struct _2C02* ppu, enum ppu_mirroring mirroring)
+{
+  static const u16 pages[5][4] = {
+    [MIRROR_HORIZONTAL]  = { 0, 0, 1, 1 },
+    [MIRROR_VERTICAL]    = { 0, 1, 0, 1 },
+    [MIRROR_SINGLE_LOW]  = { 0, 0, 0, 0 },
+    [MIRROR_SINGLE_HIGH] = { 1, 1, 1, 1 },
+    [MIRROR_FOUR]        = { 0, 1, 2, 3 },
+  };
+
+  ppu->mirroring = mirroring;
+
+  for(int i = 0; i < 4; ++i)
+    ppu->nt_map[i] = pages[mirroring][i];
+}
+
+/* PPU memory map
+   0x0000 - 0x1FFF  pattern tables (CHR ROM / RAM, banked by the mapper)
+   0x2000 - 0x2FFF  nametables, mirrored at 0x3000 - 0x3EFF
+   0x3F00 - 0x3F1F  palette, mirrored up to 0x3FFF
+*/
+
+// 0x3F10, 0x3F14, 0x3F18 and 0x3F1C are the background color entries
+static u8 ppu_2C02_palette_index(u16 addr)
+{
+  u8 i = addr & 0x1F;
+  return (i & 0x13) == 0x10 ? i & 0x0F : i;
+}
+
+static u8 ppu_2C02_read(struct _2C02* ppu, u16 addr)
 {
-  LOGF("set reg 0x%X to 0x%X", reg, val);
+  addr &= 0x3FFF;
+
+  if(addr < 0x2000)
+    return ppu->nes->rom->map->vrom_banks[addr >> 10][addr & 0x3FF];
+
+  if(addr < 0x3F00)
+    return ppu->vram_pages[ppu->nt_map[(addr >> 10) & 3]][addr & 0x3FF];
+
+  return ppu->palette[ppu_2C02_palette_index(addr)];
+}
+
+static void ppu_2C02_write(struct _2C02* ppu, u16 addr, u8 val)
+{
+  addr &= 0x3FFF;
+
+  if(addr < 0x2000) {
+    // CHR ROM is read only (and usually mapped read only)
+    if(ppu->nes->rom->chr_ram)
+      mapper_chr_ram(ppu->nes->rom->map, addr)[addr & 0x3FF] = val;
+  }
+
+  else if(addr < 0x3F00)
+    cow_write(ppu->nes->cow, COW_VRAM + ppu->nt_map[(addr >> 10) & 3])[addr & 0x3FF] = val;
+
+  else
+    ppu->palette[ppu_2C02_palette_index(addr)] = val & 0x3F;
+}
+
+/* Scroll register updates done during rendering, v is laid out as
+   yyy NN YYYYY XXXXX (fine Y, nametable, coarse Y, coarse X) */
+
+static void ppu_2C02_increment_x(u16* v)
+{
+  if((*v & 0x001F) == 31) {
+    *v &= ~0x001F;
+    *v ^= 0x0400;
+  } else {
+    (*v)++;
+  }
+}
+
+static void ppu_2C02_increment_y(u16* v)
+{
+  if((*v & 0x7000) != 0x7000) {
+    *v += 0x1000;
+    return;
+  }
+
+  *v &= ~0x7000;
+
+  u16 y = (*v & 0x03E0) >> 5;
+
+  if(y == 29) {
+    y = 0;
+    *v ^= 0x0800;
+  } else if(y == 31) {
+    y = 0;
+  } else {
+    y++;
+  }
+
+  *v = (*v & ~0x03E0) | (y << 5);
+}
+
+// find the (up to 8) sprites on a line, returns how many
+static u8 ppu_2C02_evaluate_sprites(struct _2C02* ppu, u16 line, u8* found)
+{
+  u8 height = ppu->r.ctrl.sprite_size ? 16 : 8, count = 0;
+
+  for(u8 n = 0; n < 64; ++n) {
+    // sprites are drawn one line below their Y coordinate
+    u16 row = line - ppu->oam[n * 4] - 1;
+
+    if(row >= height) continue;
+
+    if(count == 8) {
+      ppu->r.status.overflow = 1;
+      break;
+    }
+
+    found[count++] = n;
+  }
+
+  return count;
+}
+
+static void ppu_2C02_render_line(struct _2C02* ppu, u16 line)
+{
+  u8 sprites[8];
+  u8 count = ppu_2C02_evaluate_sprites(ppu, line, sprites);
+
+  bool show_bg = ppu->r.mask.show_background, show_sp = ppu->r.mask.show_sprites;
+
+  // with output suppressed only lines that may set the sprite 0 flag are drawn
+  bool need_hit = count && sprites[0] == 0 && show_bg && show_sp && !ppu->r.status.sprite_hit;
+
+  if(ppu->suppress_output && !need_hit) return;
+
+  // palette index of each pixel, 0 is transparent
+  u8 bg[PPU_WIDTH + 16] = { 0 };
+  u8 sp[PPU_WIDTH] = { 0 };
+  bool behind[PPU_WIDTH];
+
+  if(show_bg) {
+    u16 v = ppu->v, base = ppu->r.ctrl.pattern ? 0x1000 : 0;
+
+    for(int tile = 0; tile < 33; ++tile) {
+      u8 index = ppu_2C02_read(ppu, 0x2000 | (v & 0x0FFF));
+      u8 attr  = ppu_2C02_read(ppu, 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+      u8 pal   = ((attr >> (((v >> 4) & 4) | (v & 2))) & 3) << 2;
+
+      u16 addr = base + index * 16 + ((v >> 12) & 7);
+      u8 lo = ppu_2C02_read(ppu, addr), hi = ppu_2C02_read(ppu, addr + 8);
+
+      u8* out = bg + tile * 8;
+      for(int px = 0; px < 8; ++px) {
+        u8 color = ((lo >> (7 - px)) & 1) | (((hi >> (7 - px)) & 1) << 1);
+        out[px] = color ? pal | color : 0;
+      }
 
-  // TODO: shorten this up
-  if(reg == 0) // PPUCTRL
+      ppu_2C02_increment_x(&v);
+    }
+
+    if(!ppu->r.mask.clip_playfield)
+      memset(bg + ppu->x, 0, 8);
+  }
+
+  // fine X scroll shifts the whole line
+  const u8* bgline = bg + ppu->x;
+
+  if(show_sp) {
+    u8 height = ppu->r.ctrl.sprite_size ? 16 : 8;
+
+    for(int i = 0; i < count; ++i) {
+      const u8* s = ppu->oam + sprites[i] * 4;
+      u8 tile = s[1], attr = s[2], sx = s[3];
+      u16 row = line - s[0] - 1;
+
+      if(attr & 0x80) row = height - 1 - row;
+
+      u16 addr;
+      if(height == 16)
+        addr = ((tile & 1) ? 0x1000 : 0) + (tile & 0xFE) * 16 + (row & 8) * 2 + (row & 7);
+      else
+        addr = (ppu->r.ctrl.sprite_table ? 0x1000 : 0) + tile * 16 + row;
+
+      u8 lo = ppu_2C02_read(ppu, addr), hi = ppu_2C02_read(ppu, addr + 8);
+
+      for(int px = 0; px < 8 && sx + px < PPU_WIDTH; ++px) {
+        int bit = (attr & 0x40) ? px : 7 - px;
+        u8 color = ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+        int x = sx + px;
+
+        if(!color || (x < 8 && !ppu->r.mask.clip_object)) continue;
+
+        if(sprites[i] == 0 && bgline[x] && x != 255)
+          ppu->r.status.sprite_hit = 1;
+
+        // lower OAM index wins, even if behind the background
+        if(sp[x]) continue;
+
+        sp[x] = 0x10 | ((attr & 3) << 2) | color;
+        behind[x] = attr & 0x20;
+      }
+    }
+  }
+
+  if(ppu->suppress_output) return;
+
+  u8* out = ppu->framebuffer + line * PPU_WIDTH;
+  u8 mask = ppu->r.mask.greyscale ? 0x30 : 0x3F;
+
+  for(int x = 0; x < PPU_WIDTH; ++x) {
+    u8 pixel = (sp[x] && (!bgline[x] || !behind[x])) ? sp[x] : bgline[x];
+    out[x] = ppu->palette[pixel] & mask;
+  }
+}
+
+// The dot on which A12 rises once per rendered line. Sprite fetches
+// (257 - 320) from $1000 raise it at ~260, background fetches (321 - 336) of
+// the next line from $1000 at ~324.
+static u16 ppu_2C02_a12_dot(struct _2C02* ppu)
+{
+  return (ppu->r.ctrl.pattern && !ppu->r.ctrl.sprite_table) ? 324 : 260;
+}
+
+static void ppu_2C02_end_line(struct _2C02* ppu)
+{
+  ppu->dot = 0;
+
+  if(++ppu->scanline == PPU_LINES) {
+    ppu->scanline = 0;
+    ppu->frame++;
+  }
+}
+
+// True if dot d was passed going from `from` to the current dot
+#define PASSED(d) (from <= (d) && (d) < ppu->dot)
+
+/* Advance the PPU by a number of dots. Instead of doing work for every dot,
+   this steps a scanline at a time and computes which of the few events of
+   interest were crossed:
+
+   - vblank set / cleared (and NMI) at dot 1
+   - the whole visible line is drawn at dot 256, followed by the scroll
+     updates at 256 (Y), 257 (X) and 304 of the pre-render line (all of Y)
+   - the mapper's scanline event where A12 would rise during rendering
+*/
+void ppu_2C02_run(struct _2C02* ppu, u32 dots)
+{
+  while(dots) {
+    u32 left = PPU_DOTS_PER_LINE - ppu->dot;
+    u32 step = dots < left ? dots : left;
+
+    u16 from = ppu->dot;
+    ppu->dot += step;
+    dots -= step;
+
+    if(ppu->scanline == PPU_VBLANK_LINE && PASSED(1)) {
+      ppu->r.status.vblank = 1;
+
+      if(ppu->obs && !ppu->suppress_output) obs_push(ppu->obs, ppu->framebuffer);
+
+      if(ppu->r.ctrl.nmi) ppu->nes->cpu->intr.nmi = true;
+    }
+
+    else if(ppu->scanline == PPU_PRERENDER_LINE && PASSED(1)) {
+      ppu->r.status.vblank = 0;
+      ppu->r.status.sprite_hit = 0;
+      ppu->r.status.overflow = 0;
+    }
+
+    bool rendering = ppu->r.mask.show_background || ppu->r.mask.show_sprites;
+    bool visible = ppu->scanline < PPU_HEIGHT;
+
+    if(visible && PASSED(256)) {
+      if(rendering) {
+        ppu_2C02_render_line(ppu, ppu->scanline);
+        INST(++ppu->nes->inst.count[INST_SCANLINES]);
+      } else if(!ppu->suppress_output)
+        memset(ppu->framebuffer + ppu->scanline * PPU_WIDTH, ppu->palette[0], PPU_WIDTH);
+    }
+
+    if(rendering && (visible || ppu->scanline == PPU_PRERENDER_LINE)) {
+      if(PASSED(256))
+        ppu_2C02_increment_y(&ppu->v);
+
+      if(PASSED(257))
+        ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+
+      if(ppu->scanline == PPU_PRERENDER_LINE && PASSED(304))
+        ppu->v = (ppu->v & ~0x7BE0) | (ppu->t & 0x7BE0);
+
+      if(PASSED(ppu_2C02_a12_dot(ppu)))
+        mapper_scanline(ppu->nes->rom->map);
+    }
+
+    if(ppu->dot == PPU_DOTS_PER_LINE) ppu_2C02_end_line(ppu);
+  }
+}
+
+#undef PASSED
+
+/* How many dots the PPU can run before it does something the CPU sees
+   without reading a PPU register: raising NMI (vblank), the mapper's
+   scanline event (MMC3 IRQ) or starting the next frame. Running up to that
+   many dots at once instead of a few at a time gives the same results. */
+u32 ppu_2C02_dots_to_event(struct _2C02* ppu)
+{
+  bool rendering = ppu->r.mask.show_background || ppu->r.mask.show_sprites;
+  bool a12 = rendering && ppu->nes->rom->map->ops->scanline;
+
+  // without scanline events only vblank and the end of the frame are left
+  if(!a12) {
+    static const u32 events[] = {
+      PPU_VBLANK_LINE * PPU_DOTS_PER_LINE + 2,
+      PPU_PRERENDER_LINE * PPU_DOTS_PER_LINE + 2,
+      PPU_LINES * PPU_DOTS_PER_LINE
+    };
+    u32 pos = ppu->scanline * PPU_DOTS_PER_LINE + ppu->dot;
+
+    for(int i = 0; ; ++i)
+      if(events[i] > pos) return events[i] - pos;
+  }
+
+  u32 dots = 0;
+
+  for(u16 line = ppu->scanline, from = ppu->dot; ; line = (line + 1) % PPU_LINES, from = 0) {
+    u16 next = 0xFFFF;
+
+    // events fire once the dot after them is reached, see PASSED
+#define EVENT(d) if((d) > from && (d) < next) next = (d)
+    if(line == PPU_VBLANK_LINE || line == PPU_PRERENDER_LINE)
+      EVENT(2);
+    if(a12 && (line < PPU_HEIGHT || line == PPU_PRERENDER_LINE))
+      EVENT(ppu_2C02_a12_dot(ppu) + 1);
+    if(line == PPU_PRERENDER_LINE)
+      EVENT(PPU_DOTS_PER_LINE);
+#undef EVENT
+
+    if(next != 0xFFFF) return dots + next - from;
+
+    dots += PPU_DOTS_PER_LINE - from;
+  }
+}
+
+void ppu_2C02_set_register(struct _2C02* ppu, u8 reg, u8 val)
+{
+  switch(reg) {
+  case 0: { // PPUCTRL
+    bool nmi = ppu->r.ctrl.nmi;
     ppu->r.ctrl = *(struct ppu_control_register*)&val;
-  if(reg == 1) // PPUMASK
+    ppu->t = (ppu->t & ~0x0C00) | ((val & 3) << 10);
+
+    // enabling NMI during vblank fires it right away
+    if(!nmi && ppu->r.ctrl.nmi && ppu->r.status.vblank)
+      ppu->nes->cpu->intr.nmi = true;
+    break;
+  }
+  case 1: // PPUMASK
     ppu->r.mask = *(struct ppu_mask_register*)&val;
-  if(reg == 2) // PPUSTATUS
-    ppu->r.status = *(struct ppu_status_register*)&val;
-  if(reg == 3) // OAMADDR
+    break;
+  case 2: // PPUSTATUS, read only
+    break;
+  case 3: // OAMADDR
     ppu->r.oam_addr = val;
-  if(reg == 4) // OAMDATA
+    break;
+  case 4: // OAMDATA
     ppu->r.oam_data = val;
-  if(reg == 5) // PPUSCROLL
+    ppu->oam[ppu->r.oam_addr++] = val;
+    break;
+  case 5: // PPUSCROLL
     ppu->r.ppu_scroll = val;
-  if(reg == 6) // PPU_ADDR
+    if(!ppu->w) {
+      ppu->t = (ppu->t & ~0x001F) | (val >> 3);
+      ppu->x = val & 7;
+    } else {
+      ppu->t = (ppu->t & 0x0C1F) | ((val & 7) << 12) | ((val & 0xF8) << 2);
+    }
+    ppu->w = !ppu->w;
+    break;
+  case 6: // PPUADDR
     ppu->r.ppu_addr = val;
-  if(reg == 7) // PPU_DATA
+    if(!ppu->w) {
+      ppu->t = (ppu->t & 0x00FF) | ((val & 0x3F) << 8);
+    } else {
+      ppu->t = (ppu->t & 0xFF00) | val;
+      ppu->v = ppu->t;
+    }
+    ppu->w = !ppu->w;
+    break;
+  case 7: // PPUDATA
     ppu->r.ppu_data = val;
+    ppu_2C02_write(ppu, ppu->v, val);
+    ppu->v = (ppu->v + (ppu->r.ctrl.increment ? 32 : 1)) & 0x7FFF;
+    break;
+  }
 }
 
 u8 ppu_2C02_get_register(struct _2C02* ppu, u8 reg)
 {
-  LOGF("get reg 0x%X", reg);
-
-  if(reg == 0) // PPUCTRL
-    return *(u8*)&ppu->r.ctrl;
-  if(reg == 1) // PPUMASK
-    return *(u8*)&ppu->r.mask;
-  if(reg == 2) // PPUSTATUS
-    return *(u8*)&ppu->r.status;
-  if(reg == 3) // OAMADDR
-    return ppu->r.oam_addr;
-  if(reg == 4) // OAMDATA
-    return ppu->r.oam_data;
-  if(reg == 5) // PPUSCROLL
-    return ppu->r.ppu_scroll;
-  if(reg == 6) // PPU_ADDR
-    return ppu->r.ppu_addr;
-  if(reg == 7) // PPU_DATA
-    return ppu->r.ppu_data;
-
-  return 0;
+  switch(reg) {
+  case 2: { // PPUSTATUS, reading clears the vblank flag and the write toggle
+    u8 status = *(u8*)&ppu->r.status;
+    ppu->r.status.vblank = 0;
+    ppu->w = false;
+    return status;
+  }
+  case 4: // OAMDATA
+    return ppu->oam[ppu->r.oam_addr];
+  case 7: { // PPUDATA, buffered except for the palette
+    u16 addr = ppu->v & 0x3FFF;
+    u8 val = ppu->read_buffer;
+
+    if(addr >= 0x3F00) {
+      val = ppu->palette[ppu_2C02_palette_index(addr)];
+      ppu->read_buffer = ppu_2C02_read(ppu, addr - 0x1000);
+    } else {
+      ppu->read_buffer = ppu_2C02_read(ppu, addr);
+    }
+
+    ppu->v = (ppu->v + (ppu->r.ctrl.increment ? 32 : 1)) & 0x7FFF;
+    return val;
+  }
+  default: // the rest are write only
+    return 0;
+  }
 }
 
 void ppu_2C02_inspect(struct _2C02* ppu)
@@ -23,16 +23,17 @@
 #include <string.h>
 
 #include "6502.h"
+#include "2C02.h"
 #include "nes.h"
+#include "profile.h"
 #include "rom.h"
+#include "tracebuf.h"
 
-struct _6502* cpu_6502_create(struct NES* nes)
+// the CPU lives inside the NES' arena, see nes_create_in
+void cpu_6502_init(struct _6502* cpu, struct NES* nes)
 {
-  struct _6502* cpu = malloc(sizeof(struct _6502));
   memset(cpu, 0, sizeof(struct _6502));
   cpu->nes = nes;
-
-  return cpu;
 }
 
 void cpu_6502_powerup(struct _6502* cpu)
@@ -69,9 +70,11 @@ void cpu_6502_reset(struct _6502* cpu)
   cpu->intr.reset = true;
 }
 
-void cpu_6502_free(struct _6502* cpu)
+// each source raises and acknowledges only its own bit
+void cpu_6502_set_irq(struct _6502* cpu, enum irq_source source, bool level)
 {
-  free(cpu);
+  if(level) cpu->intr.irq_sources |= source;
+  else      cpu->intr.irq_sources &= ~source;
 }
 
 // give a nice output of the current state of the CPU
@@ -97,14 +100,14 @@ void cpu_6502_inspect(struct _6502* cpu)
 // push a value onto the stack
 void cpu_6502_push_stack(struct _6502* cpu, u8 val)
 {
-  u16 addr = 0xFF + cpu->r.sp--;
+  u16 addr = 0x100 + cpu->r.sp--;
   nes_set_memory(cpu->nes, addr, val);
 }
 
 // pop a value off of the stack
 u8 cpu_6502_pop_stack(struct _6502* cpu)
 {
-  u16 addr = 0xFF + ++cpu->r.sp;
+  u16 addr = 0x100 + ++cpu->r.sp;
   return nes_fetch_memory(cpu->nes, addr);
 }
 
@@ -127,7 +130,7 @@ static struct flag set_flags(struct flag f, unsigned which, u8 val)
 #define SETMEM(addr, val)  (nes_set_memory(cpu->nes, addr, val))
 
 #define X         (cpu->r.x)
-#define Y         (cpu->r.x)
+#define Y         (cpu->r.y)
 #define A         (cpu->r.a)
 #define SP        (cpu->r.sp)
 #define PC        (cpu->r.pc)
@@ -142,17 +145,21 @@ static struct flag set_flags(struct flag f, unsigned which, u8 val)
 // these procedures are for ops that manipulate 16 bit values (addresses)
 // I do some terrifying things here, please forgive me.
 #define ZP16  addr = PCVAL
-#define ZPX16 addr = PCVAL + cpu->r.x
-#define ZPY16 addr = PCVAL + cpu->r.y
+// zero page indexing and pointers wrap around within the zero page
+#define ZPX16 addr = (u8)(PCVAL + cpu->r.x)
+#define ZPY16 addr = (u8)(PCVAL + cpu->r.y)
 
-#define IZX16 {                                             \
-    u8 pcval = PCVAL;                                       \
-    addr = create_u16(MEM(pcval + X), MEM(pcval + X + 1));  \
+#define IZX16 {                                                         \
+    u8 pcval = PCVAL + X;                                               \
+    addr = create_u16(MEM(pcval), MEM((u8)(pcval + 1)));                \
   }
 
-#define IZY16 {                                             \
-    u8 pcval = PCVAL;                                       \
-    addr = create_u16(MEM(pcval), MEM(pcval + 1)) + Y;      \
+// indexing into the next page sets crossed, which costs reads a cycle
+#define IZY16 {                                                         \
+    u8 pcval = PCVAL;                                                   \
+    u16 base = create_u16(MEM(pcval), MEM((u8)(pcval + 1)));            \
+    addr = base + Y;                                                    \
+    crossed = (base ^ addr) > 0xFF;                                     \
   }
 
 #define ABS16 {                                     \
@@ -162,12 +169,16 @@ static struct flag set_flags(struct flag f, unsigned which, u8 val)
 
 #define ABX16 {                                             \
     PC += 2;                                                \
-    addr = create_u16(MEM(PC - 2), MEM(PC - 1)) + cpu->r.x; \
+    u16 base = create_u16(MEM(PC - 2), MEM(PC - 1));        \
+    addr = base + cpu->r.x;                                 \
+    crossed = (base ^ addr) > 0xFF;                         \
   }
 
 #define ABY16 {                                             \
     PC += 2;                                                \
-    addr = create_u16(MEM(PC - 2), MEM(PC - 1)) + cpu->r.y; \
+    u16 base = create_u16(MEM(PC - 2), MEM(PC - 1));        \
+    addr = base + cpu->r.y;                                 \
+    crossed = (base ^ addr) > 0xFF;                         \
   }
 
 // these procedures are common to every opcode
@@ -175,35 +186,97 @@ static struct flag set_flags(struct flag f, unsigned which, u8 val)
 #define IMM val = MEM(PC++)
 #define ZP  ZP16;  val = MEM(addr)
 #define ZPX ZPX16; val = MEM(addr)
-#define ZPY ZPX16; val = MEM(addr)
+#define ZPY ZPY16; val = MEM(addr)
 #define IZX IZX16; val = MEM(addr)
-#define IZY IZY16; val = MEM(addr)
+#define IZY IZY16; val = MEM(addr); extra = crossed
 #define ABS ABS16; val = MEM(addr)
-#define ABX ABX16; val = MEM(addr)
-#define ABY ABY16; val = MEM(addr)
+#define ABX ABX16; val = MEM(addr); extra = crossed
+#define ABY ABY16; val = MEM(addr); extra = crossed
+
+// read-modify-write always takes the extra cycle, cycles[] counts it
+#define RMW_ABX ABX16; val = MEM(addr)
+#define RMW_ABY ABY16; val = MEM(addr)
+#define RMW_IZY IZY16; val = MEM(addr)
+
+// per instruction trace, only when enabled
+#define TRACE(...) do { if(cpu->trace) printf(__VA_ARGS__); } while(0)
 
 // save some keystrokes
 #define OP(num, fam, type) case num: {              \
-    printf("0x%02X\t%s %5s\t", num, #fam, #type);   \
+    TRACE("0x%02X\t%s %5s\t", num, #fam, #type);    \
     type;                                           \
     goto fam;                                       \
     break;                                          \
   }
+// stores only compute the address, reading it first would trigger the side
+// effects of I/O registers such as $2007
+#define STORE_OP(num, fam, type) case num: {        \
+    TRACE("0x%02X\t%s %5s\t", num, #fam, #type);    \
+    type##16;                                       \
+    goto fam;                                       \
+    break;                                          \
+  }
 // implicit op
 #define IMP_OP(num, fam, code) case num: {      \
-    printf("0x%02X\t%s   IMP\t", num, #fam);    \
+    TRACE("0x%02X\t%s   IMP\t", num, #fam);     \
     code;                                       \
     break;                                      \
   }
 
 // relative op
 #define REL_OP(num, fam, code) case num: {      \
-    printf("0x%02X\t%s   REL\t", num, #fam);    \
+    TRACE("0x%02X\t%s   REL\t", num, #fam);     \
     code;                                       \
     break;                                      \
   }
 
-#define BRANCH_IF(cond) u8 jmp = PCVAL; if(cond) { PC += jmp; printf("branching to 0x%X", PC); }
+// a taken branch costs a cycle, and another one if it lands in the next page
+#define BRANCH_IF(cond) int8_t jmp = PCVAL; if(cond) {                   \
+    u16 from = PC;                                                      \
+    PC += jmp;                                                          \
+    extra = 1 + ((from ^ PC) > 0xFF);                                   \
+    TRACE("branching to 0x%X", PC);                                     \
+  }
+
+// push PC and flags, then jump through the given vector
+static void cpu_6502_interrupt(struct _6502* cpu, u16 vector)
+{
+  PUSH((PC >> 8) & 0xFF);
+  PUSH(PC & 0xFF);
+
+  struct flag f = FLAGS;
+  f.b = 0;
+  f.u = 1;
+  PUSH(flag_to_u8(f));
+
+  FLAGS.i = 1;
+  PC = create_u16(MEM(vector), MEM(vector + 1));
+
+  cpu->ticks += 7;
+}
+
+// the state before the instruction at PC - 1, see tracebuf.h
+static void cpu_6502_record(struct _6502* cpu, u8 op)
+{
+  struct tracebuf* t = cpu->tracebuf;
+  struct trace_record* r = &t->records[t->count];
+  u32 length = cpu_6502_length(op);
+
+  r->cycles = cpu->ticks;
+  r->pc = PC - 1;
+  r->scanline = cpu->nes->ppu->scanline;
+  r->dot = cpu->nes->ppu->dot;
+  r->a = cpu->r.a;
+  r->x = cpu->r.x;
+  r->y = cpu->r.y;
+  r->p = flag_to_u8(FLAGS);
+  r->sp = SP;
+  r->op[0] = op;
+  r->op[1] = length > 1 ? MEM(PC) : 0;
+  r->op[2] = length > 2 ? MEM(PC + 1) : 0;
+
+  if(++t->count == t->capacity) tracebuf_flush(t);
+}
 
 void cpu_6502_tick(struct _6502 *cpu)
 {
@@ -211,21 +284,33 @@ void cpu_6502_tick(struct _6502 *cpu)
   if(cpu->intr.reset) {
     cpu->r.pc = create_u16(MEM(0xFFFC), MEM(0xFFFD));
 
-    if(cpu->nes->rom->map->num == NROM) {
-      cpu->r.pc = 0xC000 ;
-    }
-
     cpu->intr.reset = false;
 
     LOGF("Jumping to reset address of: 0x%X", cpu->r.pc);
     return;
   }
 
+  if(cpu->intr.nmi) {
+    cpu->intr.nmi = false;
+    cpu_6502_interrupt(cpu, 0xFFFA);
+    return;
+  }
+
+  if(cpu->intr.irq_sources && !FLAGS.i) {
+    cpu_6502_interrupt(cpu, 0xFFFE);
+    return;
+  }
+
+  u16 at = PC;
   u8 op = PCVAL;
-  printf("0x%X ", PC - 1);
+  TRACE("0x%X ", at);
+
+  if(cpu->tracebuf) cpu_6502_record(cpu, op);
 
   u8  val  = 0; // temporary value for instructions to use
   u16 addr = 0; // temporary 16 bit value (for addresses)
+  bool crossed = false; // indexed address in the next page
+  u32 extra = 0;        // cycles on top of cycles[op]
 
   switch (op) {
     ///// Logical / Arithmetic operations
@@ -240,7 +325,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x1D, ORA, ABX); // ORA abx
     OP(0x19, ORA, ABY); // ORA aby
   ORA:
-    printf("0x%X | 0x%X => 0x%X", A, val, A | val);
+    TRACE("0x%X | 0x%X => 0x%X", A, val, A | val);
     A |= val;
 
     SET_FLAGS(N|Z, A);
@@ -256,7 +341,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x3D, AND, ABX); // AND abx
     OP(0x39, AND, ABY); // AND aby
   AND:
-    printf("0x%X & 0x%X => 0x%X", A, val, A & val);
+    TRACE("0x%X & 0x%X => 0x%X", A, val, A & val);
     A &= val;
 
     SET_FLAGS(N|Z, A);
@@ -272,7 +357,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x5D, EOR, ABX); // EOR abx
     OP(0x59, EOR, ABY); // EOR aby
   EOR:
-    printf("0x%X ^ 0x%X => 0x%X", A, val, A ^ val);
+    TRACE("0x%X ^ 0x%X => 0x%X", A, val, A ^ val);
     A ^= val;
 
     SET_FLAGS(N|Z, A);
@@ -293,7 +378,7 @@ void cpu_6502_tick(struct _6502 *cpu)
       FLAGS.c = v16 > 0xFF;
       FLAGS.v = !((A ^ val) & 0x80) && ((A ^ v16) & 0x80);
 
-      printf("0x%X + 0x%X => 0x%X(trunc:0x%X)", A, val, v16, (u8)v16);
+      TRACE("0x%X + 0x%X => 0x%X(trunc:0x%X)", A, val, v16, (u8)v16);
       val = v16 & 0xFF;
       A = val;
 
@@ -310,6 +395,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xED, SBC, ABS); // SBC abs
     OP(0xFD, SBC, ABX); // SBC abx
     OP(0xF9, SBC, ABY); // SBC aby
+    OP(0xEB, SBC, IMM); // SBC imm, unofficial
   SBC: {
       // XXX: at least IZY is broken for SBC
 
@@ -317,7 +403,7 @@ void cpu_6502_tick(struct _6502 *cpu)
       FLAGS.v = ((A ^ v) & 0x80) && ((A ^ val) & 0x80);
       FLAGS.c = v < 0x100;
 
-      printf("0x%X - 0x%X => 0x%X(truc:0x%X)", A, val, v, v & 0xFF);
+      TRACE("0x%X - 0x%X => 0x%X(truc:0x%X)", A, val, v, v & 0xFF);
       A = v & 0xFF;
 
       SET_FLAGS(N|Z, A);
@@ -334,7 +420,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xDD, CMP, ABX); // CMP abx
     OP(0xD9, CMP, ABY); // CMP aby
   CMP: {
-      printf("0x%X CMP 0x%X => %d", A, val, A - val);
+      TRACE("0x%X CMP 0x%X => %d", A, val, A - val);
 
       u16 v = A - val;
       FLAGS.c = v < 0x100;
@@ -347,12 +433,11 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xE4, CPX, ZP);  // CPX zp
     OP(0xEC, CPX, ABS); // CPX abs
   CPX: {
-      printf("0x%X CPX 0x%X => %d", X, val, X - val);
+      TRACE("0x%X CPX 0x%X => %d", X, val, X - val);
 
       u16 v = X - val;
       FLAGS.c = v < 0x100;
-      FLAGS.n = v;
-      FLAGS.z = v & 0xFF;
+      SET_FLAGS(N|Z, v & 0xFF);
       break;
     }
 
@@ -361,12 +446,11 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xC4, CPY, ZP);  // CPY zp
     OP(0xCC, CPY, ABS); // CPY abs
   CPY: {
-      printf("0x%X CPY 0x%X => %d", Y, val, Y - val);
+      TRACE("0x%X CPY 0x%X => %d", Y, val, Y - val);
 
       u16 v = Y - val;
       FLAGS.c = v < 0x100;
-      FLAGS.n = v;
-      FLAGS.z = v & 0xFF;
+      SET_FLAGS(N|Z, v & 0xFF);
       break;
     }
 
@@ -374,12 +458,12 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xC6, DEC, ZP);  //DEC zp
     OP(0xD6, DEC, ZPX); //DEC zpx
     OP(0xCE, DEC, ABS); //DEC abs
-    OP(0xDE, DEC, ABX); //DEC abx
+    OP(0xDE, DEC, RMW_ABX); //DEC abx
   DEC: {
       val -= 1;
-      printf("0x%X => 0x%X", addr, val);
+      TRACE("0x%X => 0x%X", addr, val);
       SETMEM(addr, val);
-      printf("==> 0x%X", MEM(addr));
+      TRACE("==> 0x%X", MEM(addr));
 
       SET_FLAGS(N|Z, val);
       break;
@@ -396,10 +480,10 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xE6, INC, ZP);  //INC zp
     OP(0xF6, INC, ZPX); //INC zpx
     OP(0xEE, INC, ABS); //INC abs
-    OP(0xFE, INC, ABX); //INC abx
+    OP(0xFE, INC, RMW_ABX); //INC abx
   INC: {
       val += 1;
-      printf("0x%X => 0x%X", addr, val);
+      TRACE("0x%X => 0x%X", addr, val);
       SETMEM(addr, val);
 
       SET_FLAGS(N|Z, val);
@@ -420,12 +504,12 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x06, ASL, ZP);       // ASL zp
     OP(0x16, ASL, ZPX);      // ASL zpx
     OP(0x0E, ASL, ABS);      // ASL abs
-    OP(0x1E, ASL, ABX);      // ASL abx
+    OP(0x1E, ASL, RMW_ABX);      // ASL abx
   ASL: {
       FLAGS.c = (val & 0x80) ? 1 : 0;
 
       val <<= 1;
-      printf("0x%X => 0x%X", addr, val);
+      TRACE("0x%X => 0x%X", addr, val);
       if(op == 0x0A) // ASL imp
         A = val;
       else
@@ -441,19 +525,16 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x26, ROL, ZP);      // ROL zp
     OP(0x36, ROL, ZPX);     // ROL zpx
     OP(0x2E, ROL, ABS);     // ROL abs
-    OP(0x3E, ROL, ABX);     // ROL abx
+    OP(0x3E, ROL, RMW_ABX);     // ROL abx
   ROL: {
-      u16 v16 = (u16)val;
-      FLAGS.c = (val & 0x80) ? 1 : 0;
-
-      v16 <<= 1;
-      if(FLAGS.c) val |= 0x01;
+      u16 v16 = (u16)val << 1;
+      if(FLAGS.c) v16 |= 0x01;
 
       FLAGS.c = v16 > 0xFF;
 
       val = v16 & 0xFF;
 
-      printf("0x%X => 0x%X", addr, val);
+      TRACE("0x%X => 0x%X", addr, val);
 
       if(op == 0x2A)  // ROL imp
         A = val;
@@ -470,12 +551,12 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x46, LSR, ZP);      // LSR zp
     OP(0x56, LSR, ZPX);     // LSR zpx
     OP(0x4E, LSR, ABS);     // LSR abs
-    OP(0x5E, LSR, ABX);     // LSR abx
+    OP(0x5E, LSR, RMW_ABX);     // LSR abx
   LSR: {
       FLAGS.c = val & 0x01;
       val >>= 1;
 
-      printf("0x%X => 0x%X", addr, val);
+      TRACE("0x%X => 0x%X", addr, val);
       if(op == 0x4A) // LSR imp
         A = val;
       else
@@ -491,7 +572,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0x66, ROR, ZP);       // ROR zp
     OP(0x76, ROR, ZPX);      // ROR zpx
     OP(0x6E, ROR, ABS);      // ROR abs
-    OP(0x7E, ROR, ABX);      // ROR abx
+    OP(0x7E, ROR, RMW_ABX);      // ROR abx
   ROR: {
       u16 v16 = (u16) val;
       if(FLAGS.c) v16 |= 0x100;
@@ -499,7 +580,7 @@ void cpu_6502_tick(struct _6502 *cpu)
       v16 >>= 1;
       val = v16 & 0xFF;
 
-      printf("0x%X => 0x%X", addr, val);
+      TRACE("0x%X => 0x%X", addr, val);
 
       if(op == 0x6A) // ROR imp
         A = val;
@@ -522,22 +603,22 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xBD, LDA, ABX); // LDA abx
     OP(0xB9, LDA, ABY); // LDA aby
   LDA:
-    printf("A = 0x%X", val);
+    TRACE("A = 0x%X", val);
     A = val;
 
     SET_FLAGS(N|Z, A);
     break;
 
     // STA
-    OP(0x85, STA, ZP);  // STA zp
-    OP(0x95, STA, ZPX); // STA zpx
-    OP(0x81, STA, IZX); // STA izx
-    OP(0x91, STA, IZY); // STA izy
-    OP(0x8D, STA, ABS); // STA abs
-    OP(0x9D, STA, ABX); // STA abx
-    OP(0x99, STA, ABY); // STA aby
+    STORE_OP(0x85, STA, ZP);  // STA zp
+    STORE_OP(0x95, STA, ZPX); // STA zpx
+    STORE_OP(0x81, STA, IZX); // STA izx
+    STORE_OP(0x91, STA, IZY); // STA izy
+    STORE_OP(0x8D, STA, ABS); // STA abs
+    STORE_OP(0x9D, STA, ABX); // STA abx
+    STORE_OP(0x99, STA, ABY); // STA aby
   STA: {
-      printf("address 0x%X -> 0x%X", addr, A);
+      TRACE("address 0x%X -> 0x%X", addr, A);
       SETMEM(addr, A);
       break;
     }
@@ -549,7 +630,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     OP(0xAE, LDX, ABS); // LDX abs
     OP(0xBE, LDX, ABY); // LDX aby
   LDX: {
-      printf("X = 0x%X", val);
+      TRACE("X = 0x%X", val);
       X = val;
 
       SET_FLAGS(N|Z, X);
@@ -557,11 +638,11 @@ void cpu_6502_tick(struct _6502 *cpu)
     }
 
     // STX
-    OP(0x86, STX, ZP);  // STX zp
-    OP(0x96, STX, ZPY); // STX zpy
-    OP(0x8E, STX, ABS); // STX abs
+    STORE_OP(0x86, STX, ZP);  // STX zp
+    STORE_OP(0x96, STX, ZPY); // STX zpy
+    STORE_OP(0x8E, STX, ABS); // STX abs
   STX: {
-      printf("0x%X -> 0x%X", addr, X);
+      TRACE("0x%X -> 0x%X", addr, X);
       SETMEM(addr, X);
       break;
     }
@@ -569,11 +650,11 @@ void cpu_6502_tick(struct _6502 *cpu)
     // LDY
     OP(0xA0, LDY, IMM); // LDY imm
     OP(0xA4, LDY, ZP);  // LDY zp
-    OP(0xB4, LDY, ZPY); // LDY zpy
+    OP(0xB4, LDY, ZPX); // LDY zpx
     OP(0xAC, LDY, ABS); // LDY abs
     OP(0xBC, LDY, ABX); // LDY abx
   LDY:
-    printf("Y = 0x%X", val);
+    TRACE("Y = 0x%X", val);
     Y = val;
 
     SET_FLAGS(N|Z, Y);
@@ -581,11 +662,11 @@ void cpu_6502_tick(struct _6502 *cpu)
 
 
     // STY
-    OP(0x84, STY, ZP);  // STY zp
-    OP(0x94, STY, ZPX); // STY zpx
-    OP(0x8C, STY, ABS); // STY abs
+    STORE_OP(0x84, STY, ZP);  // STY zp
+    STORE_OP(0x94, STY, ZPX); // STY zpx
+    STORE_OP(0x8C, STY, ABS); // STY abs
   STY:
-    printf("0x%X -> 0x%X", addr, Y);
+    TRACE("0x%X -> 0x%X", addr, Y);
     SETMEM(addr, Y);
     break;
 
@@ -606,7 +687,9 @@ void cpu_6502_tick(struct _6502 *cpu)
            A = Y;
            SET_FLAGS(N|Z, A));  // TYA imp
 
-    IMP_OP(0xBA, TSX, X = SP);       // TSX imp
+    IMP_OP(0xBA, TSX,
+           X = SP;
+           SET_FLAGS(N|Z, X));       // TSX imp
     IMP_OP(0x9A, TXS, SP = X);       // TXS imp
 
     IMP_OP(0x68, PLA,
@@ -614,8 +697,9 @@ void cpu_6502_tick(struct _6502 *cpu)
            SET_FLAGS(N|Z, A));       // PLA imp
 
     IMP_OP(0x48, PHA, PUSH(A));                   // PHA imp
-    IMP_OP(0x08, PHP, PUSH(flag_to_u8(FLAGS)));   // PHP imp
-    IMP_OP(0x28, PLP, FLAGS = u8_to_flag(POP));   // PLP imp
+    // B and the unused bit only exist on the stack
+    IMP_OP(0x08, PHP, PUSH(flag_to_u8(FLAGS) | B | U));   // PHP imp
+    IMP_OP(0x28, PLP, FLAGS = u8_to_flag((POP & ~B) | U)); // PLP imp
 
     ///// Jump / flag operations
 
@@ -629,17 +713,17 @@ void cpu_6502_tick(struct _6502 *cpu)
     REL_OP(0xD0, BNE, BRANCH_IF(!FLAGS.z)); // BNE rel
     REL_OP(0xF0, BEQ, BRANCH_IF(FLAGS.z));  // BEQ rel
 
+    // skips the padding byte after the opcode
     IMP_OP(0x00, BRK,                       // BRK imp
-           cpu->nes->is_active = false;
-           PUSH((--PC >> 8) & 0xFF);
+           PC++;
+           PUSH((PC >> 8) & 0xFF);
            PUSH(PC & 0xFF);
-           FLAGS.c = 1;
-           PUSH(flag_to_u8(FLAGS));
+           PUSH(flag_to_u8(FLAGS) | B | U);
            FLAGS.i = 1;
            PC = (MEM(0xFFFE) | (MEM(0xFFFF) << 8)));
 
     IMP_OP(0x40, RTI,                      // RTI imp
-           FLAGS = u8_to_flag(POP);
+           FLAGS = u8_to_flag((POP & ~B) | U);
            PC = POP; PC |= (POP << 8));
 
     OP(0x20, JSR, ABS16);                  // JSR abs
@@ -648,7 +732,7 @@ void cpu_6502_tick(struct _6502 *cpu)
       PUSH((PC >> 8) & 0xFF);
       PUSH(PC & 0xFF);
 
-      printf("jumping to 0x%X PC=>0x%X (0x%X 0x%X)", addr, PC, (PC >> 8) & 0xFF, (PC & 0xFF));
+      TRACE("jumping to 0x%X PC=>0x%X (0x%X 0x%X)", addr, PC, (PC >> 8) & 0xFF, (PC & 0xFF));
 
       PC = addr;
       break;
@@ -657,7 +741,7 @@ void cpu_6502_tick(struct _6502 *cpu)
     IMP_OP(0x60, RTS,                      // RTS imp
            PC = POP;
            PC += (POP << 8) + 1;
-           printf("returning to addr: 0x%X", PC));
+           TRACE("returning to addr: 0x%X", PC));
 
     OP(0x4C, JMP, ABS);               // JMP abs
     OP(0x6C, JMP, IMP);               // JMP ind
@@ -666,29 +750,24 @@ void cpu_6502_tick(struct _6502 *cpu)
       addr = PCVAL;
       addr |= PCVAL << 8;
 
-      // XXX: this is an ugly hack
-      if((cpu->nes->rom->map->num == NROM || cpu->nes->rom->map->num == CNROM)
-         && addr == 0x2FF) {
-        PC = 0x300;
-      } else {
-        u8 b1 = MEM(addr), b2 = MEM(addr + 1);
-        PC = b2 << 8;
-        PC |= b1;
-      }
+      // the high byte comes from the same page, JMP ($02FF) reads $0200
+      u8 b1 = MEM(addr), b2 = MEM((addr & 0xFF00) | ((addr + 1) & 0xFF));
+      PC = b2 << 8;
+      PC |= b1;
 
     } else {
       PC = addr;
     }
 
-    printf("PC = 0x%X", PC);
+    TRACE("PC = 0x%X", PC);
     break;
 
     OP(0x24, BIT, ZP);        // BIT zp
     OP(0x2C, BIT, ABS);       // BIT abs
   BIT: {
-      FLAGS.n = val;
+      FLAGS.n = 0x80 & val;
       FLAGS.v = 0x40 & val;
-      FLAGS.z = val & A;
+      FLAGS.z = !(val & A);
       break;
     }
 
@@ -737,6 +816,173 @@ void cpu_6502_tick(struct _6502 *cpu)
     IMP_OP(0xDC, NOP, ABX);         // NOP abx
     IMP_OP(0xFC, NOP, ABX);         // NOP abx
 
+    ///// Unofficial operations, read-modify-write ops and loads / stores
+    ///// combined, as used by nestest and blargg's instr_test
+
+    // SLO, ASL then ORA
+    OP(0x07, SLO, ZP);       // SLO zp
+    OP(0x17, SLO, ZPX);      // SLO zpx
+    OP(0x03, SLO, IZX);      // SLO izx
+    OP(0x13, SLO, RMW_IZY);  // SLO izy
+    OP(0x0F, SLO, ABS);      // SLO abs
+    OP(0x1F, SLO, RMW_ABX);  // SLO abx
+    OP(0x1B, SLO, RMW_ABY);  // SLO aby
+  SLO:
+    FLAGS.c = (val & 0x80) ? 1 : 0;
+    val <<= 1;
+    SETMEM(addr, val);
+    goto ORA;
+
+    // RLA, ROL then AND
+    OP(0x27, RLA, ZP);       // RLA zp
+    OP(0x37, RLA, ZPX);      // RLA zpx
+    OP(0x23, RLA, IZX);      // RLA izx
+    OP(0x33, RLA, RMW_IZY);  // RLA izy
+    OP(0x2F, RLA, ABS);      // RLA abs
+    OP(0x3F, RLA, RMW_ABX);  // RLA abx
+    OP(0x3B, RLA, RMW_ABY);  // RLA aby
+  RLA: {
+      u8 carry = FLAGS.c;
+      FLAGS.c = (val & 0x80) ? 1 : 0;
+      val = (val << 1) | carry;
+      SETMEM(addr, val);
+      goto AND;
+    }
+
+    // SRE, LSR then EOR
+    OP(0x47, SRE, ZP);       // SRE zp
+    OP(0x57, SRE, ZPX);      // SRE zpx
+    OP(0x43, SRE, IZX);      // SRE izx
+    OP(0x53, SRE, RMW_IZY);  // SRE izy
+    OP(0x4F, SRE, ABS);      // SRE abs
+    OP(0x5F, SRE, RMW_ABX);  // SRE abx
+    OP(0x5B, SRE, RMW_ABY);  // SRE aby
+  SRE:
+    FLAGS.c = val & 0x01;
+    val >>= 1;
+    SETMEM(addr, val);
+    goto EOR;
+
+    // RRA, ROR then ADC with the carry ROR left
+    OP(0x67, RRA, ZP);       // RRA zp
+    OP(0x77, RRA, ZPX);      // RRA zpx
+    OP(0x63, RRA, IZX);      // RRA izx
+    OP(0x73, RRA, RMW_IZY);  // RRA izy
+    OP(0x6F, RRA, ABS);      // RRA abs
+    OP(0x7F, RRA, RMW_ABX);  // RRA abx
+    OP(0x7B, RRA, RMW_ABY);  // RRA aby
+  RRA: {
+      u8 carry = FLAGS.c;
+      FLAGS.c = val & 0x01;
+      val = (val >> 1) | (carry << 7);
+      SETMEM(addr, val);
+      goto ADC;
+    }
+
+    // DCP, DEC then CMP
+    OP(0xC7, DCP, ZP);       // DCP zp
+    OP(0xD7, DCP, ZPX);      // DCP zpx
+    OP(0xC3, DCP, IZX);      // DCP izx
+    OP(0xD3, DCP, RMW_IZY);  // DCP izy
+    OP(0xCF, DCP, ABS);      // DCP abs
+    OP(0xDF, DCP, RMW_ABX);  // DCP abx
+    OP(0xDB, DCP, RMW_ABY);  // DCP aby
+  DCP:
+    val -= 1;
+    SETMEM(addr, val);
+    goto CMP;
+
+    // ISB, INC then SBC
+    OP(0xE7, ISB, ZP);       // ISB zp
+    OP(0xF7, ISB, ZPX);      // ISB zpx
+    OP(0xE3, ISB, IZX);      // ISB izx
+    OP(0xF3, ISB, RMW_IZY);  // ISB izy
+    OP(0xEF, ISB, ABS);      // ISB abs
+    OP(0xFF, ISB, RMW_ABX);  // ISB abx
+    OP(0xFB, ISB, RMW_ABY);  // ISB aby
+  ISB:
+    val += 1;
+    SETMEM(addr, val);
+    goto SBC;
+
+    // LAX, LDA and LDX at once
+    OP(0xAB, LAX, IMM);      // LAX imm
+    OP(0xA7, LAX, ZP);       // LAX zp
+    OP(0xB7, LAX, ZPY);      // LAX zpy
+    OP(0xA3, LAX, IZX);      // LAX izx
+    OP(0xB3, LAX, IZY);      // LAX izy
+    OP(0xAF, LAX, ABS);      // LAX abs
+    OP(0xBF, LAX, ABY);      // LAX aby
+  LAX:
+    A = X = val;
+    SET_FLAGS(N|Z, A);
+    break;
+
+    // SAX, stores A & X
+    STORE_OP(0x87, SAX, ZP);  // SAX zp
+    STORE_OP(0x97, SAX, ZPY); // SAX zpy
+    STORE_OP(0x83, SAX, IZX); // SAX izx
+    STORE_OP(0x8F, SAX, ABS); // SAX abs
+  SAX:
+    SETMEM(addr, A & X);
+    break;
+
+    // SHY / SHX store the register ANDed with the address' high byte + 1,
+    // which also replaces the high byte when indexing crossed a page
+    STORE_OP(0x9C, SHY, ABX); // SHY abx
+    STORE_OP(0x9E, SHX, ABY); // SHX aby
+  SHY:
+    val = Y;
+    goto SHX_SHY;
+  SHX:
+    val = X;
+  SHX_SHY: {
+      u16 base = addr - (op == 0x9C ? X : Y);
+      val &= (base >> 8) + 1;
+      if(crossed) addr = (val << 8) | (addr & 0xFF);
+      SETMEM(addr, val);
+      break;
+    }
+
+    OP(0xBB, LAS, ABY);      // LAS aby
+  LAS:
+    A = X = SP = val & SP;
+    SET_FLAGS(N|Z, A);
+    break;
+
+    OP(0x0B, ANC, IMM);      // ANC imm
+    OP(0x2B, ANC, IMM);      // ANC imm
+  ANC:
+    A &= val;
+    SET_FLAGS(N|Z, A);
+    FLAGS.c = FLAGS.n;
+    break;
+
+    OP(0x4B, ALR, IMM);      // ALR imm
+  ALR:
+    A &= val;
+    FLAGS.c = A & 0x01;
+    A >>= 1;
+    SET_FLAGS(N|Z, A);
+    break;
+
+    OP(0x6B, ARR, IMM);      // ARR imm
+  ARR:
+    A = ((A & val) >> 1) | (FLAGS.c << 7);
+    SET_FLAGS(N|Z, A);
+    FLAGS.c = (A >> 6) & 1;
+    FLAGS.v = ((A >> 6) ^ (A >> 5)) & 1;
+    break;
+
+    OP(0xCB, AXS, IMM);      // AXS imm
+  AXS: {
+      u8 ax = A & X;
+      FLAGS.c = ax >= val;
+      X = ax - val;
+      SET_FLAGS(N|Z, X);
+      break;
+    }
+
     ///// KIL
     OP(0x02, KIL, IMP);  // KIL imp
     OP(0x12, KIL, IMP);  // KIL imp
@@ -761,19 +1007,22 @@ void cpu_6502_tick(struct _6502 *cpu)
     break;
   } // switch (op)
 
-  puts("");
+  TRACE("\n");
 
-  cpu->ticks += cycles[op];
+  u32 c = cycles[op] + extra;
+  if(cpu->profile) profile_count(cpu->profile, cpu->nes->rom->map, at, c);
+
+  cpu->ticks += c;
 }
 
 
-// TODO: ditch cycles table and do it by hand (every mem r/w is a cycle, etc.)
+// without page crossings and taken branches, see extra in cpu_6502_tick
 const u8 cycles[0x100] = {
   //0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
   7, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6, // 0
   2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 1
-  6, 6, 0, 8, 3, 3, 5, 5, 4, 3, 3, 3, 4, 4, 6, 6, // 2
-  2, 5, 0, 8, 4, 4, 6, 6, 3, 4, 3, 7, 4, 4, 7, 7, // 3
+  6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6, // 2
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 3
   6, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6, // 4
   2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 5
   6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6, // 6
@@ -787,3 +1036,95 @@ const u8 cycles[0x100] = {
   2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, // E
   2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7  // F
 };
+
+// the mnemonics and modes of the switch in cpu_6502_tick, for disassembly
+const char opcode_names[0x100][4] = {
+  // 0      1      2      3      4      5      6      7      8      9      A      B      C      D      E      F
+  "BRK", "ORA", "KIL", "SLO", "NOP", "ORA", "ASL", "SLO", "PHP", "ORA", "ASL", "ANC", "NOP", "ORA", "ASL", "SLO", // 0
+  "BPL", "ORA", "KIL", "SLO", "NOP", "ORA", "ASL", "SLO", "CLC", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO", // 1
+  "JSR", "AND", "KIL", "RLA", "BIT", "AND", "ROL", "RLA", "PLP", "AND", "ROL", "ANC", "BIT", "AND", "ROL", "RLA", // 2
+  "BMI", "AND", "KIL", "RLA", "NOP", "AND", "ROL", "RLA", "SEC", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA", // 3
+  "RTI", "EOR", "KIL", "SRE", "NOP", "EOR", "LSR", "SRE", "PHA", "EOR", "LSR", "ALR", "JMP", "EOR", "LSR", "SRE", // 4
+  "BVC", "EOR", "KIL", "SRE", "NOP", "EOR", "LSR", "SRE", "CLI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE", // 5
+  "RTS", "ADC", "KIL", "RRA", "NOP", "ADC", "ROR", "RRA", "PLA", "ADC", "ROR", "ARR", "JMP", "ADC", "ROR", "RRA", // 6
+  "BVS", "ADC", "KIL", "RRA", "NOP", "ADC", "ROR", "RRA", "SEI", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA", // 7
+  "NOP", "STA", "NOP", "SAX", "STY", "STA", "STX", "SAX", "DEY", "NOP", "TXA", "???", "STY", "STA", "STX", "SAX", // 8
+  "BCC", "STA", "KIL", "???", "STY", "STA", "STX", "SAX", "TYA", "STA", "TXS", "???", "SHY", "STA", "SHX", "???", // 9
+  "LDY", "LDA", "LDX", "LAX", "LDY", "LDA", "LDX", "LAX", "TAY", "LDA", "TAX", "LAX", "LDY", "LDA", "LDX", "LAX", // A
+  "BCS", "LDA", "KIL", "LAX", "LDY", "LDA", "LDX", "LAX", "CLV", "LDA", "TSX", "LAS", "LDY", "LDA", "LDX", "LAX", // B
+  "CPY", "CMP", "NOP", "DCP", "CPY", "CMP", "DEC", "DCP", "INY", "CMP", "DEX", "AXS", "CPY", "CMP", "DEC", "DCP", // C
+  "BNE", "CMP", "KIL", "DCP", "NOP", "CMP", "DEC", "DCP", "CLD", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP", // D
+  "CPX", "SBC", "NOP", "ISB", "CPX", "SBC", "INC", "ISB", "INX", "SBC", "NOP", "SBC", "CPX", "SBC", "INC", "ISB", // E
+  "BEQ", "SBC", "KIL", "ISB", "NOP", "SBC", "INC", "ISB", "SED", "SBC", "NOP", "ISB", "NOP", "SBC", "INC", "ISB"  // F
+};
+
+const u8 opcode_modes[0x100] = {
+  // 0        1         2         3         4         5         6         7
+  MODE_IMP, MODE_IZX, MODE_IMP, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // 00
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // 08
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPX, MODE_ZPX, // 10
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABX, MODE_ABX, // 18
+  MODE_ABS, MODE_IZX, MODE_IMP, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // 20
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // 28
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPX, MODE_ZPX, // 30
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABX, MODE_ABX, // 38
+  MODE_IMP, MODE_IZX, MODE_IMP, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // 40
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // 48
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPX, MODE_ZPX, // 50
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABX, MODE_ABX, // 58
+  MODE_IMP, MODE_IZX, MODE_IMP, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // 60
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_IND, MODE_ABS, MODE_ABS, MODE_ABS, // 68
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPX, MODE_ZPX, // 70
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABX, MODE_ABX, // 78
+  MODE_IMM, MODE_IZX, MODE_IMM, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // 80
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMP, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // 88
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IMP, MODE_ZPX, MODE_ZPX, MODE_ZPY, MODE_ZPY, // 90
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_IMP, MODE_ABX, MODE_ABX, MODE_ABY, MODE_IMP, // 98
+  MODE_IMM, MODE_IZX, MODE_IMM, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // A0
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // A8
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPY, MODE_ZPY, // B0
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABY, MODE_ABY, // B8
+  MODE_IMM, MODE_IZX, MODE_IMM, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // C0
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // C8
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPX, MODE_ZPX, // D0
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABX, MODE_ABX, // D8
+  MODE_IMM, MODE_IZX, MODE_IMM, MODE_IZX, MODE_ZP,  MODE_ZP,  MODE_ZP,  MODE_ZP,  // E0
+  MODE_IMP, MODE_IMM, MODE_IMP, MODE_IMM, MODE_ABS, MODE_ABS, MODE_ABS, MODE_ABS, // E8
+  MODE_REL, MODE_IZY, MODE_IMP, MODE_IZY, MODE_ZPX, MODE_ZPX, MODE_ZPX, MODE_ZPX, // F0
+  MODE_IMP, MODE_ABY, MODE_IMP, MODE_ABY, MODE_ABX, MODE_ABX, MODE_ABX, MODE_ABX  // F8
+};
+
+u32 cpu_6502_length(u8 op)
+{
+  switch(opcode_modes[op]) {
+  case MODE_IMP:
+    return 1;
+  case MODE_ABS: case MODE_ABX: case MODE_ABY: case MODE_IND:
+    return 3;
+  default:
+    return 2;
+  }
+}
+
+// bytes is the opcode and the two bytes after it, found at pc
+int cpu_6502_disassemble(const u8* bytes, u16 pc, char* buf, size_t size)
+{
+  u8 op = bytes[0], b = bytes[1];
+  u16 w = create_u16(bytes[1], bytes[2]);
+  const char* name = opcode_names[op];
+
+  switch(opcode_modes[op]) {
+  case MODE_IMM: return snprintf(buf, size, "%s #$%02X", name, b);
+  case MODE_ZP:  return snprintf(buf, size, "%s $%02X", name, b);
+  case MODE_ZPX: return snprintf(buf, size, "%s $%02X,X", name, b);
+  case MODE_ZPY: return snprintf(buf, size, "%s $%02X,Y", name, b);
+  case MODE_IZX: return snprintf(buf, size, "%s ($%02X,X)", name, b);
+  case MODE_IZY: return snprintf(buf, size, "%s ($%02X),Y", name, b);
+  case MODE_ABS: return snprintf(buf, size, "%s $%04X", name, w);
+  case MODE_ABX: return snprintf(buf, size, "%s $%04X,X", name, w);
+  case MODE_ABY: return snprintf(buf, size, "%s $%04X,Y", name, w);
+  case MODE_IND: return snprintf(buf, size, "%s ($%04X)", name, w);
+  case MODE_REL: return snprintf(buf, size, "%s $%04X", name, (u16)(pc + 2 + (int8_t)b));
+  default:       return snprintf(buf, size, "%s", name);
+  }
+}
@@ -19,40 +19,413 @@
 /* emulation of the NES' Audio Processing Unit */
 
 #include "apu.h"
+#include "6502.h"
+#include "nes.h"
 
-struct APU* apu_create(struct NES* nes)
+#include <string.h>
+
+static const u8 length_table[32] = {
+  10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+  12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const u8 duty_table[4][8] = {
+  { 0, 1, 0, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 1, 1, 0, 0, 0 },
+  { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const u8 triangle_table[32] = {
+  15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+// in CPU cycles
+static const u16 noise_table[16] = {
+  4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+void apu_init(struct APU* apu, struct NES* nes)
 {
-  struct APU* apu = malloc(sizeof(struct APU));
+  memset(apu, 0, sizeof(struct APU));
   apu->nes = nes;
+  apu->r.noise.shift = 1;
+}
 
-  return apu;
+void apu_reset(struct APU* apu)
+{
+  // silences all channels, the frame counter mode is kept
+  apu_write(apu, 0x4015, 0);
+  apu->r.frame_cycle = 0;
 }
 
-void apu_free(struct APU* apu)
+void apu_powerup(struct APU* apu)
 {
-  free(apu);
+  memset(&apu->r, 0, sizeof(apu->r));
+  apu->r.noise.shift = 1;
+  apu->sample_count = 0;
 }
 
-void apu_reset(struct APU* apu)
+/* Frame counter clocks, see http://wiki.nesdev.com/w/index.php/APU_Frame_Counter */
+
+static void apu_clock_envelope(struct apu_envelope* env)
 {
-  (void)apu;
-  // TODO:
+  if(env->start) {
+    env->start = false;
+    env->decay = 15;
+    env->divider = env->volume;
+  } else if(env->divider == 0) {
+    env->divider = env->volume;
+    if(env->decay) env->decay--;
+    else if(env->loop) env->decay = 15;
+  } else {
+    env->divider--;
+  }
 }
 
-void apu_powerup(struct APU* apu)
+// the period a sweep would change to, pulse 1 negates with ones' complement
+static u16 apu_sweep_target(struct apu_pulse* p, int channel)
+{
+  u16 change = p->period >> p->sweep_shift;
+
+  if(!p->sweep_negate) return p->period + change;
+
+  return p->period - change - (channel == 0);
+}
+
+static bool apu_sweep_mute(struct apu_pulse* p, int channel)
+{
+  return p->period < 8 || apu_sweep_target(p, channel) > 0x7FF;
+}
+
+static void apu_quarter_frame(struct APU* apu)
+{
+  apu_clock_envelope(&apu->r.pulse[0].env);
+  apu_clock_envelope(&apu->r.pulse[1].env);
+  apu_clock_envelope(&apu->r.noise.env);
+
+  struct apu_triangle* t = &apu->r.triangle;
+
+  if(t->linear_start)
+    t->linear = t->linear_reload;
+  else if(t->linear)
+    t->linear--;
+
+  if(!t->control) t->linear_start = false;
+}
+
+static void apu_half_frame(struct APU* apu)
+{
+  for(int i = 0; i < 2; ++i) {
+    struct apu_pulse* p = &apu->r.pulse[i];
+
+    if(p->length && !p->env.loop) p->length--;
+
+    if(p->sweep_divider == 0 && p->sweep_enabled && p->sweep_shift && !apu_sweep_mute(p, i))
+      p->period = apu_sweep_target(p, i);
+
+    if(p->sweep_divider == 0 || p->sweep_reload) {
+      p->sweep_divider = p->sweep_period;
+      p->sweep_reload = false;
+    } else {
+      p->sweep_divider--;
+    }
+  }
+
+  if(apu->r.triangle.length && !apu->r.triangle.control) apu->r.triangle.length--;
+  if(apu->r.noise.length && !apu->r.noise.env.loop) apu->r.noise.length--;
+}
+
+static void apu_set_frame_irq(struct APU* apu, bool level)
+{
+  apu->r.frame_irq = level;
+  cpu_6502_set_irq(apu->nes->cpu, IRQ_APU, level);
+}
+
+static void apu_frame_counter(struct APU* apu)
+{
+  switch(++apu->r.frame_cycle) {
+  case 7457:
+  case 22371:
+    apu_quarter_frame(apu);
+    break;
+  case 14913:
+    apu_quarter_frame(apu);
+    apu_half_frame(apu);
+    break;
+  case 29829:
+    if(!apu->r.five_step) {
+      apu_quarter_frame(apu);
+      apu_half_frame(apu);
+      apu->r.frame_cycle = 0;
+
+      if(!apu->r.irq_inhibit) apu_set_frame_irq(apu, true);
+    }
+    break;
+  case 37281:
+    apu_quarter_frame(apu);
+    apu_half_frame(apu);
+    apu->r.frame_cycle = 0;
+    break;
+  }
+}
+
+// cycles until the frame counter reaches its next step, at least 1
+static u32 apu_frame_distance(struct APU* apu)
+{
+  static const u32 steps[] = { 7457, 14913, 22371, 29829, 37281 };
+
+  for(u32 i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i) {
+    if(apu->r.frame_cycle < steps[i]) return steps[i] - apu->r.frame_cycle;
+  }
+
+  return UINT32_MAX;
+}
+
+static u8 apu_envelope_volume(struct apu_envelope* env)
+{
+  return env->constant ? env->volume : env->decay;
+}
+
+// clocks a timer counting down to 0 and reloading from period, returns
+// how many times it reloaded
+static u32 apu_divider(u16* timer, u16 period, u32 clocks)
+{
+  if(clocks <= *timer) {
+    *timer -= clocks;
+    return 0;
+  }
+
+  clocks -= *timer + 1;
+  u32 reloads = 1;
+
+  // silent channels often sit at period 0, spare them the division
+  if(clocks > period) {
+    reloads += period ? clocks / (period + 1) : clocks;
+    clocks = period ? clocks % (period + 1) : 0;
+  }
+
+  *timer = period - clocks;
+  return reloads;
+}
+
+// the channel timers over the next cycles cycles
+static void apu_clock_timers(struct APU* apu, u32 cycles)
 {
-  (void)apu;
-  // TODO:
+  struct apu_triangle* t = &apu->r.triangle;
+  u32 steps = apu_divider(&t->timer, t->period, cycles);
+
+  if(t->length && t->linear) t->step = (t->step + steps) & 31;
+
+  struct apu_noise* n = &apu->r.noise;
+
+  for(steps = apu_divider(&n->timer, n->period, cycles); steps; --steps) {
+    u16 feedback = (n->shift ^ (n->shift >> (n->mode ? 6 : 1))) & 1;
+    n->shift = (n->shift >> 1) | (feedback << 14);
+  }
+
+  // the pulses only on every other cycle, the ones odd flips back from
+  u32 clocks = (cycles + apu->r.odd) / 2;
+  apu->r.odd ^= cycles & 1;
+
+  for(int i = 0; i < 2; ++i) {
+    struct apu_pulse* p = &apu->r.pulse[i];
+    p->step = (p->step + apu_divider(&p->timer, p->period, clocks)) & 7;
+  }
+}
+
+// linear approximation of the mixer, http://wiki.nesdev.com/w/index.php/APU_Mixer
+static s16 apu_mix(struct APU* apu)
+{
+  u8 pulse = 0;
+
+  for(int i = 0; i < 2; ++i) {
+    struct apu_pulse* p = &apu->r.pulse[i];
+
+    if(p->length && duty_table[p->duty][p->step] && !apu_sweep_mute(p, i))
+      pulse += apu_envelope_volume(&p->env);
+  }
+
+  u8 triangle = triangle_table[apu->r.triangle.step];
+  u8 noise = (apu->r.noise.length && !(apu->r.noise.shift & 1))
+    ? apu_envelope_volume(&apu->r.noise.env) : 0;
+
+  float out = 0.00752f * pulse + 0.00851f * triangle + 0.00494f * noise;
+
+  return (s16)(out * 65535.0f) - 16384;
 }
 
+/*
+  Runs in spans that end on the next frame counter step or sample, or when
+  the cycles run out. Only the last cycle of a span can step the frame
+  counter (which happens before that cycle's timers) or take a sample
+  (after them), so the timers in between are clocked all at once.
+*/
+void apu_run(struct APU* apu, u32 cycles)
+{
+  while(cycles) {
+    u32 frame = apu_frame_distance(apu);
+    u32 span = frame < cycles ? frame : cycles;
+
+    if(apu->suppress_output) {
+      apu->r.frame_cycle += span - 1;
+      apu_frame_counter(apu);
+      cycles -= span;
+      continue;
+    }
+
+    // point sampled, once every APU_CPU_CLOCK / APU_SAMPLE_RATE cycles
+    u32 sample = (APU_CPU_CLOCK - apu->r.sample_phase + APU_SAMPLE_RATE - 1) / APU_SAMPLE_RATE;
+    if(sample < span) span = sample;
+    cycles -= span;
+
+    if(span == frame) {
+      apu->r.frame_cycle += span - 1;
+      apu_clock_timers(apu, span - 1);
+      apu_frame_counter(apu);
+      apu_clock_timers(apu, 1);
+    } else {
+      apu->r.frame_cycle += span;
+      apu_clock_timers(apu, span);
+    }
+
+    apu->r.sample_phase += span * APU_SAMPLE_RATE;
+    if(apu->r.sample_phase >= APU_CPU_CLOCK) {
+      apu->r.sample_phase -= APU_CPU_CLOCK;
+
+      if(apu->sample_count < APU_SAMPLES)
+        apu->samples[apu->sample_count++] = apu_mix(apu);
+    }
+  }
+}
+
+/* How many cycles the APU can run before it raises the frame IRQ, the one
+   thing it does that the CPU sees without reading $4015; UINT32_MAX when
+   it won't. */
+u32 apu_cycles_to_event(struct APU* apu)
+{
+  if(apu->r.five_step || apu->r.irq_inhibit || apu->r.frame_cycle >= 29829) return UINT32_MAX;
+
+  return 29829 - apu->r.frame_cycle;
+}
 
 void apu_tick(struct APU* apu)
 {
-  (void)apu;
-  // TODO
+  apu_run(apu, 1);
+}
+
+static void apu_write_envelope(struct apu_envelope* env, u8 val)
+{
+  env->loop = (val >> 5) & 1;
+  env->constant = (val >> 4) & 1;
+  env->volume = val & 0xF;
+}
+
+// $4000 - $4017, except for OAM DMA ($4014), the controllers ($4016) and the
+// DMC ($4010 - $4013), which is not emulated
+void apu_write(struct APU* apu, u16 addr, u8 val)
+{
+  struct apu_pulse* p = &apu->r.pulse[(addr >> 2) & 1];
+  struct apu_triangle* t = &apu->r.triangle;
+  struct apu_noise* n = &apu->r.noise;
+
+  switch(addr) {
+  case 0x4000: case 0x4004:
+    p->duty = val >> 6;
+    apu_write_envelope(&p->env, val);
+    break;
+  case 0x4001: case 0x4005:
+    p->sweep_enabled = val >> 7;
+    p->sweep_period = (val >> 4) & 7;
+    p->sweep_negate = (val >> 3) & 1;
+    p->sweep_shift = val & 7;
+    p->sweep_reload = true;
+    break;
+  case 0x4002: case 0x4006:
+    p->period = (p->period & 0x700) | val;
+    break;
+  case 0x4003: case 0x4007:
+    p->period = (p->period & 0xFF) | ((val & 7) << 8);
+    if(p->enabled) p->length = length_table[val >> 3];
+    p->step = 0;
+    p->env.start = true;
+    break;
+
+  case 0x4008:
+    t->control = val >> 7;
+    t->linear_reload = val & 0x7F;
+    break;
+  case 0x400A:
+    t->period = (t->period & 0x700) | val;
+    break;
+  case 0x400B:
+    t->period = (t->period & 0xFF) | ((val & 7) << 8);
+    if(t->enabled) t->length = length_table[val >> 3];
+    t->linear_start = true;
+    break;
+
+  case 0x400C:
+    apu_write_envelope(&n->env, val);
+    break;
+  case 0x400E:
+    n->mode = val >> 7;
+    n->period = noise_table[val & 0xF];
+    break;
+  case 0x400F:
+    if(n->enabled) n->length = length_table[val >> 3];
+    n->env.start = true;
+    break;
+
+  case 0x4015:
+    apu->r.pulse[0].enabled = val & 1;
+    apu->r.pulse[1].enabled = (val >> 1) & 1;
+    t->enabled = (val >> 2) & 1;
+    n->enabled = (val >> 3) & 1;
+
+    if(!apu->r.pulse[0].enabled) apu->r.pulse[0].length = 0;
+    if(!apu->r.pulse[1].enabled) apu->r.pulse[1].length = 0;
+    if(!t->enabled) t->length = 0;
+    if(!n->enabled) n->length = 0;
+    break;
+
+  case 0x4017:
+    apu->r.five_step = val >> 7;
+    apu->r.irq_inhibit = (val >> 6) & 1;
+    apu->r.frame_cycle = 0;
+
+    if(apu->r.irq_inhibit && apu->r.frame_irq) apu_set_frame_irq(apu, false);
+
+    if(apu->r.five_step) {
+      apu_quarter_frame(apu);
+      apu_half_frame(apu);
+    }
+    break;
+  }
+}
+
+static u8 apu_status(struct APU* apu)
+{
+  return (apu->r.pulse[0].length ? 0x01 : 0)
+    | (apu->r.pulse[1].length ? 0x02 : 0)
+    | (apu->r.triangle.length ? 0x04 : 0)
+    | (apu->r.noise.length ? 0x08 : 0)
+    | (apu->r.frame_irq ? 0x40 : 0);
+}
+
+// $4015, which length counters are still running and the frame IRQ flag,
+// reading acknowledges the frame IRQ
+u8 apu_read_status(struct APU* apu)
+{
+  u8 status = apu_status(apu);
+
+  if(apu->r.frame_irq) apu_set_frame_irq(apu, false);
+
+  return status;
 }
 
 void apu_inspect(struct APU* apu)
 {
-  LOGF("TODO: apu_inspect(struct APU*) %p", (void*)apu);
+  printf("APU = { status=0x%X frame_cycle=%u samples=%u }\n",
+         apu_status(apu), apu->r.frame_cycle, apu->sample_count);
 }
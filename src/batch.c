@@ -0,0 +1,611 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* lockstep batches, see batch.h */
+
+#include "batch.h"
+#include "6502.h"
+#include "2C02.h"
+#include "apu.h"
+#include "mapper.h"
+#include "nes.h"
+#include "profile.h"
+#include "rom.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum batch_flags {
+  C = 1 << 0,  Z = 1 << 1,  I = 1 << 2,  D = 1 << 3,
+  B = 1 << 4,  U = 1 << 5,  V = 1 << 6,  N = 1 << 7
+};
+
+static inline u8 nz(u8 v) { return (v & N) | (v ? 0 : Z); }
+
+struct batch* batch_create(struct NES** nes, u32 count)
+{
+  for(u32 i = 1; i < count; ++i) {
+    if(!nes[i]->rom || nes[i]->rom->img != nes[0]->rom->img) {
+      LOGF("Batched instances have to share one ROM image");
+      return NULL;
+    }
+  }
+
+  struct batch* b = malloc(sizeof(struct batch));
+  memset(b, 0, sizeof(struct batch));
+
+  b->count = count;
+  b->nes = nes;
+
+  b->a  = malloc(count);
+  b->x  = malloc(count);
+  b->y  = malloc(count);
+  b->sp = malloc(count);
+  b->p  = malloc(count);
+  b->pc = malloc(count * sizeof(u16));
+
+  b->code    = malloc(count * sizeof(const u8*));
+  b->group   = malloc(count);
+  b->slot    = malloc(count * sizeof(u32));
+
+  for(b->buckets = 2; b->buckets < 2 * count; b->buckets *= 2);
+  b->keys    = malloc(b->buckets * sizeof(const u8*));
+  b->sizes   = malloc(b->buckets * sizeof(u32));
+  b->stepped = malloc(count);
+  b->running = malloc(count);
+  b->frame   = malloc(count * sizeof(u32));
+  b->ram     = malloc(count * sizeof(u8*));
+  b->banks   = malloc(count * sizeof(u8**));
+  b->pending = malloc(count * sizeof(u32));
+  b->until   = malloc(count * sizeof(u32));
+  b->val     = malloc(count);
+  b->addr    = malloc(count * sizeof(u16));
+  b->extra   = calloc(count, 1);
+  b->at      = malloc(count * sizeof(u16));
+
+  for(u32 i = 0; i < count; ++i) {
+    b->ram[i] = nes[i]->mem->lowmem;
+    b->banks[i] = nes[i]->rom->map->rom_banks;
+  }
+
+  return b;
+}
+
+void batch_free(struct batch* b)
+{
+  free(b->a);
+  free(b->x);
+  free(b->y);
+  free(b->sp);
+  free(b->p);
+  free(b->pc);
+  free(b->code);
+  free(b->group);
+  free(b->slot);
+  free(b->keys);
+  free(b->sizes);
+  free(b->stepped);
+  free(b->running);
+  free(b->frame);
+  free(b->ram);
+  free(b->banks);
+  free(b->pending);
+  free(b->until);
+  free(b->val);
+  free(b->addr);
+  free(b->extra);
+  free(b->at);
+  free(b);
+}
+
+static void batch_load(struct batch* b, u32 i)
+{
+  struct registers* r = &b->nes[i]->cpu->r;
+
+  b->a[i]  = r->a;
+  b->x[i]  = r->x;
+  b->y[i]  = r->y;
+  b->sp[i] = r->sp;
+  b->p[i]  = flag_to_u8(r->flags);
+  b->pc[i] = r->pc;
+}
+
+static void batch_store(struct batch* b, u32 i)
+{
+  struct registers* r = &b->nes[i]->cpu->r;
+
+  r->a  = b->a[i];
+  r->x  = b->x[i];
+  r->y  = b->y[i];
+  r->sp = b->sp[i];
+  r->flags = u8_to_flag(b->p[i]);
+  r->pc = b->pc[i];
+}
+
+static bool batch_interrupt_pending(struct batch* b, u32 i)
+{
+  struct interrupts* intr = &b->nes[i]->cpu->intr;
+
+  return intr->reset || intr->nmi || (intr->irq_sources && !(b->p[i] & I));
+}
+
+// the instruction bytes at a lane's PC, NULL unless they're all in one PRG ROM page
+static const u8* batch_code(struct batch* b, u32 i)
+{
+  u16 pc = b->pc[i];
+
+  if(pc < 0x8000 || (pc & (ROM_BANK_SIZE - 1)) > ROM_BANK_SIZE - 3) return NULL;
+
+  return b->banks[i][pc / ROM_BANK_SIZE] + (pc & (ROM_BANK_SIZE - 1));
+}
+
+// the operand of a step for every lane: val, and for memory operands their
+// lowmem offset in addr. False for operands that may be outside of RAM.
+static bool batch_operand(struct batch* b, u8 op, const u8* code)
+{
+  u32 n = b->count;
+  const u8* g = b->group;
+  u8 *x = b->x, *y = b->y, *val = b->val, *extra = b->extra;
+  u16* addr = b->addr;
+  u8** ram = b->ram;
+  u8 imm = code[1];
+  u16 w = create_u16(code[1], code[2]);
+
+  switch(opcode_modes[op]) {
+  case MODE_IMM:
+    memset(val, imm, n);
+    return true;
+
+  case MODE_ZP:  for(u32 i = 0; i < n; ++i) addr[i] = imm; break;
+  case MODE_ZPX: for(u32 i = 0; i < n; ++i) addr[i] = (u8)(imm + x[i]); break;
+  case MODE_ZPY: for(u32 i = 0; i < n; ++i) addr[i] = (u8)(imm + y[i]); break;
+
+  case MODE_ABS:
+    if(w >= 0x2000) return false;
+    for(u32 i = 0; i < n; ++i) addr[i] = w & 0x7FF;
+    break;
+
+  // reads take a cycle more when indexing crosses a page, stores and
+  // read-modify-write (5 and 7 cycles) always take it
+  case MODE_ABX:
+  case MODE_ABY: {
+    if(w + 0xFF >= 0x2000) return false;
+
+    const u8* index = opcode_modes[op] == MODE_ABX ? x : y;
+    u8 reads = cycles[op] == 4;
+
+    for(u32 i = 0; i < n; ++i) {
+      u16 e = w + index[i];
+      addr[i] = e & 0x7FF;
+      extra[i] = g[i] & reads & ((e ^ w) > 0xFF);
+    }
+    break;
+  }
+
+  default:
+    return false;
+  }
+
+  for(u32 i = 0; i < n; ++i) val[i] = ram[i][addr[i]];
+  return true;
+}
+
+/* The kernels. Every one runs over all lanes and only keeps the result of
+   lanes in the group, so most loops have no branches. */
+
+#define LANES for(u32 i = 0; i < n; ++i)
+#define SELECT(dst, val) dst[i] = g[i] ? (u8)(val) : dst[i]
+#define OPERAND if(!batch_operand(b, op, code)) return false
+#define RAM_OPS(k) INST(b->ram_ops = (k))
+
+// sets reg and N, Z from expr
+#define NZ_KERNEL(reg, expr) LANES {                    \
+    u8 v = (expr);                                      \
+    SELECT(reg, v);                                     \
+    SELECT(p, (p[i] & ~(N | Z)) | nz(v));               \
+  }
+
+#define CMP_KERNEL(reg) LANES {                                             \
+    u8 v = reg[i] - val[i];                                                 \
+    SELECT(p, (p[i] & ~(N | Z | C)) | nz(v) | (reg[i] >= val[i] ? C : 0));  \
+  }
+
+#define FLAG_KERNEL(clear, set) LANES { SELECT(p, (p[i] & ~(clear)) | (set)); }
+
+#define STORE_KERNEL(reg) LANES { if(g[i]) ram[i][addr[i]] = reg[i]; }
+
+// shifts and rotates of in (A or the operand), the result r goes to dst
+#define SHIFT_KERNEL(src, dst, result, carry) LANES {                   \
+    if(!g[i]) continue;                                                 \
+    u8 in = (src), r = (result);                                        \
+    dst = r;                                                            \
+    p[i] = (p[i] & ~(N | Z | C)) | nz(r) | (carry);                     \
+  }
+
+#define INC_KERNEL(delta) LANES {                       \
+    if(!g[i]) continue;                                 \
+    u8 v = val[i] + (delta);                            \
+    ram[i][addr[i]] = v;                                \
+    p[i] = (p[i] & ~(N | Z)) | nz(v);                   \
+  }
+
+// the stack is always lowmem too
+#define PUSH(v) ram[i][0x100 | sp[i]--] = (v)
+#define POP     ram[i][0x100 | ++sp[i]]
+
+// taken branches cost one more cycle, two into the next page
+#define BRANCH_KERNEL(flag, taken) LANES {                                \
+    bool t = g[i] && !(p[i] & (flag)) == !(taken);                      \
+    u16 from = pc[i] + 2, next = from + (t ? (int8_t)imm : 0);          \
+    extra[i] = t ? 1 + ((from ^ next) > 0xFF) : 0;                      \
+    pc[i] = g[i] ? next : pc[i];                                        \
+  }
+
+// returns false if op (with this operand) has no kernel, nothing is
+// changed then
+static bool batch_kernel(struct batch* b, u8 op, const u8* code)
+{
+  u32 n = b->count;
+  const u8* g = b->group;
+  u8 *a = b->a, *x = b->x, *y = b->y, *sp = b->sp, *p = b->p;
+  u8 *val = b->val, *extra = b->extra;
+  u16* pc = b->pc;
+  u16* addr = b->addr;
+  u8** ram = b->ram;
+  u8 imm = code[1];
+  u16 w = create_u16(code[1], code[2]);
+
+  // one RAM access for the modes from MODE_ZP to MODE_ABY, but JMP
+  RAM_OPS(opcode_modes[op] >= MODE_ZP && opcode_modes[op] <= MODE_ABY && op != 0x4C);
+
+  switch(op) {
+  // loads, logic, arithmetic and compares of a RAM or immediate operand
+  case 0xA9: case 0xA5: case 0xB5: case 0xAD: case 0xBD: case 0xB9:   // LDA
+    OPERAND; NZ_KERNEL(a, val[i]); break;
+  case 0xA2: case 0xA6: case 0xB6: case 0xAE: case 0xBE:              // LDX
+    OPERAND; NZ_KERNEL(x, val[i]); break;
+  case 0xA0: case 0xA4: case 0xB4: case 0xAC: case 0xBC:              // LDY
+    OPERAND; NZ_KERNEL(y, val[i]); break;
+  case 0x09: case 0x05: case 0x15: case 0x0D: case 0x1D: case 0x19:   // ORA
+    OPERAND; NZ_KERNEL(a, a[i] | val[i]); break;
+  case 0x29: case 0x25: case 0x35: case 0x2D: case 0x3D: case 0x39:   // AND
+    OPERAND; NZ_KERNEL(a, a[i] & val[i]); break;
+  case 0x49: case 0x45: case 0x55: case 0x4D: case 0x5D: case 0x59:   // EOR
+    OPERAND; NZ_KERNEL(a, a[i] ^ val[i]); break;
+  case 0xC9: case 0xC5: case 0xD5: case 0xCD: case 0xDD: case 0xD9:   // CMP
+    OPERAND; CMP_KERNEL(a); break;
+  case 0xE0: case 0xE4: case 0xEC:                                    // CPX
+    OPERAND; CMP_KERNEL(x); break;
+  case 0xC0: case 0xC4: case 0xCC:                                    // CPY
+    OPERAND; CMP_KERNEL(y); break;
+
+  case 0x24: case 0x2C:                                               // BIT
+    OPERAND;
+    LANES { SELECT(p, (p[i] & ~(N | V | Z)) | (val[i] & (N | V)) | ((a[i] & val[i]) ? 0 : Z)); }
+    break;
+
+  case 0x69: case 0x65: case 0x75: case 0x6D: case 0x7D: case 0x79:   // ADC
+    OPERAND;
+    LANES {
+      u16 s = a[i] + val[i] + (p[i] & C);
+      u8 v = s;
+      u8 f = (p[i] & ~(N | Z | C | V)) | nz(v) | (s >> 8) | ((~(a[i] ^ val[i]) & (a[i] ^ v) & 0x80) >> 1);
+      SELECT(a, v);
+      SELECT(p, f);
+    }
+    break;
+
+  case 0xE9: case 0xE5: case 0xF5: case 0xED: case 0xFD: case 0xF9:   // SBC
+    OPERAND;
+    LANES {
+      int s = a[i] - val[i] - !(p[i] & C);
+      u8 v = s;
+      u8 f = (p[i] & ~(N | Z | C | V)) | nz(v) | (s >= 0 ? C : 0) | (((a[i] ^ v) & (a[i] ^ val[i]) & 0x80) >> 1);
+      SELECT(a, v);
+      SELECT(p, f);
+    }
+    break;
+
+  // stores and read-modify-write in RAM
+  case 0x85: case 0x95: case 0x8D: case 0x9D: case 0x99:              // STA
+    OPERAND; STORE_KERNEL(a); break;
+  case 0x86: case 0x96: case 0x8E:                                    // STX
+    OPERAND; STORE_KERNEL(x); break;
+  case 0x84: case 0x94: case 0x8C:                                    // STY
+    OPERAND; STORE_KERNEL(y); break;
+
+  case 0xE6: case 0xF6: case 0xEE: case 0xFE:                         // INC
+    OPERAND; INC_KERNEL(1); RAM_OPS(2); break;
+  case 0xC6: case 0xD6: case 0xCE: case 0xDE:                         // DEC
+    OPERAND; INC_KERNEL(-1); RAM_OPS(2); break;
+
+  case 0x06: case 0x16: case 0x0E: case 0x1E:                         // ASL
+    OPERAND; SHIFT_KERNEL(val[i], ram[i][addr[i]], in << 1, in >> 7); RAM_OPS(2); break;
+  case 0x26: case 0x36: case 0x2E: case 0x3E:                         // ROL
+    OPERAND; SHIFT_KERNEL(val[i], ram[i][addr[i]], (in << 1) | (p[i] & C), in >> 7); RAM_OPS(2); break;
+  case 0x46: case 0x56: case 0x4E: case 0x5E:                         // LSR
+    OPERAND; SHIFT_KERNEL(val[i], ram[i][addr[i]], in >> 1, in & C); RAM_OPS(2); break;
+  case 0x66: case 0x76: case 0x6E: case 0x7E:                         // ROR
+    OPERAND; SHIFT_KERNEL(val[i], ram[i][addr[i]], (in >> 1) | (p[i] & C) << 7, in & C); RAM_OPS(2); break;
+
+  // on A
+  case 0x0A: SHIFT_KERNEL(a[i], a[i], in << 1, in >> 7); break;                         // ASL
+  case 0x2A: SHIFT_KERNEL(a[i], a[i], (in << 1) | (p[i] & C), in >> 7); break;          // ROL
+  case 0x4A: SHIFT_KERNEL(a[i], a[i], in >> 1, in & C); break;                          // LSR
+  case 0x6A: SHIFT_KERNEL(a[i], a[i], (in >> 1) | (p[i] & C) << 7, in & C); break;      // ROR
+
+  // register transfers, increments and flags
+  case 0xAA: NZ_KERNEL(x, a[i]); break;                   // TAX
+  case 0x8A: NZ_KERNEL(a, x[i]); break;                   // TXA
+  case 0xA8: NZ_KERNEL(y, a[i]); break;                   // TAY
+  case 0x98: NZ_KERNEL(a, y[i]); break;                   // TYA
+  case 0xBA: NZ_KERNEL(x, sp[i]); break;                  // TSX
+  case 0x9A: LANES { SELECT(sp, x[i]); } break;           // TXS
+  case 0xE8: NZ_KERNEL(x, x[i] + 1); break;               // INX
+  case 0xCA: NZ_KERNEL(x, x[i] - 1); break;               // DEX
+  case 0xC8: NZ_KERNEL(y, y[i] + 1); break;               // INY
+  case 0x88: NZ_KERNEL(y, y[i] - 1); break;               // DEY
+
+  case 0x18: FLAG_KERNEL(C, 0); break;                    // CLC
+  case 0x38: FLAG_KERNEL(0, C); break;                    // SEC
+  case 0x58: FLAG_KERNEL(I, 0); break;                    // CLI
+  case 0x78: FLAG_KERNEL(0, I); break;                    // SEI
+  case 0xB8: FLAG_KERNEL(V, 0); break;                    // CLV
+  case 0xD8: FLAG_KERNEL(D, 0); break;                    // CLD
+  case 0xF8: FLAG_KERNEL(0, D); break;                    // SED
+  case 0xEA: break;                                       // NOP
+
+  // stack
+  case 0x48: LANES { if(g[i]) PUSH(a[i]); } RAM_OPS(1); break;              // PHA
+  case 0x08: LANES { if(g[i]) PUSH(p[i] | B | U); } RAM_OPS(1); break;      // PHP
+  case 0x68: LANES {                                      // PLA
+      if(!g[i]) continue;
+      a[i] = POP;
+      p[i] = (p[i] & ~(N | Z)) | nz(a[i]);
+    }
+    RAM_OPS(1);
+    break;
+  case 0x28: LANES { if(g[i]) p[i] = (POP & ~B) | U; } RAM_OPS(1); break;   // PLP
+
+  case 0x20: {                                            // JSR
+    LANES {
+      if(!g[i]) continue;
+      u16 ret = pc[i] + 2;
+      PUSH(ret >> 8);
+      PUSH(ret & 0xFF);
+      pc[i] = w;
+    }
+    RAM_OPS(2);
+    return true;
+  }
+
+  case 0x60: LANES {                                      // RTS
+      if(!g[i]) continue;
+      u8 lo = POP;
+      pc[i] = create_u16(lo, POP) + 1;
+    }
+    RAM_OPS(2);
+    return true;
+
+  // branches, the taken cycles go to extra
+  case 0x10: BRANCH_KERNEL(N, false); return true;        // BPL
+  case 0x30: BRANCH_KERNEL(N, true);  return true;        // BMI
+  case 0x50: BRANCH_KERNEL(V, false); return true;        // BVC
+  case 0x70: BRANCH_KERNEL(V, true);  return true;        // BVS
+  case 0x90: BRANCH_KERNEL(C, false); return true;        // BCC
+  case 0xB0: BRANCH_KERNEL(C, true);  return true;        // BCS
+  case 0xD0: BRANCH_KERNEL(Z, false); return true;        // BNE
+  case 0xF0: BRANCH_KERNEL(Z, true);  return true;        // BEQ
+
+  case 0x4C:                                              // JMP abs
+    LANES { pc[i] = g[i] ? w : pc[i]; }
+    return true;
+
+  default:
+    return false;
+  }
+
+  u16 len = cpu_6502_length(op);
+  LANES { pc[i] = g[i] ? pc[i] + len : pc[i]; }
+  return true;
+}
+
+#undef LANES
+#undef SELECT
+#undef OPERAND
+#undef PUSH
+#undef POP
+
+// let the lane's PPU and APU catch up with its CPU
+static void batch_sync(struct batch* b, u32 i)
+{
+  struct NES* nes = b->nes[i];
+  u32 c = b->pending[i];
+
+  if(c) {
+    INST(struct instrument_mark m);
+    INST(instrument_mark(&nes->inst, &m));
+
+    nes->cpu->ticks += c;
+    ppu_2C02_run(nes->ppu, c * 3);
+    INST(instrument_lap(&nes->inst, INST_TIME_PPU, &m));
+
+    apu_run(nes->apu, c);
+    INST(instrument_lap(&nes->inst, INST_TIME_APU, &m));
+    INST(++nes->inst.count[INST_APU_SYNCS]);
+    INST(if(nes->ppu->frame != nes->inst.frame) nes_instrument_frame(nes));
+
+    b->pending[i] = 0;
+  }
+
+  // the APU's frame IRQ is the other event the CPU could notice
+  u32 until = ppu_2C02_dots_to_event(nes->ppu);
+  u32 apu = apu_cycles_to_event(nes->apu);
+
+  b->until[i] = apu < until / 3 ? apu * 3 : until;
+  b->running[i] = nes->is_active && nes->ppu->frame == b->frame[i];
+}
+
+// books the kernel step of op for every lane in the group, with the hooks
+// nes_tick and cpu_6502_tick would have run
+static void batch_retire(struct batch* b, u8 op, u32 members, u64 start)
+{
+  INST(u64 share = (instrument_ticks() - start) / members);
+  INST(u32 cart = cpu_6502_length(op) + (op == 0x4C)); // JMP abs also reads its target
+
+  for(u32 i = 0; i < b->count; ++i) {
+    if(!b->group[i]) continue;
+
+    struct NES* nes = b->nes[i];
+    u32 c = cycles[op] + b->extra[i];
+    b->extra[i] = 0;
+
+    if(b->hooked && nes->cpu->profile)
+      profile_count(nes->cpu->profile, nes->rom->map, b->at[i], c);
+
+    INST(nes->inst.time[INST_TIME_CPU] += share);
+    INST(++nes->inst.count[INST_INSTRUCTIONS]);
+    INST(nes->inst.count[INST_BUS_CART] += cart);
+    INST(nes->inst.count[INST_BUS_RAM] += b->ram_ops);
+
+    b->stepped[i] = 1;
+    b->pending[i] += c;
+
+    if(b->pending[i] * 3 >= b->until[i]) batch_sync(b, i);
+  }
+
+  b->vector_steps += members;
+}
+
+// one instruction through the normal CPU
+static void batch_scalar_step(struct batch* b, u32 i)
+{
+  batch_sync(b, i);
+
+  batch_store(b, i);
+  nes_tick(b->nes[i]);
+  batch_load(b, i);
+
+  batch_sync(b, i);
+  b->scalar_steps++;
+}
+
+// counts the lanes sharing each code pointer of the round. Equal code
+// pointers mean equal instructions, even at (mirrored) different PCs.
+static void batch_count(struct batch* b)
+{
+  u32 mask = b->buckets - 1;
+
+  memset(b->keys, 0, b->buckets * sizeof(const u8*));
+
+  for(u32 i = 0; i < b->count; ++i) {
+    const u8* code = b->code[i];
+    if(!code) continue;
+
+    u32 h = (u32)(((uintptr_t)code * 0x9E3779B1u) >> 7) & mask;
+    while(b->keys[h] && b->keys[h] != code) h = (h + 1) & mask;
+
+    if(!b->keys[h]) {
+      b->keys[h] = code;
+      b->sizes[h] = 0;
+    }
+
+    b->sizes[h]++;
+    b->slot[i] = h;
+  }
+}
+
+// the lanes that can share the leader's step, returns how many. Groups under
+// an eighth of the batch aren't worth a kernel pass over every lane.
+static u32 batch_group(struct batch* b, u32 leader)
+{
+  u32 members = b->sizes[b->slot[leader]];
+  if(members * 8 < b->count) return 0;
+
+  const u8* code = b->code[leader];
+
+  for(u32 i = 0; i < b->count; ++i) b->group[i] = b->code[i] == code;
+
+  return members;
+}
+
+// runs every lane until its PPU starts the next frame (or it stops)
+void batch_run_frame(struct batch* b)
+{
+  u32 n = b->count;
+
+  b->hooked = false;
+
+  for(u32 i = 0; i < n; ++i) {
+    batch_load(b, i);
+    b->frame[i] = b->nes[i]->ppu->frame;
+    b->pending[i] = 0;
+    b->hooked |= b->nes[i]->cpu->profile != NULL;
+    batch_sync(b, i);
+  }
+
+  // each round steps every running lane by one instruction
+  for(bool any = true; any; ) {
+    any = false;
+    memset(b->stepped, 0, n);
+
+    // trace records need the PPU position, which only a scalar step has
+    for(u32 i = 0; i < n; ++i) {
+      bool vector = b->running[i] && !batch_interrupt_pending(b, i) && !b->nes[i]->cpu->tracebuf;
+      b->code[i] = vector ? batch_code(b, i) : NULL;
+    }
+
+    batch_count(b);
+
+    for(u32 leader = 0; leader < n; ++leader) {
+      if(!b->running[leader] || b->stepped[leader]) continue;
+
+      any = true;
+
+      const u8* code = b->code[leader];
+      u32 members = code ? batch_group(b, leader) : 0;
+
+      if(!members) {
+        batch_scalar_step(b, leader);
+        b->stepped[leader] = 1;
+        continue;
+      }
+
+      // a kernel pass costs the same for any group size
+      u64 start = 0;
+      INST(start = instrument_ticks());
+      if(b->hooked) memcpy(b->at, b->pc, n * sizeof(u16));
+
+      if(batch_kernel(b, code[0], code)) {
+        batch_retire(b, code[0], members, start);
+        continue;
+      }
+
+      // no kernel, the whole group goes scalar now rather than being
+      // formed again for each of its lanes
+      for(u32 i = 0; i < n; ++i) {
+        if(!b->group[i]) continue;
+
+        batch_scalar_step(b, i);
+        b->stepped[i] = 1;
+      }
+    }
+  }
+
+  for(u32 i = 0; i < n; ++i) batch_store(b, i);
+}
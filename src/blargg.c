@@ -0,0 +1,178 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* blargg test ROM runner, see blargg.h */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "blargg.h"
+#include "2C02.h"
+#include "apu.h"
+#include "mapper.h"
+#include "nes.h"
+#include "rom.h"
+#include "runner.h"
+
+#include <string.h>
+
+#define STATUS_RUNNING 0x80
+#define STATUS_RESET   0x81
+
+// 100ms, the least the tests want between asking for and getting a reset
+#define RESET_DELAY    6
+
+// PRG RAM as it is, even while the game has it disabled through the mapper
+static u8 blargg_peek(struct NES* nes, u16 addr)
+{
+  return nes->rom->map->sram_pages[(addr >> 10) & 7][addr & 0x3FF];
+}
+
+static bool blargg_signature(struct NES* nes)
+{
+  return blargg_peek(nes, 0x6001) == 0xDE && blargg_peek(nes, 0x6002) == 0xB0 &&
+         blargg_peek(nes, 0x6003) == 0x61;
+}
+
+static void blargg_text(struct NES* nes, char* text)
+{
+  u32 i = 0;
+
+  for(; i < BLARGG_TEXT - 1 && 0x6004 + i < 0x8000; ++i) {
+    if(!(text[i] = blargg_peek(nes, 0x6004 + i))) break;
+  }
+
+  text[i] = 0;
+}
+
+// powers nes (with the test ROM loaded) on and runs the test
+void blargg_run(struct NES* nes, u32 max_frames, struct blargg_result* r)
+{
+  bool ppu_suppress = nes->ppu->suppress_output, apu_suppress = nes->apu->suppress_output;
+  u32 reset_at = 0;
+
+  r->outcome = BLARGG_TIMEOUT;
+  r->code = 0;
+  r->text[0] = 0;
+
+  nes->ppu->suppress_output = nes->apu->suppress_output = true;
+  nes_powerup(nes);
+  nes->is_active = true;
+
+  for(r->frames = 0; r->frames < max_frames; ++r->frames) {
+    nes_run_frame(nes);
+
+    if(!nes->is_active) {
+      r->outcome = BLARGG_STOPPED;
+      break;
+    }
+
+    if(!blargg_signature(nes)) continue;
+
+    u8 status = blargg_peek(nes, 0x6000);
+
+    if(status < STATUS_RUNNING) {
+      r->outcome = BLARGG_DONE;
+      break;
+    }
+
+    if(status != STATUS_RESET) {
+      reset_at = 0;
+    } else if(!reset_at) {
+      reset_at = r->frames + RESET_DELAY;
+    } else if(r->frames >= reset_at) {
+      nes_reset(nes);
+      reset_at = 0;
+    }
+  }
+
+  // whatever it got to print, it may explain a timeout or a crash
+  if(blargg_signature(nes)) {
+    r->code = blargg_peek(nes, 0x6000);
+    blargg_text(nes, r->text);
+  } else if(r->outcome != BLARGG_STOPPED) {
+    r->outcome = BLARGG_NO_SIGNATURE;
+  }
+
+  nes->ppu->suppress_output = ppu_suppress;
+  nes->apu->suppress_output = apu_suppress;
+}
+
+struct blargg_job {
+  struct blargg_result* results;
+  u32 max_frames;
+};
+
+static void blargg_task(struct NES* nes, u32 i, void* arg)
+{
+  struct blargg_job* job = arg;
+  struct blargg_result* r = &job->results[i];
+  FILE* fp = fopen(r->path, "rb");
+  struct rom_image* img = fp ? rom_image_load_file(fp) : NULL;
+  if(fp) fclose(fp);
+
+  if(!img) {
+    r->outcome = BLARGG_LOAD_FAILED;
+    r->text[0] = 0;
+    return;
+  }
+
+  bool loaded = nes_load_rom_image(nes, img);
+  rom_image_release(img);
+
+  if(!loaded) {
+    r->outcome = BLARGG_LOAD_FAILED;
+    r->text[0] = 0;
+    return;
+  }
+
+  blargg_run(nes, job->max_frames, r);
+}
+
+// runs the ROMs at results[i].path, threads at a time, each on one NES per
+// thread that's reused from ROM to ROM; a ROM left BLARGG_NOT_RUN (nothing
+// else sets that) means no thread could create an NES
+void blargg_run_files(struct blargg_result* results, u32 count, u32 max_frames, u32 threads)
+{
+  for(u32 i = 0; i < count; ++i)
+    results[i].outcome = BLARGG_NOT_RUN;
+
+  struct blargg_job job = {
+    .results = results,
+    .max_frames = max_frames
+  };
+
+  runner_for_each(count, threads, NULL, blargg_task, &job);
+}
+
+bool blargg_passed(struct blargg_result* r)
+{
+  return r->outcome == BLARGG_DONE && r->code == 0;
+}
+
+const char* blargg_describe(struct blargg_result* r)
+{
+  switch(r->outcome) {
+  case BLARGG_NOT_RUN:      return "not run";
+  case BLARGG_DONE:         return r->code ? "failed" : "passed";
+  case BLARGG_NO_SIGNATURE: return "no blargg signature";
+  case BLARGG_STOPPED:      return "CPU stopped";
+  case BLARGG_TIMEOUT:      return "timed out";
+  case BLARGG_LOAD_FAILED:  return "couldn't load";
+  }
+
+  return "?";
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* standard controllers, see controller.h */
+
+#include "controller.h"
+#include "nes.h"
+
+void controller_write(struct NES* nes, u8 val)
+{
+  nes->strobe = val & 1;
+
+  if(nes->strobe) {
+    nes->shift[0] = nes->input[0];
+    nes->shift[1] = nes->input[1];
+  }
+}
+
+u8 controller_read(struct NES* nes, u8 port)
+{
+  // while strobed, the first button is read over and over
+  if(nes->strobe) return 0x40 | (nes->input[port] & 1);
+
+  u8 bit = nes->shift[port] & 1;
+  nes->shift[port] = 0x80 | nes->shift[port] >> 1;
+
+  return 0x40 | bit;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* copy-on-write pages, see cow.h */
+
+#include "cow.h"
+
+#include <string.h>
+
+// point slot at own storage; slot is NULL for pages the board doesn't have
+void cow_bind(struct cow* c, u32 page, u8** slot, u8* own)
+{
+  if(c->shared[page]) cow_unshare(c, page, false);
+
+  c->slot[page] = slot;
+  c->own[page] = own;
+  c->dirty |= 1u << page;
+
+  if(slot) *slot = own;
+}
+
+// every bound page of parent is shared with child, whose pages have to be
+// bound already. A parent page that isn't shared yet is moved to a new block
+void cow_share(struct cow* parent, struct cow* child)
+{
+  for(u32 i = 0; i < COW_PAGES; ++i) {
+    if(!parent->slot[i] || !child->slot[i]) continue;
+
+    struct cow_page* page = parent->shared[i];
+
+    if(!page) {
+      page = malloc(sizeof(struct cow_page));
+      if(!page) {
+        // stay private, the child gets a copy instead
+        memcpy(child->own[i], *parent->slot[i], COW_PAGE_SIZE);
+        continue;
+      }
+
+      page->refs = 1;
+      memcpy(page->data, *parent->slot[i], COW_PAGE_SIZE);
+
+      parent->shared[i] = page;
+      parent->count++;
+      *parent->slot[i] = page->data;
+    }
+
+    __atomic_add_fetch(&page->refs, 1, __ATOMIC_RELAXED);
+
+    if(child->shared[i]) cow_unshare(child, i, false);
+
+    child->shared[i] = page;
+    child->count++;
+    *child->slot[i] = page->data;
+  }
+}
+
+// back to own storage, with the shared contents if copy
+void cow_unshare(struct cow* c, u32 page, bool copy)
+{
+  struct cow_page* p = c->shared[page];
+
+  if(copy) memcpy(c->own[page], p->data, COW_PAGE_SIZE);
+
+  *c->slot[page] = c->own[page];
+  c->shared[page] = NULL;
+  c->count--;
+
+  if(!__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL)) free(p);
+}
+
+// drops every shared page without copying, before the pages get reset
+void cow_release(struct cow* c)
+{
+  for(u32 i = 0; c->count && i < COW_PAGES; ++i) {
+    if(c->shared[i]) cow_unshare(c, i, false);
+  }
+}
@@ -0,0 +1,232 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* golden log comparison, see golden.h */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "golden.h"
+#include "nes.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t golden_line_end(struct golden* g, size_t pos)
+{
+  const char* nl = memchr(g->data + pos, '\n', g->size - pos);
+  return nl ? (size_t)(nl - g->data) : g->size;
+}
+
+// past the end of the line at pos and any blank lines after it
+static size_t golden_next(struct golden* g, size_t pos)
+{
+  pos = golden_line_end(g, pos);
+
+  while(pos < g->size && (g->data[pos] == '\n' || g->data[pos] == '\r'))
+    ++pos;
+
+  return pos;
+}
+
+static bool golden_hex(const char* s)
+{
+  return isxdigit((unsigned char)s[0]) && isxdigit((unsigned char)s[1]);
+}
+
+/* C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7 */
+static bool golden_parse(struct golden* g, size_t pos, struct golden_line* l)
+{
+  char buf[256];
+  size_t len = golden_line_end(g, pos) - pos;
+
+  if(len >= sizeof(buf)) len = sizeof(buf) - 1;
+  memcpy(buf, g->data + pos, len);
+  buf[len] = 0;
+
+  memset(l, 0, sizeof(struct golden_line));
+
+  if(len < 16 || !golden_hex(buf) || !golden_hex(buf + 2)) return false;
+  l->pc = strtoul(buf, NULL, 16);
+
+  for(; l->length < 3; ++l->length) {
+    const char* b = buf + 6 + l->length * 3;
+    if(!golden_hex(b) || b[2] != ' ') break;
+    l->op[l->length] = strtoul(b, NULL, 16);
+  }
+
+  const char* regs = strstr(buf + 15, "A:");
+  if(!l->length || !regs ||
+     sscanf(regs, "A:%hhx X:%hhx Y:%hhx P:%hhx SP:%hhx",
+            &l->a, &l->x, &l->y, &l->p, &l->sp) != 5) return false;
+
+  const char* cyc = strstr(regs, "PPU:") ? strstr(regs, "CYC:") : NULL;
+
+  if(cyc) {
+    l->has_cycles = true;
+    l->cycles = strtoul(cyc + 4, NULL, 10);
+  }
+
+  return true;
+}
+
+static u32 golden_compare(const struct golden_line* l, const struct trace_record* r)
+{
+  u32 m = 0;
+
+  if(l->pc != r->pc)                             m |= GOLDEN_PC;
+  if(memcmp(l->op, r->op, l->length))            m |= GOLDEN_BYTES;
+  if(l->a != r->a)                               m |= GOLDEN_A;
+  if(l->x != r->x)                               m |= GOLDEN_X;
+  if(l->y != r->y)                               m |= GOLDEN_Y;
+  if((l->p ^ r->p) & ~0x10)                      m |= GOLDEN_P;
+  if(l->sp != r->sp)                             m |= GOLDEN_SP;
+  if(l->has_cycles && l->cycles != r->cycles)    m |= GOLDEN_CYCLES;
+
+  return m;
+}
+
+struct golden* golden_open(const char* path, struct NES* nes)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+
+  if(fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+    LOGF("Couldn't open golden log %s", path);
+    if(fd >= 0) close(fd);
+    return NULL;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(data == MAP_FAILED) {
+    LOGF("Couldn't map golden log %s", path);
+    return NULL;
+  }
+
+  // read front to back exactly once
+  posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  struct golden* g = malloc(sizeof(struct golden));
+  memset(g, 0, sizeof(struct golden));
+
+  g->path = path;
+  g->data = data;
+  g->size = st.st_size;
+  g->nes = nes;
+
+  if(!golden_parse(g, 0, &g->first)) {
+    LOGF("%s doesn't look like a nestest style log", path);
+    golden_close(g);
+    return NULL;
+  }
+
+  return g;
+}
+
+void golden_close(struct golden* g)
+{
+  munmap((void*)g->data, g->size);
+  free(g);
+}
+
+void golden_flush(struct tracebuf* t, void* ctx)
+{
+  struct golden* g = ctx;
+
+  for(u32 i = 0; i < t->count && !g->finished && !g->mismatch; ++i) {
+    struct trace_record r = t->records[i];
+
+    if(!g->started) {
+      g->cycle_offset = g->first.cycles - r.cycles;
+      g->started = true;
+    }
+
+    r.cycles += g->cycle_offset;
+
+    u32 k = g->lines % GOLDEN_CONTEXT;
+    g->recent[k] = r;
+    g->recent_pos[k] = g->pos;
+
+    struct golden_line l;
+    g->mismatch = golden_parse(g, g->pos, &l) ? golden_compare(&l, &r) : GOLDEN_PARSE;
+
+    if(!g->mismatch) {
+      ++g->lines;
+      g->pos = golden_next(g, g->pos);
+      g->finished = g->pos >= g->size;
+    }
+  }
+
+  if(g->finished || g->mismatch) g->nes->is_active = false;
+}
+
+static void golden_print_line(struct golden* g, FILE* fp, size_t pos, char mark)
+{
+  size_t end = golden_line_end(g, pos);
+  if(end > pos && g->data[end - 1] == '\r') --end;
+
+  fprintf(fp, "%c %.*s\n", mark, (int)(end - pos), g->data + pos);
+}
+
+// prints the outcome, with context unless every line matched
+bool golden_report(struct golden* g, FILE* fp)
+{
+  static const char* names[] = { "PC", "bytes", "A", "X", "Y", "P", "SP", "CYC", "format" };
+
+  if(g->finished) {
+    fprintf(fp, "%s: all %llu lines match\n", g->path, (unsigned long long)g->lines);
+    return true;
+  }
+
+  fprintf(fp, "%s:%llu: ", g->path, (unsigned long long)g->lines + 1);
+
+  if(g->mismatch) {
+    for(u32 i = 0, n = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+      if(g->mismatch & (1u << i)) fprintf(fp, "%s%s", n++ ? ", " : "", names[i]);
+    }
+
+    fprintf(fp, " differ%s\n", g->mismatch & GOLDEN_PARSE ? "s from the log" : "");
+  } else {
+    fprintf(fp, "the CPU stopped before this line\n");
+  }
+
+  u64 total = g->lines + (g->mismatch ? 1 : 0);
+  u64 from = total > GOLDEN_CONTEXT ? total - GOLDEN_CONTEXT : 0;
+
+  fprintf(fp, "expected:\n");
+
+  for(u64 i = from; i < total; ++i)
+    golden_print_line(g, fp, g->recent_pos[i % GOLDEN_CONTEXT], i == g->lines ? '>' : ' ');
+
+  if(!g->mismatch && g->pos < g->size)
+    golden_print_line(g, fp, g->pos, '>');
+
+  fprintf(fp, "trace:\n");
+
+  for(u64 i = from; i < total; ++i) {
+    char line[128];
+    tracebuf_format(&g->recent[i % GOLDEN_CONTEXT], line, sizeof(line));
+    fprintf(fp, "%c %s\n", i == g->lines ? '>' : ' ', line);
+  }
+
+  return false;
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* log-linear histograms, see histogram.h */
+
+#include <string.h>
+
+#include "histogram.h"
+
+void histogram_clear(struct histogram* h)
+{
+  memset(h, 0, sizeof(struct histogram));
+}
+
+// the largest value that lands in bucket i
+static u64 histogram_upper(u32 i)
+{
+  if(i < HIST_SUB) return i;
+
+  u32 shift = (i >> HIST_BITS) - 1;
+  u64 lower = (u64)(HIST_SUB + (i & (HIST_SUB - 1))) << shift;
+
+  return lower + ((u64)1 << shift) - 1;
+}
+
+// the value percent of all recorded values are at or below, rounded up to
+// its bucket's upper end (but never above the largest value recorded)
+u64 histogram_percentile(const struct histogram* h, double percent)
+{
+  if(!h->total) return 0;
+
+  u64 rank = (u64)(percent / 100.0 * h->total + 0.5), seen = 0;
+  if(rank < 1) rank = 1;
+  if(rank > h->total) rank = h->total;
+
+  for(u32 i = 0; i < HIST_BUCKETS; ++i) {
+    seen += h->count[i];
+
+    if(seen >= rank) {
+      u64 value = histogram_upper(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+// one line: count, mean, p50, p99, p99.9 and max, values divided by scale
+void histogram_print(const struct histogram* h, FILE* fp, const char* name, const char* unit,
+                     double scale)
+{
+  fprintf(fp, "%-8s %10llu  mean %9.3f  p50 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f %s\n",
+          name, (unsigned long long)h->total, h->total ? h->sum / h->total / scale : 0.0,
+          histogram_percentile(h, 50) / scale, histogram_percentile(h, 99) / scale,
+          histogram_percentile(h, 99.9) / scale, h->max / scale, unit);
+}
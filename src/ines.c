@@ -17,66 +17,87 @@
 
 
 #include "ines.h"
-#include "nes.h"
+#include "2C02.h"
 #include "mapper.h"
 #include "rom.h"
 
 #include <string.h>
 
-struct ROM* ines_rom_load_file(FILE* fp, struct ROM* rom)
+// PRG and CHR are not copied, the image points directly into buf
+struct rom_image* ines_image_load_buffer(const u8* buf, u32 size, struct rom_image* img)
 {
 
   struct iNES_ROM_header header;
 
-  char hdr[16] = {0};
-  long hdrsz = fread(hdr, 1, 16, fp);
-
-  if(hdrsz != 16 || memcmp(hdr, INES_HEADER, 4)) {
-    LOGF("Given magic 0x%X 0x%X 0x%X 0x%X, expected 0x4E 0x45 0x53 0x1A, is this an iNES ROM?",
-         hdr[0], hdr[1], hdr[2], hdr[3]);
+  if(size < 16 || memcmp(buf, INES_HEADER, 4)) {
+    if(size >= 4) {
+      LOGF("Given magic 0x%X 0x%X 0x%X 0x%X, expected 0x4E 0x45 0x53 0x1A, is this an iNES ROM?",
+           buf[0], buf[1], buf[2], buf[3]);
+    }
     goto fail;
   }
 
-  header.prg_rom_count = hdr[4];
-  header.chr_rom_count = hdr[5];
-  header.flags6        = hdr[6];
-  header.flags7        = hdr[7];
-  header.prg_ram_count = hdr[8];
-  header.format        = hdr[9];
+  header.prg_rom_count = buf[4];
+  header.chr_rom_count = buf[5];
+  header.flags6        = buf[6];
+  header.flags7        = buf[7];
+  header.prg_ram_count = buf[8];
+  header.format        = buf[9];
 
-  u8 mapper_num  = header.flags7 | (header.flags6 >> 4);
+  u8 mapper_num  = (header.flags7 & 0xF0) | (header.flags6 >> 4);
 
   u32 rom_size = header.prg_rom_count * 0x4000;
   u32 vrom_size = header.chr_rom_count * 0x2000;
 
-  LOGF("Loading 0x%X bytes of PRG ROM and 0x%X bytes of VROM", rom_size, vrom_size);
+  // bit 2 of flags 6 signals a 512 byte trainer between header and PRG ROM
+  u32 offset = 16;
+  const u8* trainer = NULL;
 
-  unsigned read;
+  if(header.flags6 & 0x04) {
+    trainer = buf + offset;
+    offset += 0x200;
+  }
 
-  rom->nes->mem->rom_size = rom_size;
-  rom->nes->mem->vrom_size = vrom_size;
+  LOGF("Loading 0x%X bytes of PRG ROM and 0x%X bytes of VROM", rom_size, vrom_size);
 
-  rom->nes->mem->rom = malloc(rom_size);
-  rom->nes->mem->vrom = malloc(vrom_size);
+  if(!rom_size) {
+    LOGF("ROM has no PRG ROM");
+    goto fail;
+  }
 
-  if((read = fread(rom->nes->mem->rom, 1, rom_size, fp)) != rom_size) {
-    LOGF("Unexpected EOF in ROM (wanted 0x%X bytes, only saw 0x%X)", rom_size, read);
+  if(offset + rom_size > size) {
+    LOGF("Unexpected EOF in ROM (wanted 0x%X bytes, only saw 0x%X)",
+         rom_size, size > offset ? size - offset : 0);
     goto fail;
   }
 
-  if((read = fread(rom->nes->mem->vrom, 1, vrom_size, fp)) != vrom_size)  {
-    LOGF("Unexpected EOF in VROM (wanted 0x%X bytes, only saw 0x%X)", vrom_size, read);
+  if(offset + rom_size + vrom_size > size) {
+    LOGF("Unexpected EOF in VROM (wanted 0x%X bytes, only saw 0x%X)",
+         vrom_size, size - offset - rom_size);
     goto fail;
   }
 
-  rom->hdr.type = INES;
-  rom->hdr.format = header.format ? PAL : NTSC;
-  rom->hdr.prg_rom_count = header.prg_rom_count;
-  rom->hdr.chr_rom_count = header.chr_rom_count;
-  rom->hdr.has_prg_ram = (header.prg_ram_count != 0);
-  rom->hdr.mapper = mapper_num;
+  img->prg_size = rom_size;
+  img->prg = buf + offset;
+
+  img->chr_size = vrom_size;
+  img->chr = vrom_size ? buf + offset + rom_size : NULL;
+
+  img->hdr.type = INES;
+  img->hdr.format = header.format ? PAL : NTSC;
+  img->hdr.prg_rom_count = header.prg_rom_count;
+  img->hdr.chr_rom_count = header.chr_rom_count;
+  img->hdr.has_prg_ram = (header.prg_ram_count != 0);
+
+  // flags 6 bit 0: vertical mirroring, bit 3: four screen VRAM
+  if(header.flags6 & 0x08)
+    img->hdr.mirroring = MIRROR_FOUR;
+  else
+    img->hdr.mirroring = (header.flags6 & 0x01) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+  img->hdr.mapper = mapper_num;
+  img->trainer = trainer;
 
-  return rom;
+  return img;
 
  fail:
   LOGF("ROM load failed, aborting...");
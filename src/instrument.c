@@ -0,0 +1,129 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* host side instrumentation, see instrument.h */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+
+#include "instrument.h"
+
+static const char* const timer_names[INST_TIMERS] = {
+  "cpu", "ppu", "apu", "dma"
+};
+
+static const char* const count_names[INST_COUNTS] = {
+  "instructions", "bus_ram", "bus_ppu", "bus_apu", "bus_cart",
+  "scanlines", "apu_syncs", "bank_switches", "dma"
+};
+
+// monotonic nanoseconds
+u64 instrument_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void instrument_perf_lap(struct instrument* inst, enum instrument_timer timer,
+                         struct instrument_mark* m)
+{
+  u64 now[PERF_COUNTERS];
+  perf_read(inst->perf, now);
+
+  for(int i = 0; i < PERF_COUNTERS; ++i) {
+    inst->perf_time[timer][i] += now[i] - m->perf[i];
+    m->perf[i] = now[i];
+  }
+}
+
+static void instrument_perf_write(struct instrument* inst, const char* name, const u64* values,
+                                  bool first)
+{
+  fprintf(inst->out, "%s\"%s\":{", first ? "" : ",", name);
+
+  for(int i = 0, n = 0; i < PERF_COUNTERS; ++i) {
+    if(inst->perf->fd[i] < 0) continue;
+
+    fprintf(inst->out, "%s\"%s\":%llu", n++ ? "," : "", perf_names[i],
+            (unsigned long long)values[i]);
+  }
+
+  fprintf(inst->out, "}");
+}
+
+// ends the current frame, writing it out, and starts counting frame
+void instrument_frame(struct instrument* inst, u32 frame)
+{
+  u64 ticks = instrument_ticks(), ns = instrument_clock();
+  u64 counters[PERF_COUNTERS];
+
+  if(inst->perf) {
+    perf_read(inst->perf, counters);
+
+    for(int i = 0; i < PERF_COUNTERS; ++i) {
+      u64 start = inst->perf_start[i];
+
+      inst->perf_start[i] = counters[i];
+      counters[i] -= start;
+    }
+  }
+
+  if(inst->out && inst->start_ns) {
+    u64 elapsed = ns - inst->start_ns;
+    double scale = ticks > inst->start_ticks ? (double)elapsed / (ticks - inst->start_ticks) : 0;
+
+    fprintf(inst->out, "{\"frame\":%u,\"ns\":{\"frame\":%llu", inst->frame,
+            (unsigned long long)elapsed);
+
+    for(int i = 0; i < INST_TIMERS; ++i)
+      fprintf(inst->out, ",\"%s\":%llu", timer_names[i],
+              (unsigned long long)(inst->time[i] * scale));
+
+    fprintf(inst->out, "},\"count\":{");
+
+    for(int i = 0; i < INST_COUNTS; ++i)
+      fprintf(inst->out, "%s\"%s\":%llu", i ? "," : "", count_names[i],
+              (unsigned long long)inst->count[i]);
+
+    fprintf(inst->out, "}");
+
+    if(inst->perf) {
+      fprintf(inst->out, ",\"perf\":{");
+      instrument_perf_write(inst, "frame", counters, true);
+
+      for(int i = 0; i < INST_TIMERS; ++i)
+        instrument_perf_write(inst, timer_names[i], inst->perf_time[i], false);
+
+      fprintf(inst->out, "}");
+    }
+
+    fprintf(inst->out, "}\n");
+  }
+
+  memset(inst->time, 0, sizeof(inst->time));
+  memset(inst->count, 0, sizeof(inst->count));
+  memset(inst->perf_time, 0, sizeof(inst->perf_time));
+
+  inst->frame = frame;
+  inst->start_ticks = ticks;
+  inst->start_ns = ns;
+}
@@ -16,39 +16,611 @@
 */
 
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "def.h"
+#include "batch.h"
+#include "blargg.h"
+#include "golden.h"
 #include "ines.h"
 #include "6502.h"
 #include "2C02.h"
+#include "apu.h"
 #include "nes.h"
 #include "mapper.h"
+#include "movie.h"
+#include "profile.h"
 #include "rom.h"
+#include "runahead.h"
+#include "runner.h"
+#include "stats.h"
+#include "state.h"
+#include "tracebuf.h"
+#include "verify.h"
 
 int usage(void)
 {
-  fprintf(stderr, "Usage: nestorama NESROM\n");
+  fprintf(stderr,
+          "Usage: nestorama [options] NESROM\n"
+          "  --run-ahead FRAMES   run ahead to hide input latency\n"
+          "  --pc ADDR            start the traced run at ADDR (hex) instead of the reset\n"
+          "                       vector, C000 for nestest's automated mode\n"
+          "  --instances M        run M instances of the ROM, without tracing\n"
+          "  --threads K          on K worker threads (default 1)\n"
+          "  --frames N           for N frames each (default 600)\n"
+          "  --lockstep           step the instances as one batch instead\n"
+          "  --play MOVIE         replay a movie, checking every frame\n"
+          "  --verify MOVIE       the same, segments in parallel on --threads\n"
+          "  --record MOVIE       record --frames frames without input\n"
+          "  --checkpoint K       with a checkpoint every K frames\n"
+          "  --hashes             print the state hash after each of --frames frames\n"
+          "  --profile            print where the game spent its cycles at the end\n"
+          "  --instrument FILE    write host timings per frame as JSON lines (make instrument)\n"
+          "  --perf               with hardware counters per frame and phase\n"
+          "  --realtime           run at the NTSC frame rate for --frames frames (0: until\n"
+          "                       stopped), then print frame time percentiles\n"
+          "  --stats-socket PATH  also send them to whoever connects to this UNIX socket\n"
+          "  --golden LOG         compare the trace against a nestest.log style log, stopping\n"
+          "                       at the first difference\n"
+          "  --blargg             run blargg's test ROMs headless and exit with the result;\n"
+          "                       NESROM may be a directory, run on --threads, for up to\n"
+          "                       --frames frames each (default 3600)\n");
   return 1;
 }
 
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// NTSC, 39375000 / 655171 frames a second
+#define FRAME_NS 16639267ull
+
+static volatile sig_atomic_t stopped;
+
+static void stop(int sig)
+{
+  stopped = 1;
+}
+
+static u64 clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// paced like an interactive frontend, recording every frame's times until
+// the game stops, SIGINT / SIGTERM or after frames frames (unless 0)
+static int run_realtime(struct NES* nes, u32 run_ahead, u32 frames, const char* socket)
+{
+  struct frame_stats* stats = frame_stats_create(socket);
+  if(!stats) return 1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  struct runahead* ra = runahead_create(nes, run_ahead);
+
+  nes_powerup(nes);
+  nes->is_active = true;
+
+  u64 deadline = clock_ns();
+
+  for(u32 i = 0; (!frames || i < frames) && nes->is_active && !stopped; ++i) {
+    u64 start = clock_ns();
+    runahead_run_frame(ra);
+    u64 end = clock_ns();
+
+    histogram_record(&stats->emulate, end - start);
+
+    // wait for vsync
+    deadline += FRAME_NS;
+
+    if(end < deadline) {
+      struct timespec ts = { deadline / 1000000000ull, deadline % 1000000000ull };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    u64 presented = clock_ns(), late = presented > deadline ? presented - deadline : 0;
+    histogram_record(&stats->present, late);
+
+    // a whole frame behind, drop it rather than rushing to catch up
+    if(late > FRAME_NS) deadline = presented;
+
+    frame_stats_audio(stats, nes->apu->sample_count, presented);
+    nes->apu->sample_count = 0;
+
+    frame_stats_poll(stats);
+  }
+
+  frame_stats_report(stats, stdout);
+
+  runahead_free(ra);
+  frame_stats_free(stats);
+  return 0;
+}
+
+// steps every instance in batches of a second worth of frames
+static int run_instances(struct rom_image* img, u32 instances, u32 threads, u32 frames)
+{
+  struct runner* r = runner_create(img, instances, threads);
+  if(!r) return 1;
+
+  double start = now();
+
+  for(u32 done = 0; done < frames; done += 60)
+    runner_run(r, frames - done < 60 ? frames - done : 60);
+
+  double elapsed = now() - start;
+
+  printf("%u instances x %u frames on %u threads: %.3fs, %.1f frames/s, %llu steals\n",
+         instances, frames, r->threads, elapsed, instances * (double)frames / elapsed,
+         (unsigned long long)runner_steals(r));
+
+  runner_free(r);
+  return 0;
+}
+
+// the same, but all instances step together on this thread
+static int run_lockstep(struct rom_image* img, u32 instances, u32 frames)
+{
+  struct runner* r = runner_create(img, instances, 1);
+  struct batch* b = r ? batch_create(r->nes, instances) : NULL;
+
+  if(!b) {
+    if(r) runner_free(r);
+    return 1;
+  }
+
+  double start = now();
+
+  for(u32 i = 0; i < frames; ++i)
+    batch_run_frame(b);
+
+  double elapsed = now() - start;
+  u64 steps = b->vector_steps + b->scalar_steps;
+
+  printf("%u instances x %u frames in lockstep: %.3fs, %.1f frames/s, %.1f%% vector steps\n",
+         instances, frames, elapsed, instances * (double)frames / elapsed,
+         steps ? 100.0 * b->vector_steps / steps : 0.0);
+
+  batch_free(b);
+  runner_free(r);
+  return 0;
+}
+
+// replays a movie headless, exits with 1 on a desync
+static int play_movie(struct NES* nes, const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  struct movie* m = fp ? movie_load(fp) : NULL;
+  if(fp) fclose(fp);
+
+  if(!m) {
+    LOGF("Couldn't load movie %s", path);
+    return 1;
+  }
+
+  nes_powerup(nes);
+  nes->is_active = true;
+
+  u32 frames;
+  double start = now();
+  bool ok = movie_play(m, nes, &frames);
+  double elapsed = now() - start;
+
+  if(ok)
+    printf("%s: all %u frames match, %.3fs, %.1f frames/s\n", path, frames, elapsed,
+           frames / elapsed);
+  else if(frames < m->frames)
+    printf("%s: desync at frame %u of %u, state hash %016llx instead of %016llx\n", path,
+           frames, m->frames, (unsigned long long)nes_state_hash(nes),
+           (unsigned long long)m->frame[frames].hash);
+
+  movie_free(m);
+  return !ok;
+}
+
+// the same split at the movie's checkpoints, on several threads
+static int verify(struct rom_image* img, const char* path, u32 threads)
+{
+  FILE* fp = fopen(path, "rb");
+  struct movie* m = fp ? movie_load(fp) : NULL;
+  if(fp) fclose(fp);
+
+  if(!m) {
+    LOGF("Couldn't load movie %s", path);
+    return 1;
+  }
+
+  struct verify_result res;
+  double start = now();
+  bool ok = verify_movie(m, img, threads, &res);
+  double elapsed = now() - start;
+
+  if(ok)
+    printf("%s: all %u frames match in %u segments on %u threads, %.3fs, %.1f frames/s\n",
+           path, res.frames, res.segments, threads, elapsed, res.frames / elapsed);
+  else if(res.error)
+    printf("%s: couldn't be verified\n", path);
+  else
+    printf("%s: desync at frame %u of %u\n", path, res.frames, m->frames);
+
+  movie_free(m);
+  return !ok;
+}
+
+// one line per frame, to diff two builds or runs against each other
+static void print_hashes(struct NES* nes, u32 frames)
+{
+  nes_powerup(nes);
+  nes->is_active = true;
+  nes->ppu->suppress_output = true;
+
+  for(u32 i = 0; i < frames && nes->is_active; ++i) {
+    nes_run_frame(nes);
+    printf("%u %016llx\n", i, (unsigned long long)nes_state_hash(nes));
+  }
+}
+
+static int record_movie(struct NES* nes, const char* path, u32 frames, u32 interval)
+{
+  struct movie* m = movie_create(nes, interval);
+  if(!m) {
+    LOGF("Out of memory");
+    return 1;
+  }
+
+  nes_powerup(nes);
+  nes->is_active = true;
+
+  for(u32 i = 0; i < frames; ++i)
+    movie_record_frame(m, nes);
+
+  FILE* fp = fopen(path, "wb");
+  bool ok = fp && movie_save(m, fp);
+  if(fp && fclose(fp)) ok = false;
+
+  if(!ok) {
+    LOGF("Couldn't write movie %s", path);
+  }
+
+  movie_free(m);
+  return !ok;
+}
+
+// the trace checked against a golden log, from the PC of its first line
+static int check_golden(struct NES* nes, const char* path)
+{
+  struct golden* g = golden_open(path, nes);
+  if(!g) return 1;
+
+  // one record per flush, so the NES stops at the first difference
+  // instead of running on until the buffer fills
+  struct tracebuf* t = tracebuf_create(1, golden_flush, g);
+
+  nes_powerup(nes);
+  nes->is_active = true;
+  nes->ppu->suppress_output = true;
+
+  // take the reset, then go where the log starts
+  nes_tick(nes);
+  nes->cpu->r.pc = g->first.pc;
+  nes->cpu->tracebuf = t;
+
+  double start = now();
+
+  while(nes->is_active) {
+    nes_tick(nes);
+  }
+
+  tracebuf_flush(t);
+  double elapsed = now() - start;
+
+  bool ok = golden_report(g, stdout);
+  printf("%llu lines in %.3fs\n", (unsigned long long)g->lines, elapsed);
+
+  nes->cpu->tracebuf = NULL;
+  tracebuf_free(t);
+  golden_close(g);
+  return !ok;
+}
+
+// plain run, traces every instruction; from pc rather than the reset vector
+// unless it's negative
+static void run_traced(struct NES* nes, long pc)
+{
+  nes->cpu->trace = true;
+
+  if(pc < 0) {
+    nes_run(nes);
+    return;
+  }
+
+  nes_powerup(nes);
+  nes->is_active = true;
+
+  // take the reset, then go to pc
+  nes_tick(nes);
+  nes->cpu->r.pc = pc;
+
+  printf("PC     OP  \tNAM  TYPE\tINFO\n");
+  while(nes->is_active) {
+    nes_tick(nes);
+  }
+}
+
+// every .nes file below path (or path itself), sorted
+static u32 find_roms(const char* path, char*** roms, u32 count)
+{
+  struct stat st;
+
+  if(stat(path, &st)) return count;
+
+  if(!S_ISDIR(st.st_mode)) {
+    *roms = realloc(*roms, (count + 1) * sizeof(char*));
+    (*roms)[count++] = strdup(path);
+    return count;
+  }
+
+  struct dirent** entries;
+  int n = scandir(path, &entries, NULL, alphasort);
+
+  for(int i = 0; i < n; ++i) {
+    const char* name = entries[i]->d_name;
+    size_t len = strlen(name);
+    char* child = malloc(strlen(path) + len + 2);
+
+    sprintf(child, path[strlen(path) - 1] == '/' ? "%s%s" : "%s/%s", path, name);
+
+    if(name[0] != '.' && !stat(child, &st) &&
+       (S_ISDIR(st.st_mode) || (len > 4 && !strcmp(name + len - 4, ".nes"))))
+      count = find_roms(child, roms, count);
+
+    free(child);
+    free(entries[i]);
+  }
+
+  if(n >= 0) free(entries);
+  return count;
+}
+
+// a test ROM exits with its result code, a directory of them with 1 if any
+// of them didn't pass
+static int run_blargg(const char* path, u32 threads, u32 frames)
+{
+  char** roms = NULL;
+  u32 count = find_roms(path, &roms, 0);
+
+  if(!count) {
+    LOGF("No ROMs in %s", path);
+    return 1;
+  }
+
+  struct blargg_result* results = calloc(count, sizeof(struct blargg_result));
+  if(!results) {
+    LOGF("Out of memory");
+    return 1;
+  }
+
+  for(u32 i = 0; i < count; ++i)
+    results[i].path = roms[i];
+
+  double start = now();
+  blargg_run_files(results, count, frames, threads);
+  double elapsed = now() - start;
+
+  u32 passed = 0;
+
+  for(u32 i = 0; i < count; ++i) {
+    struct blargg_result* r = &results[i];
+
+    if(r->outcome == BLARGG_DONE && r->code)
+      printf("%s: failed with code %u after %u frames\n", r->path, r->code, r->frames);
+    else
+      printf("%s: %s after %u frames\n", r->path, blargg_describe(r), r->frames);
+
+    // the text usually ends in a newline already
+    size_t len = strlen(r->text);
+    if(!blargg_passed(r) && len)
+      printf("%s%s", r->text, r->text[len - 1] == '\n' ? "" : "\n");
+
+    passed += blargg_passed(r);
+  }
+
+  printf("%u of %u passed on %u threads, %.3fs\n", passed, count, threads, elapsed);
+
+  struct stat st;
+  int ret = passed == count ? 0 : 1;
+
+  if(!stat(path, &st) && !S_ISDIR(st.st_mode))
+    ret = results[0].outcome == BLARGG_DONE ? results[0].code : 255;
+
+  for(u32 i = 0; i < count; ++i)
+    free(roms[i]);
+
+  free(roms);
+  free(results);
+  return ret;
+}
+
 int main(int argc, char** argv)
 {
-  if(argc < 2) {
+  const char* path = NULL;
+  const char* play = NULL;
+  const char* record = NULL;
+  const char* check = NULL;
+  const char* instrument = NULL;
+  const char* socket = NULL;
+  const char* golden = NULL;
+  int interval = 0;
+  long pc = -1;
+  int run_ahead = -1, instances = 0, threads = 1, frames = -1;
+  bool lockstep = false, hashes = false, profile = false, realtime = false, perf = false;
+  bool blargg = false;
+
+  for(int i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "--run-ahead") && i + 1 < argc) {
+      run_ahead = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "--instances") && i + 1 < argc) {
+      instances = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "--frames") && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "--lockstep")) {
+      lockstep = true;
+    } else if(!strcmp(argv[i], "--hashes")) {
+      hashes = true;
+    } else if(!strcmp(argv[i], "--profile")) {
+      profile = true;
+    } else if(!strcmp(argv[i], "--instrument") && i + 1 < argc) {
+      instrument = argv[++i];
+    } else if(!strcmp(argv[i], "--perf")) {
+      perf = true;
+    } else if(!strcmp(argv[i], "--golden") && i + 1 < argc) {
+      golden = argv[++i];
+    } else if(!strcmp(argv[i], "--pc") && i + 1 < argc) {
+      pc = strtol(argv[++i], NULL, 16);
+    } else if(!strcmp(argv[i], "--blargg")) {
+      blargg = true;
+    } else if(!strcmp(argv[i], "--realtime")) {
+      realtime = true;
+    } else if(!strcmp(argv[i], "--stats-socket") && i + 1 < argc) {
+      socket = argv[++i];
+    } else if(!strcmp(argv[i], "--play") && i + 1 < argc) {
+      play = argv[++i];
+    } else if(!strcmp(argv[i], "--verify") && i + 1 < argc) {
+      check = argv[++i];
+    } else if(!strcmp(argv[i], "--record") && i + 1 < argc) {
+      record = argv[++i];
+    } else if(!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+      interval = atoi(argv[++i]);
+    } else if(argv[i][0] == '-' || path) {
+      return usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if(!path || run_ahead < -1 || instances < 0 || threads < 1 || frames < -1 || interval < 0 ||
+     pc > 0xFFFF || (socket && !realtime) || (perf && !instrument)) {
     return usage();
   }
 
-  LOGF("Trying to load ROM: %s", argv[1]);
+#ifndef NESTORAMA_INSTRUMENT
+  if(instrument) {
+    LOGF("Built without instrumentation, use nestorama-instrument (make instrument)");
+    return 1;
+  }
+#endif
+
+  if(frames < 0) frames = blargg ? 3600 : 600;
+
+  if(blargg) return run_blargg(path, threads, frames);
+
+  LOGF("Trying to load ROM: %s", path);
+
+  FILE* fp = fopen(path, "rb");
+  struct rom_image* img = fp ? rom_image_load_file(fp) : NULL;
+  if(fp) fclose(fp);
+
+  if(!img) {
+    LOGF("Couldn't load %s", path);
+    return 1;
+  }
+
+  if(check) {
+    int ret = verify(img, check, threads);
+    rom_image_release(img);
+    return ret;
+  }
+
+  if(instances) {
+    int ret = lockstep ? run_lockstep(img, instances, frames)
+                       : run_instances(img, instances, threads, frames);
+    rom_image_release(img);
+    return ret;
+  }
 
   struct NES* nes = nes_create();
+  nes_load_rom_image(nes, img);
+  rom_image_release(img);
+
+  if(profile) nes->cpu->profile = profile_create(nes);
 
-  FILE* fp = fopen(argv[1], "rb");
-  nes_load_rom(nes, fp);
-  fclose(fp);
+#ifdef NESTORAMA_INSTRUMENT
+  FILE* inst = instrument ? fopen(instrument, "w") : NULL;
 
-  nes_run(nes);
+  if(instrument && !inst) {
+    LOGF("Couldn't write %s", instrument);
+    nes_free(nes);
+    return 1;
+  }
+
+  nes->inst.out = inst;
+
+  struct perf counters;
+
+  if(perf) {
+    if(!perf_open(&counters)) {
+      LOGF("No hardware counters could be opened");
+      if(inst) fclose(inst);
+      nes_free(nes);
+      return 1;
+    }
+
+    nes->inst.perf = &counters;
+  }
+#endif
+
+  int ret = 0;
+
+  if(hashes) {
+    print_hashes(nes, frames);
+  } else if(golden) {
+    ret = check_golden(nes, golden);
+  } else if(play || record) {
+    ret = play ? play_movie(nes, play) : record_movie(nes, record, frames, interval);
+  } else if(realtime) {
+    ret = run_realtime(nes, run_ahead < 0 ? 0 : run_ahead, frames, socket);
+  } else if(run_ahead < 0) {
+    run_traced(nes, pc);
+    nes_inspect(nes);
+  } else {
+    struct runahead* ra = runahead_create(nes, run_ahead);
+
+    nes_powerup(nes);
+    nes->is_active = true;
+
+    while(nes->is_active) {
+      runahead_run_frame(ra);
+    }
+
+    runahead_free(ra);
+    nes_inspect(nes);
+  }
+
+  if(profile) {
+    profile_report(nes->cpu->profile, stdout, 20);
+    profile_free(nes->cpu->profile);
+  }
+
+  INST(if(inst) fclose(inst));
+  INST(if(perf) perf_close(&counters));
 
-  nes_inspect(nes);
   nes_free(nes);
-  return 0;
+  return ret;
 }
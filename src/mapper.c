@@ -17,80 +17,72 @@
 
 
 #include "mapper.h"
+#include "cow.h"
 #include "nes.h"
 #include "rom.h"
 
 #include <string.h>
 
-struct mapper* mapper_create(struct ROM* rom)
+// every supported board, looked up by iNES mapper number
+static const struct mapper_ops* const mapper_registry[] = {
+  &nrom_ops,
+  &mmc1_ops,
+  &cnrom_ops,
+  &mmc3_ops,
+  &axrom_ops,
+  NULL
+};
+
+const struct mapper_ops* mapper_find(enum rom_mapper num)
 {
-  struct mapper* map = malloc(sizeof(struct mapper));
-  memset(map, 0, sizeof(struct mapper));
-
-  map->rom = rom;
-  map->num = rom->hdr.mapper;;
-
-  mapper_init_banks(map);
+  for(int i = 0; mapper_registry[i]; ++i) {
+    if(mapper_registry[i]->num == num) return mapper_registry[i];
+  }
 
-  return map;
+  return NULL;
 }
 
-void mapper_free(struct mapper* map)
+// sram is 0x2000 bytes, cleared here
+void mapper_init(struct mapper* map, struct ROM* rom, u8* sram)
 {
-  free(map);
-}
+  memset(map, 0, sizeof(struct mapper));
+  memset(sram, 0, 0x2000);
 
-void mapper_init_banks(struct mapper* map)
-{
-  switch(map->num) {
-  case CNROM:
-  case NROM:
-    mapper_set_rom_bank(map, 0, 0x8000, 0x8000);
-    break;
-  case MMC1:
-  case AXROM:
-  default:
-    mapper_set_rom_bank(map, 0,  0x0000, 0x4000);
-    mapper_set_rom_bank(map, 0,  0x4000, 0x4000);
-    mapper_set_rom_bank(map, 0,  0x8000, 0x4000);
-    mapper_set_rom_bank(map, -1, 0xC000, 0x4000);
-    break;
+  for(int i = 0; i < 8; ++i) {
+    map->sram_pages[i] = sram + i * COW_PAGE_SIZE;
   }
-}
-
-// this function just factors out some functionality common to ROM and VROM bankswitching
-static void mapper_set_bank(struct mapper* map, u32 index, u16 addr, u16 size, bool use_rom)
-{
-  struct NES* nes = map->rom->nes;
 
-  u8* rom    = use_rom ? nes->mem->rom      : nes->mem->vrom;
-  u32 rs     = use_rom ? nes->mem->rom_size : nes->mem->vrom_size;
-  u8** banks = use_rom ? map->rom_banks     : map->vrom_banks;
-
-  u32 bs = use_rom ? ROM_BANK_SIZE : VROM_BANK_SIZE;
-
-  for(u32 page = addr / bs, idx = rs + index * size;
-      page < (addr + size) / bs && page < NUM_BANKS;
-      page++, idx += bs) {
-
-    banks[page] = &rom[idx % rs];
+  map->rom = rom;
+  map->num = rom->hdr.mapper;
+  map->ops = mapper_find(map->num);
+
+  map->prg_table = rom->img->prg_banks;
+  map->prg_mask  = rom->img->prg_mask;
+  map->prg_count = rom->img->prg_size / ROM_BANK_SIZE;
+
+  if(rom->chr_ram) {
+    map->chr_table = rom->chr_ram_banks;
+    map->chr_mask  = 7;
+    map->chr_count = 8;
+  } else {
+    map->chr_table = rom->img->chr_banks;
+    map->chr_mask  = rom->img->chr_mask;
+    map->chr_count = rom->img->chr_size / VROM_BANK_SIZE;
   }
-}
 
-void mapper_set_rom_bank(struct mapper* map, u16 index, u16 addr, u16 size)
-{
-  LOGF("Setting 0x%X through 0x%X to ROM index %d", addr, addr + size, index);
+  if(!map->ops) {
+    LOGF("XXX: Mapper %d isn't supported, pretending it's NROM", map->num);
+    map->ops = &nrom_ops;
+  }
 
-  struct NES* nes = map->rom->nes;
-  mapper_set_bank(map, index, addr, size, true);
+  mapper_init_banks(map);
 }
 
-void mapper_set_vrom_bank(struct mapper* map, u16 index, u16 addr, u16 size)
+void mapper_init_banks(struct mapper* map)
 {
-  LOGF("Setting 0x%X through 0x%X to VROM index %d", addr, addr + size, index);
-
-  struct NES* nes = map->rom->nes;
-  mapper_set_bank(map, index, addr, size, false);
+  memset(map->state, 0, sizeof(map->state));
+  map->sram_enabled = map->sram_writable = true;
+  map->ops->init(map);
 }
 
 u8 mapper_fetch_memory(struct mapper* map, u16 addr)
@@ -98,7 +90,17 @@ u8 mapper_fetch_memory(struct mapper* map, u16 addr)
   // PRG RAM (SRAM)
   // (addr >> 13) == 3 checks if 0x6000 <= addr <= 0x7FFF
   if((addr >> 13) == 3) {
-    return map->sram[addr - 0x6000];
+    if(!map->sram_enabled) return 0;
+    return map->sram_pages[(addr >> 10) & 7][addr & 0x3FF];
+  }
+
+  // expansion area (0x4018 - 0x5FFF), nothing there on supported boards
+  if(addr < 0x8000) {
+    return 0;
+  }
+
+  if(map->ops->read) {
+    return map->ops->read(map, addr);
   }
 
   u8* bank = map->rom_banks[(addr / ROM_BANK_SIZE) % NUM_BANKS];
@@ -107,121 +109,67 @@ u8 mapper_fetch_memory(struct mapper* map, u16 addr)
 
 void mapper_set_memory(struct mapper* map, u16 addr, u8 val)
 {
-  switch(map->num) {
-  case MMC1: {
-
-    // bit 7 is the reset flag
-    if(val >> 7) {
-      map->data.mmc1.write_count = 0;
-      map->data.mmc1.regs[0] = (1 << 2) | (1 << 3);
+  if((addr >> 13) == 3) {
+    if(!map->sram_enabled || !map->sram_writable) return;
+    cow_write(map->rom->nes->cow, COW_SRAM + ((addr >> 10) & 7))[addr & 0x3FF] = val;
+    return;
+  }
 
-      LOGF("MMC1 reset bit set");
+  if(addr < 0x8000) {
+    LOGF("XXX: Tried to access memory location 0x%X, which doesn't seem to be mapped", addr);
+    return;
+  }
 
-      goto switch_prg;
-    }
+  map->ops->write(map, addr, val);
+}
 
-    map->data.mmc1.reg_cache |= (val & 1) << map->data.mmc1.write_count;
-
-    // only every 5th write actually does anything
-    if(++map->data.mmc1.write_count == 5) {
-      u8 reg_index, value;
-
-    switch_prg:
-
-      reg_index = (addr >> 13) & 3;
-      value = map->data.mmc1.regs[reg_index] = map->data.mmc1.reg_cache;
-      map->data.mmc1.write_count = map->data.mmc1.reg_cache = 0;
-
-      /* control register (actual bankswitching takes place in 0xE000 - 0xFFFF)
-         $8000-9FFF:  [...C PSMM]
-         - C = CHR Mode (0=8k mode, 1=4k mode)
-         - P = PRG Size (0=32k mode, 1=16k mode)
-
-         - S = Slot select:
-         -- 0 = $C000 swappable, $8000 fixed to page $00 (mode A)
-         -- 1 = $8000 swappable, $C000 fixed to page $0F (mode B)
-         -- This bit is ignored when 'P' is clear (32k mode)
-
-         - M = Mirroring control:
-         -- %00 = 1ScA
-         -- %01 = 1ScB
-         -- %10 = Vert
-         -- %11 = Horz
-      */
-
-      map->data.mmc1.chr_mode = (value >> 4) & 1;
-
-      // TODO: nametable mirroring
-
-      /* CHR Bank 0
-         $A000-BFFF:  [...C CCCC]
-         - CHR Reg 0
-
-         CHR Bank 1
-         $C000-DFFF:  [...C CCCC]
-         - CHR Reg 1
-      */
-      {
-        // checks if bit 5 is set (4k)
-        u8 use_4k = (map->data.mmc1.regs[0] >> 4) & 1;
-        u8 bank = map->data.mmc1.regs[1] & 0x10;
-
-        // TODO: this is almost certainly wrong here
-        // mapper_set_vrom_bank(map, use_4k ? bank & 0xFE : bank, 0x0000, 0x0FFF);
-        // mapper_set_vrom_bank(map, use_4k ? bank & 0xFE + 1 : bank, 0x1000, 0x0FFF);
-      }
-
-      /* PRG Bank
-         $E000-FFFF:  [...W PPPP]
-         - W = RAM Disable (0=enabled, 1=disabled)
-         - P = PRG Reg
-      */
-      {
-        u8 reg0 = map->data.mmc1.regs[0];
-
-        u8 chr = (reg0 >> 4) & 1;
-        u8 prg = (reg0 >> 3) & 1;
-        u8 slot = (reg0 >> 2) & 1;
-        u8 mirror = reg0 & 3;
-
-        u8 bank = map->data.mmc1.regs[3] & 0xF;
-        map->rom->hdr.has_prg_ram = (map->data.mmc1.regs[3] >> 4) & 1;
-
-        if(prg == 0) {
-          // ignores low bit of bank number
-          mapper_set_rom_bank(map, (bank & 0xE) >> 1, 0x8000, 0x8000);
-        } else {
-
-          if(slot == 0) {
-            mapper_set_rom_bank(map, 0,    0x8000, 0x4000);
-            mapper_set_rom_bank(map, bank, 0xC000, 0x4000);
-          }
-
-          if(slot == 1) {
-            mapper_set_rom_bank(map, ~0, 0xC000, 0x4000);
-            mapper_set_rom_bank(map, bank, 0x8000, 0x4000);
-          }
-        }
-      }
-    }
+void mapper_scanline(struct mapper* map)
+{
+  if(map->ops->scanline) map->ops->scanline(map);
+}
 
-    break;
+u32 mapper_serialize(struct mapper* map, u8* buf, bool restore)
+{
+  if(map->ops->serialize) {
+    return map->ops->serialize(map, buf, restore);
   }
-  case AXROM: {
-    // (val & 7) to grap lowest 3 bits (representing bank index)
-    mapper_set_rom_bank(map, val & 0x7, 0x8000, 0x8000);
 
-    // (val >> 3) & 1 to grab bit 4 (vrom)
-    // mapper_set_vrom_bank(map, (val >> 3) & 0x1, ..., ...);
-    break;
+  if(restore) {
+    memcpy(map->state, buf, map->ops->state_size);
+  } else {
+    memcpy(buf, map->state, map->ops->state_size);
   }
 
-  case NROM:
-  case CNROM: {
-    // TODO: simulate bus conflict
+  return map->ops->state_size;
+}
+
+// the CHR RAM page at PPU address addr for writing, made private first if a
+// fork shares it
+u8* mapper_chr_ram(struct mapper* map, u16 addr)
+{
+  u8* page = map->vrom_banks[addr >> 10];
+  struct cow* cow = map->rom->nes->cow;
+
+  for(u32 i = 0; i < 8; ++i) {
+    if(map->chr_table[i] != page) continue;
+
+    cow->dirty |= 1u << (COW_CHR + i);
+
+    if(cow->shared[COW_CHR + i]) {
+      cow_unshare(cow, COW_CHR + i, true);
+      mapper_move_chr(map, page, map->chr_table[i]);
+    }
+
+    return map->chr_table[i];
   }
 
-  default:
-    LOGF("XXX: Tried to access memory location 0x%X, which doesn't seem to be mapped", addr);
+  return page;
+}
+
+// repoint the PPU page table after a CHR RAM page moved
+void mapper_move_chr(struct mapper* map, u8* from, u8* to)
+{
+  for(int i = 0; i < NUM_BANKS; ++i) {
+    if(map->vrom_banks[i] == from) map->vrom_banks[i] = to;
   }
 }
@@ -0,0 +1,82 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* AxROM (mapper 7), one switchable 32K PRG ROM bank and single screen mirroring */
+
+#include "mapper.h"
+#include "2C02.h"
+#include "nes.h"
+#include "rom.h"
+
+#include <string.h>
+
+struct axrom_state {
+  u8 prg_bank;
+  u8 nametable;  // which 1K VRAM page all 4 nametables use
+};
+
+#define STATE(map) ((struct axrom_state*)(map)->state)
+
+static void axrom_sync(struct mapper* map)
+{
+  mapper_set_rom_bank(map, STATE(map)->prg_bank, 0x8000, 0x8000);
+  ppu_2C02_set_mirroring(map->rom->nes->ppu,
+                         STATE(map)->nametable ? MIRROR_SINGLE_HIGH : MIRROR_SINGLE_LOW);
+}
+
+static void axrom_init(struct mapper* map)
+{
+  axrom_sync(map);
+  mapper_set_vrom_bank(map, 0, 0x0000, 0x2000);
+}
+
+/* Any write to 0x8000 - 0xFFFF:
+   xxxM xPPP
+   PPP - Select 32 KB PRG ROM bank for CPU $8000-$FFFF
+   M   - Select 1 KB VRAM page for all 4 nametables
+*/
+static void axrom_write(struct mapper* map, u16 addr, u8 val)
+{
+  (void)addr;
+
+  STATE(map)->prg_bank = val & 0x7;
+  STATE(map)->nametable = (val >> 4) & 0x1;
+
+  axrom_sync(map);
+}
+
+static u32 axrom_serialize(struct mapper* map, u8* buf, bool restore)
+{
+  if(!restore) {
+    memcpy(buf, map->state, sizeof(struct axrom_state));
+  } else {
+    memcpy(map->state, buf, sizeof(struct axrom_state));
+    axrom_sync(map);
+  }
+
+  return sizeof(struct axrom_state);
+}
+
+const struct mapper_ops axrom_ops = {
+  .num        = AXROM,
+  .name       = "AxROM",
+  .state_size = sizeof(struct axrom_state),
+  .init       = axrom_init,
+  .write      = axrom_write,
+  .serialize  = axrom_serialize,
+};
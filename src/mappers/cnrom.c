@@ -0,0 +1,69 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* CNROM (mapper 3), fixed PRG ROM and a switchable 8K CHR ROM bank */
+
+#include "mapper.h"
+
+#include <string.h>
+
+struct cnrom_state {
+  u8 chr_bank;
+};
+
+#define STATE(map) ((struct cnrom_state*)(map)->state)
+
+static void cnrom_init(struct mapper* map)
+{
+  mapper_set_rom_bank(map, 0, 0x8000, 0x8000);
+  mapper_set_vrom_bank(map, 0, 0x0000, 0x2000);
+}
+
+/* Any write to 0x8000 - 0xFFFF:
+   xxxx xxCC
+   CC - Select 8 KB CHR ROM bank for PPU $0000-$1FFF
+*/
+static void cnrom_write(struct mapper* map, u16 addr, u8 val)
+{
+  (void)addr;
+
+  // TODO: simulate bus conflict
+  STATE(map)->chr_bank = val & 0x3;
+  mapper_set_vrom_bank(map, STATE(map)->chr_bank, 0x0000, 0x2000);
+}
+
+static u32 cnrom_serialize(struct mapper* map, u8* buf, bool restore)
+{
+  if(!restore) {
+    memcpy(buf, map->state, sizeof(struct cnrom_state));
+  } else {
+    memcpy(map->state, buf, sizeof(struct cnrom_state));
+    mapper_set_vrom_bank(map, STATE(map)->chr_bank, 0x0000, 0x2000);
+  }
+
+  return sizeof(struct cnrom_state);
+}
+
+const struct mapper_ops cnrom_ops = {
+  .num        = CNROM,
+  .name       = "CNROM",
+  .state_size = sizeof(struct cnrom_state),
+  .init       = cnrom_init,
+  .write      = cnrom_write,
+  .serialize  = cnrom_serialize,
+};
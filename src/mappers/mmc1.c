@@ -0,0 +1,152 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* MMC1 (mapper 1), used by SxROM boards */
+
+#include "mapper.h"
+#include "2C02.h"
+#include "nes.h"
+#include "rom.h"
+
+#include <string.h>
+
+struct mmc1_state {
+  u8 write_count;
+  u8 reg_cache;   // shift register, filled LSB first
+  u8 regs[4];
+};
+
+#define STATE(map) ((struct mmc1_state*)(map)->state)
+
+// redo the banking described by the four internal registers
+static void mmc1_sync(struct mapper* map)
+{
+  u8* regs = STATE(map)->regs;
+
+  /* control register
+     $8000-9FFF:  [...C PSMM]
+     - C = CHR Mode (0=8k mode, 1=4k mode)
+     - P = PRG Size (0=32k mode, 1=16k mode)
+
+     - S = Slot select:
+     -- 0 = $C000 swappable, $8000 fixed to page $00 (mode A)
+     -- 1 = $8000 swappable, $C000 fixed to page $0F (mode B)
+     -- This bit is ignored when 'P' is clear (32k mode)
+
+     - M = Mirroring control:
+     -- %00 = 1ScA
+     -- %01 = 1ScB
+     -- %10 = Vert
+     -- %11 = Horz
+  */
+  u8 chr  = (regs[0] >> 4) & 1;
+  u8 prg  = (regs[0] >> 3) & 1;
+  u8 slot = (regs[0] >> 2) & 1;
+
+  static const enum ppu_mirroring mirroring[4] = {
+    MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+  };
+  ppu_2C02_set_mirroring(map->rom->nes->ppu, mirroring[regs[0] & 3]);
+
+  /* CHR Bank 0
+     $A000-BFFF:  [...C CCCC]
+     - CHR Reg 0
+
+     CHR Bank 1
+     $C000-DFFF:  [...C CCCC]
+     - CHR Reg 1
+  */
+  if(chr) {
+    mapper_set_vrom_bank(map, regs[1], 0x0000, 0x1000);
+    mapper_set_vrom_bank(map, regs[2], 0x1000, 0x1000);
+  } else {
+    // ignores low bit of bank number
+    mapper_set_vrom_bank(map, regs[1] >> 1, 0x0000, 0x2000);
+  }
+
+  /* PRG Bank
+     $E000-FFFF:  [...W PPPP]
+     - W = RAM Disable (0=enabled, 1=disabled)
+     - P = PRG Reg
+  */
+  u8 bank = regs[3] & 0xF;
+  map->sram_enabled = map->sram_writable = !((regs[3] >> 4) & 1);
+
+  if(prg == 0) {
+    // ignores low bit of bank number
+    mapper_set_rom_bank(map, bank >> 1, 0x8000, 0x8000);
+  } else if(slot == 0) {
+    mapper_set_rom_bank(map, 0,    0x8000, 0x4000);
+    mapper_set_rom_bank(map, bank, 0xC000, 0x4000);
+  } else {
+    mapper_set_rom_bank(map, bank, 0x8000, 0x4000);
+    mapper_set_rom_bank(map, ~0,   0xC000, 0x4000);
+  }
+}
+
+static void mmc1_init(struct mapper* map)
+{
+  // power on in 16K mode with the last bank fixed at 0xC000
+  STATE(map)->regs[0] = 0x0C;
+  mmc1_sync(map);
+}
+
+static void mmc1_write(struct mapper* map, u16 addr, u8 val)
+{
+  struct mmc1_state* s = STATE(map);
+
+  // bit 7 is the reset flag
+  if(val >> 7) {
+    s->write_count = s->reg_cache = 0;
+    s->regs[0] |= (1 << 2) | (1 << 3);
+
+    mmc1_sync(map);
+    return;
+  }
+
+  s->reg_cache |= (val & 1) << s->write_count;
+
+  // only every 5th write actually does anything
+  if(++s->write_count == 5) {
+    s->regs[(addr >> 13) & 3] = s->reg_cache;
+    s->write_count = s->reg_cache = 0;
+
+    mmc1_sync(map);
+  }
+}
+
+static u32 mmc1_serialize(struct mapper* map, u8* buf, bool restore)
+{
+  if(!restore) {
+    memcpy(buf, map->state, sizeof(struct mmc1_state));
+  } else {
+    memcpy(map->state, buf, sizeof(struct mmc1_state));
+    mmc1_sync(map);
+  }
+
+  return sizeof(struct mmc1_state);
+}
+
+const struct mapper_ops mmc1_ops = {
+  .num        = MMC1,
+  .name       = "MMC1",
+  .state_size = sizeof(struct mmc1_state),
+  .init       = mmc1_init,
+  .write      = mmc1_write,
+  .serialize  = mmc1_serialize,
+};
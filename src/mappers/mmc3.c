@@ -0,0 +1,183 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* MMC3 (mapper 4), used by TxROM boards */
+
+#include "mapper.h"
+#include "2C02.h"
+#include "6502.h"
+#include "nes.h"
+#include "rom.h"
+
+#include <string.h>
+
+struct mmc3_state {
+  u8 bank_select;   // $8000
+  u8 regs[8];       // R0 - R7, written through $8001
+  u8 mirroring;     // $A000
+  u8 prg_ram;       // $A001: bit 7 enables PRG RAM, bit 6 protects it
+
+  u8 irq_latch;     // $C000
+  u8 irq_counter;
+  bool irq_reload;  // $C001
+  bool irq_enabled; // $E000 / $E001
+};
+
+#define STATE(map) ((struct mmc3_state*)(map)->state)
+
+static void mmc3_set_irq(struct mapper* map, bool level)
+{
+  cpu_6502_set_irq(map->rom->nes->cpu, IRQ_MAPPER, level);
+}
+
+/*
+  Bank select ($8000 even): CPxx xRRR
+  - C = CHR A12 inversion
+  - P = PRG ROM bank mode
+  - R = which of R0 - R7 the next $8001 write goes to
+
+  PRG (8K banks, -2 / -1 are the second to last / last bank)
+    P   $8000   $A000   $C000   $E000
+    0   R6      R7      -2      -1
+    1   -2      R7      R6      -1
+
+  CHR (R0 / R1 are 2K banks and ignore their low bit)
+    C   $0000   $0400   $0800   $0C00   $1000   $1400   $1800   $1C00
+    0   R0              R1              R2      R3      R4      R5
+    1   R2      R3      R4      R5      R0              R1
+*/
+static void mmc3_sync(struct mapper* map)
+{
+  struct mmc3_state* s = STATE(map);
+
+  u16 swap = (s->bank_select & 0x40) ? 0x4000 : 0x0000;
+  mapper_set_rom_bank(map, s->regs[6], 0x8000 ^ swap, 0x2000);
+  mapper_set_rom_bank(map, s->regs[7], 0xA000,        0x2000);
+  mapper_set_rom_bank(map, -2,         0xC000 ^ swap, 0x2000);
+  mapper_set_rom_bank(map, -1,         0xE000,        0x2000);
+
+  u16 inv = (s->bank_select & 0x80) ? 0x1000 : 0x0000;
+  mapper_set_vrom_bank(map, s->regs[0] >> 1, 0x0000 ^ inv, 0x0800);
+  mapper_set_vrom_bank(map, s->regs[1] >> 1, 0x0800 ^ inv, 0x0800);
+  mapper_set_vrom_bank(map, s->regs[2],      0x1000 ^ inv, 0x0400);
+  mapper_set_vrom_bank(map, s->regs[3],      0x1400 ^ inv, 0x0400);
+  mapper_set_vrom_bank(map, s->regs[4],      0x1800 ^ inv, 0x0400);
+  mapper_set_vrom_bank(map, s->regs[5],      0x1C00 ^ inv, 0x0400);
+
+  map->sram_enabled  = s->prg_ram & 0x80;
+  map->sram_writable = !(s->prg_ram & 0x40);
+
+  // four screen boards ignore $A000
+  if(map->rom->hdr.mirroring != MIRROR_FOUR)
+    ppu_2C02_set_mirroring(map->rom->nes->ppu, s->mirroring ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+}
+
+static void mmc3_init(struct mapper* map)
+{
+  struct mmc3_state* s = STATE(map);
+
+  s->regs[0] = 0; s->regs[1] = 2;
+  s->regs[2] = 4; s->regs[3] = 5; s->regs[4] = 6; s->regs[5] = 7;
+  s->regs[6] = 0; s->regs[7] = 1;
+  s->mirroring = map->rom->hdr.mirroring == MIRROR_HORIZONTAL;
+  s->prg_ram = 0x80; // games expect their RAM before they enable it
+
+  mmc3_sync(map);
+}
+
+// registers are selected by address range and A0 (even / odd)
+static void mmc3_write(struct mapper* map, u16 addr, u8 val)
+{
+  struct mmc3_state* s = STATE(map);
+
+  switch(((addr >> 12) & 0x6) | (addr & 1)) {
+  case 0: // $8000 bank select
+    s->bank_select = val;
+    mmc3_sync(map);
+    break;
+  case 1: // $8001 bank data
+    s->regs[s->bank_select & 7] = val;
+    mmc3_sync(map);
+    break;
+  case 2: // $A000 mirroring
+    s->mirroring = val & 1;
+    mmc3_sync(map);
+    break;
+  case 3: // $A001 PRG RAM protect
+    s->prg_ram = val;
+    mmc3_sync(map);
+    break;
+  case 4: // $C000 IRQ latch
+    s->irq_latch = val;
+    break;
+  case 5: // $C001 IRQ reload
+    s->irq_counter = 0;
+    s->irq_reload = true;
+    break;
+  case 6: // $E000 IRQ disable, also acknowledges a pending IRQ
+    s->irq_enabled = false;
+    mmc3_set_irq(map, false);
+    break;
+  case 7: // $E001 IRQ enable
+    s->irq_enabled = true;
+    break;
+  }
+}
+
+/* Clocked on each rising edge of PPU A12, which while rendering with the
+   usual pattern table layout happens once per scanline. The PPU predicts
+   where that edge falls and calls this through the scanline hook instead
+   of watching every pattern fetch.
+*/
+static void mmc3_clock_irq(struct mapper* map)
+{
+  struct mmc3_state* s = STATE(map);
+
+  if(s->irq_counter == 0 || s->irq_reload) {
+    s->irq_counter = s->irq_latch;
+    s->irq_reload = false;
+  } else {
+    s->irq_counter--;
+  }
+
+  if(s->irq_counter == 0 && s->irq_enabled) {
+    mmc3_set_irq(map, true);
+  }
+}
+
+static u32 mmc3_serialize(struct mapper* map, u8* buf, bool restore)
+{
+  if(!restore) {
+    memcpy(buf, map->state, sizeof(struct mmc3_state));
+  } else {
+    memcpy(map->state, buf, sizeof(struct mmc3_state));
+    mmc3_sync(map);
+  }
+
+  return sizeof(struct mmc3_state);
+}
+
+const struct mapper_ops mmc3_ops = {
+  .num        = MMC3,
+  .name       = "MMC3",
+  .state_size = sizeof(struct mmc3_state),
+  .init       = mmc3_init,
+  .write      = mmc3_write,
+  .scanline   = mmc3_clock_irq,
+  .serialize  = mmc3_serialize,
+};
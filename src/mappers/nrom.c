@@ -0,0 +1,42 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* NROM (mapper 0), no bank switching at all. 16K PRG ROMs are mirrored at 0xC000 */
+
+#include "mapper.h"
+
+static void nrom_init(struct mapper* map)
+{
+  mapper_set_rom_bank(map, 0, 0x8000, 0x8000);
+  mapper_set_vrom_bank(map, 0, 0x0000, 0x2000);
+}
+
+static void nrom_write(struct mapper* map, u16 addr, u8 val)
+{
+  (void)map; (void)val;
+
+  // TODO: simulate bus conflict
+  LOGF("XXX: Tried to access memory location 0x%X, which doesn't seem to be mapped", addr);
+}
+
+const struct mapper_ops nrom_ops = {
+  .num   = NROM,
+  .name  = "NROM",
+  .init  = nrom_init,
+  .write = nrom_write,
+};
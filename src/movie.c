@@ -0,0 +1,284 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* input movies, see movie.h */
+
+#include "movie.h"
+#include "2C02.h"
+#include "hash.h"
+#include "nes.h"
+#include "rom.h"
+#include "state.h"
+
+#include <string.h>
+
+#define HEADER_SIZE 0x18
+#define FRAME_SIZE  10
+#define MAX_FRAMES  (1u << 26)   // about 12 days at 60 frames a second
+
+static void put16(u8* p, u16 v) { p[0] = v; p[1] = v >> 8; }
+static void put32(u8* p, u32 v) { put16(p, v); put16(p + 2, v >> 16); }
+static void put64(u8* p, u64 v) { put32(p, v); put32(p + 4, v >> 32); }
+static u16  get16(const u8* p)  { return create_u16(p[0], p[1]); }
+static u32  get32(const u8* p)  { return get16(p) | (u32)get16(p + 2) << 16; }
+static u64  get64(const u8* p)  { return get32(p) | (u64)get32(p + 4) << 32; }
+
+u64 movie_rom_hash(struct rom_image* img)
+{
+  u64 h = hash_bytes(img->prg, img->prg_size, HASH_SEED);
+  return hash_bytes(img->chr, img->chr_size, h);
+}
+
+// an empty movie for the ROM loaded into nes, checkpointed every interval
+// frames unless 0
+struct movie* movie_create(struct NES* nes, u32 interval)
+{
+  struct movie* m = malloc(sizeof(struct movie));
+  if(!m) return NULL;
+  memset(m, 0, sizeof(struct movie));
+
+  m->rom_hash = movie_rom_hash(nes->rom->img);
+  m->interval = interval;
+
+  return m;
+}
+
+void movie_free(struct movie* m)
+{
+  for(u32 i = 0; i < m->checkpoints; ++i)
+    free(m->checkpoint[i].state);
+
+  free(m->checkpoint);
+  free(m->frame);
+  free(m);
+}
+
+static bool movie_add_checkpoint(struct movie* m, u32 frame, u32 size)
+{
+  struct movie_checkpoint* c = realloc(m->checkpoint,
+                                       (m->checkpoints + 1) * sizeof(struct movie_checkpoint));
+  if(!c) return false;
+
+  m->checkpoint = c;
+  c += m->checkpoints;
+
+  c->frame = frame;
+  c->size = size;
+  c->state = malloc(size);
+  if(!c->state) return false;
+
+  m->checkpoints++;
+  return true;
+}
+
+static bool movie_reserve(struct movie* m, u32 frames)
+{
+  if(frames <= m->capacity) return true;
+  if(frames > MAX_FRAMES) return false;
+
+  u32 capacity = m->capacity ? m->capacity : 3600;
+  while(capacity < frames) capacity *= 2;
+  if(capacity > MAX_FRAMES) capacity = MAX_FRAMES;
+
+  struct movie_frame* frame = realloc(m->frame, capacity * sizeof(struct movie_frame));
+  if(!frame) return false;
+
+  m->frame = frame;
+  m->capacity = capacity;
+
+  return true;
+}
+
+bool movie_save(struct movie* m, FILE* fp)
+{
+  u8 buf[HEADER_SIZE];
+
+  memcpy(buf, MOVIE_MAGIC, 4);
+  put16(buf + 4, MOVIE_VERSION);
+  put16(buf + 6, STATE_VERSION);
+  put64(buf + 8, m->rom_hash);
+  put32(buf + 16, m->frames);
+  put32(buf + 20, m->interval);
+
+  if(fwrite(buf, HEADER_SIZE, 1, fp) != 1) return false;
+
+  for(u32 i = 0; i < m->frames; ++i) {
+    buf[0] = m->frame[i].input[0];
+    buf[1] = m->frame[i].input[1];
+    put64(buf + 2, m->frame[i].hash);
+
+    if(fwrite(buf, FRAME_SIZE, 1, fp) != 1) return false;
+  }
+
+  if(!m->interval) return true;
+
+  put32(buf, m->checkpoints);
+  if(fwrite(buf, 4, 1, fp) != 1) return false;
+
+  for(u32 i = 0; i < m->checkpoints; ++i) {
+    put32(buf, m->checkpoint[i].frame);
+    put32(buf + 4, m->checkpoint[i].size);
+
+    if(fwrite(buf, 8, 1, fp) != 1 ||
+       fwrite(m->checkpoint[i].state, m->checkpoint[i].size, 1, fp) != 1) return false;
+  }
+
+  return true;
+}
+
+struct movie* movie_load(FILE* fp)
+{
+  u8 buf[HEADER_SIZE];
+
+  if(fread(buf, HEADER_SIZE, 1, fp) != 1 || memcmp(buf, MOVIE_MAGIC, 4)) {
+    LOGF("Not a movie");
+    return NULL;
+  }
+
+  u16 version = get16(buf + 4);
+
+  // older versions hashed the state differently, their hashes can't match
+  if(version != MOVIE_VERSION || get16(buf + 6) != STATE_VERSION) {
+    LOGF("Movie version %d (state version %d) isn't supported", get16(buf + 4), get16(buf + 6));
+    return NULL;
+  }
+
+  u32 frames = get32(buf + 16);
+
+  if(frames > MAX_FRAMES) {
+    LOGF("Movie has %u frames, at most %u are supported", frames, MAX_FRAMES);
+    return NULL;
+  }
+
+  struct movie* m = malloc(sizeof(struct movie));
+  if(!m) return NULL;
+  memset(m, 0, sizeof(struct movie));
+
+  m->rom_hash = get64(buf + 8);
+  m->interval = get32(buf + 20);
+
+  // grown while reading, so a bogus frame count fails at the end of the
+  // file rather than up front with a huge allocation
+  for(; m->frames < frames; ++m->frames) {
+    if(!movie_reserve(m, m->frames + 1)) {
+      LOGF("Out of memory");
+      movie_free(m);
+      return NULL;
+    }
+
+    if(fread(buf, FRAME_SIZE, 1, fp) != 1) {
+      LOGF("Movie is truncated after %u of %u frames", m->frames, frames);
+      movie_free(m);
+      return NULL;
+    }
+
+    m->frame[m->frames].input[0] = buf[0];
+    m->frame[m->frames].input[1] = buf[1];
+    m->frame[m->frames].hash = get64(buf + 2);
+  }
+
+  u32 checkpoints = 0;
+
+  if(m->interval && fread(buf, 4, 1, fp) == 1)
+    checkpoints = get32(buf);
+
+  // i only counts checkpoints whose state was read in full, a partly read
+  // one is already in m->checkpoints and freed along with the movie
+  u32 i = 0;
+
+  for(; i < checkpoints; ++i) {
+    u32 frame, size;
+
+    if(fread(buf, 8, 1, fp) != 1) break;
+    frame = get32(buf);
+    size = get32(buf + 4);
+
+    // segments between checkpoints are verified on their own, see verify.c
+    if(frame <= (i ? m->checkpoint[i - 1].frame : 0) || frame > frames) {
+      LOGF("Movie checkpoint %u at frame %u is out of order", i, frame);
+      movie_free(m);
+      return NULL;
+    }
+
+    if(size > 0x1000000 || !movie_add_checkpoint(m, frame, size) ||
+       fread(m->checkpoint[i].state, size, 1, fp) != 1) break;
+  }
+
+  if(i != checkpoints) {
+    LOGF("Movie checkpoints are truncated");
+    movie_free(m);
+    return NULL;
+  }
+
+  return m;
+}
+
+// runs one frame with the buttons in nes->input and appends it
+void movie_record_frame(struct movie* m, struct NES* nes)
+{
+  if(!movie_reserve(m, m->frames + 1)) {
+    LOGF("Out of memory");
+    return;
+  }
+
+  if(m->interval && m->frames && m->frames % m->interval == 0) {
+    u32 size = nes_state_size(nes);
+
+    if(movie_add_checkpoint(m, m->frames, size)) {
+      nes_save_state(nes, m->checkpoint[m->checkpoints - 1].state, size);
+    } else {
+      LOGF("Out of memory, no checkpoint at frame %u", m->frames);
+    }
+  }
+
+  nes_run_frame(nes);
+
+  struct movie_frame* f = &m->frame[m->frames++];
+  f->input[0] = nes->input[0];
+  f->input[1] = nes->input[1];
+  f->hash = nes_state_hash(nes);
+}
+
+/* Replays m on nes, which has to be freshly powered on with the same ROM.
+   frames is set to the number of frames that matched; returns true if that
+   is all of them. Nothing is drawn, the hash doesn't cover the picture. */
+bool movie_play(struct movie* m, struct NES* nes, u32* frames)
+{
+  *frames = 0;
+
+  if(m->rom_hash != movie_rom_hash(nes->rom->img)) {
+    LOGF("Movie was recorded with a different ROM");
+    return false;
+  }
+
+  bool suppress = nes->ppu->suppress_output;
+  nes->ppu->suppress_output = true;
+
+  for(u32 i = 0; i < m->frames; ++i) {
+    nes->input[0] = m->frame[i].input[0];
+    nes->input[1] = m->frame[i].input[1];
+
+    nes_run_frame(nes);
+
+    if(nes_state_hash(nes) != m->frame[i].hash) break;
+    ++*frames;
+  }
+
+  nes->ppu->suppress_output = suppress;
+
+  return *frames == m->frames;
+}
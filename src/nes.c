@@ -18,47 +18,203 @@
 
 /* */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "nes.h"
 
 #include "6502.h"
 #include "2C02.h"
 #include "apu.h"
+#include "controller.h"
+#include "cow.h"
 #include "mapper.h"
 #include "rom.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// see nes.h, cold and large members last
+struct nes_arena {
+  struct NES    nes;
+  struct _6502  cpu;
+  struct memory mem __attribute__ ((aligned (NES_ALIGN)));
+  struct mapper map;
+  struct ROM    rom;
+  struct _2C02  ppu __attribute__ ((aligned (NES_ALIGN)));
+  struct APU    apu __attribute__ ((aligned (NES_ALIGN)));
+
+  u8 sram[0x2000];
+  u8 chr_ram[0x2000];
+
+  struct cow cow;
+} __attribute__ ((aligned (NES_ALIGN)));
+
+// point every page at the arena, CHR RAM only if the board has it
+static void nes_bind_pages(struct nes_arena* arena)
+{
+  struct cow* cow = &arena->cow;
+
+  for(int i = 0; i < 8; ++i)
+    cow_bind(cow, COW_SRAM + i, &arena->map.sram_pages[i], arena->sram + i * COW_PAGE_SIZE);
+
+  for(int i = 0; i < 4; ++i)
+    cow_bind(cow, COW_VRAM + i, &arena->ppu.vram_pages[i], arena->ppu.vram + i * COW_PAGE_SIZE);
+
+  for(int i = 0; i < 8; ++i) {
+    if(arena->rom.chr_ram)
+      cow_bind(cow, COW_CHR + i, &arena->rom.chr_ram_banks[i], arena->chr_ram + i * COW_PAGE_SIZE);
+    else
+      cow_bind(cow, COW_CHR + i, NULL, NULL);
+  }
+}
+
+size_t nes_instance_size(void)
+{
+  return sizeof(struct nes_arena);
+}
+
 struct NES* nes_create(void)
 {
-  struct NES* nes = calloc(1, sizeof(struct NES));
+  void* mem;
 
-  nes->cpu = cpu_6502_create(nes);
-  nes->ppu = ppu_2C02_create(nes);
-  nes->apu = apu_create(nes);
+  if(posix_memalign(&mem, NES_ALIGN, sizeof(struct nes_arena))) {
+    LOGF("Out of memory");
+    return NULL;
+  }
 
-  nes->mem = calloc(1, sizeof(struct memory));
+  struct NES* nes = nes_create_in(mem, sizeof(struct nes_arena));
+  nes->owns_memory = true;
 
-  nes->mem->rom_size = nes->mem->vrom_size = 0;
-  nes->is_active = false;
+  return nes;
+}
+
+struct NES* nes_create_in(void* mem, size_t size)
+{
+  if((uintptr_t)mem % NES_ALIGN || size < sizeof(struct nes_arena)) {
+    LOGF("Need %zu bytes aligned to %d", sizeof(struct nes_arena), NES_ALIGN);
+    return NULL;
+  }
+
+  struct nes_arena* arena = mem;
+  memset(arena, 0, sizeof(struct nes_arena));
 
+  struct NES* nes = &arena->nes;
+
+  nes->cpu = &arena->cpu;
+  nes->ppu = &arena->ppu;
+  nes->apu = &arena->apu;
+  nes->mem = &arena->mem;
+  nes->cow = &arena->cow;
+
+  cpu_6502_init(nes->cpu, nes);
+  ppu_2C02_init(nes->ppu, nes);
+  apu_init(nes->apu, nes);
+
+  nes_bind_pages(arena);
+
+  nes->is_active = false;
   nes->rom = NULL;
 
   return nes;
 }
 
 
-void nes_free(struct NES* nes)
+// see nes.h, the parent has to have a ROM loaded
+struct NES* nes_fork(struct NES* nes)
 {
-  cpu_6502_free(nes->cpu);
-  ppu_2C02_free(nes->ppu);
-  apu_free(nes->apu);
+  struct nes_arena* parent = (struct nes_arena*)nes;
+  struct nes_arena* arena;
+
+  if(!nes->rom || posix_memalign((void**)&arena, NES_ALIGN, sizeof(struct nes_arena))) {
+    LOGF("Can't fork this NES");
+    return NULL;
+  }
+
+  // only the shared pages' own storage and the output buffers stay
+  // uninitialized, everything else is copied and repointed
+  arena->nes = parent->nes;
+  arena->nes.cpu = &arena->cpu;
+  arena->nes.ppu = &arena->ppu;
+  arena->nes.apu = &arena->apu;
+  arena->nes.mem = &arena->mem;
+  arena->nes.rom = &arena->rom;
+  arena->nes.cow = &arena->cow;
+  arena->nes.owns_memory = true;
+  INST(memset(&arena->nes.inst, 0, sizeof(struct instrument)));
+
+  arena->cpu = parent->cpu;
+  arena->cpu.nes = &arena->nes;
+  arena->cpu.profile = NULL;
+  arena->cpu.tracebuf = NULL;
+
+  arena->mem = parent->mem;
+
+  arena->rom = parent->rom;
+  arena->rom.img = rom_image_retain(parent->rom.img);
+  arena->rom.map = &arena->map;
+  arena->rom.nes = &arena->nes;
+
+  arena->map = parent->map;
+  arena->map.rom = &arena->rom;
+
+  if(parent->rom.chr_ram) {
+    arena->rom.chr_ram = arena->chr_ram;
+    arena->mem.vrom = arena->chr_ram;
+    arena->map.chr_table = arena->rom.chr_ram_banks;
+  }
+
+  memcpy(&arena->ppu, &parent->ppu, offsetof(struct _2C02, vram));
+  memcpy(arena->ppu.palette, parent->ppu.palette, sizeof(arena->ppu.palette));
+  memcpy(arena->ppu.oam, parent->ppu.oam, sizeof(arena->ppu.oam));
+  arena->ppu.obs = NULL;
+  arena->ppu.nes = &arena->nes;
 
+  arena->apu.r = parent->apu.r;
+  arena->apu.suppress_output = parent->apu.suppress_output;
+  arena->apu.sample_count = 0;
+  arena->apu.nes = &arena->nes;
 
-  free(nes->mem->rom);
-  free(nes->mem->vrom);
-  free(nes->mem);
+  // the child's PPU page table still points where the parent's did
+  u8* chr[8];
+  memcpy(chr, parent->rom.chr_ram_banks, sizeof(chr));
 
-  if(nes->rom) rom_free(nes->rom);
+  memset(&arena->cow, 0, sizeof(struct cow));
+  nes_bind_pages(arena);
+  cow_share(&parent->cow, &arena->cow);
 
-  free(nes);
+  for(int i = 0; parent->rom.chr_ram && i < 8; ++i) {
+    mapper_move_chr(&parent->map, chr[i], parent->rom.chr_ram_banks[i]);
+    mapper_move_chr(&arena->map, chr[i], arena->rom.chr_ram_banks[i]);
+  }
+
+  return &arena->nes;
+}
+
+// copies every page still shared with forks back into this instance
+void nes_unshare(struct NES* nes)
+{
+  struct cow* cow = nes->cow;
+
+  for(u32 i = 0; cow->count && i < COW_PAGES; ++i) {
+    if(!cow->shared[i]) continue;
+
+    u8* page = *cow->slot[i];
+    cow_unshare(cow, i, true);
+
+    if(i >= COW_CHR) mapper_move_chr(nes->rom->map, page, *cow->slot[i]);
+  }
+}
+
+void nes_free(struct NES* nes)
+{
+  cow_release(nes->cow);
+
+  // PRG and CHR belong to the (shared) ROM image
+  if(nes->rom) rom_destroy(nes->rom);
+
+  // the arena starts with the NES
+  if(nes->owns_memory) free(nes);
 }
 
 void nes_powerup(struct NES* nes)
@@ -66,6 +222,8 @@ void nes_powerup(struct NES* nes)
   cpu_6502_powerup(nes->cpu);
   ppu_2C02_powerup(nes->ppu);
   apu_powerup(nes->apu);
+
+  nes->strobe = nes->shift[0] = nes->shift[1] = 0;
 }
 
 void nes_reset(struct NES* nes)
@@ -77,16 +235,47 @@ void nes_reset(struct NES* nes)
 
 bool nes_load_rom(struct NES* nes, FILE* fp)
 {
-  // free any previous ROM
-  if(nes->rom) free(nes->rom);
+  struct rom_image* img = rom_image_load_file(fp);
+
+  if(!img) {
+    LOGF("ROM load failed");
+    return false;
+  }
+
+  bool ok = nes_load_rom_image(nes, img);
+  rom_image_release(img);
+
+  return ok;
+}
 
-  nes->rom = rom_load_file(fp, nes);
+bool nes_load_rom_buffer(struct NES* nes, const u8* buf, u32 size)
+{
+  struct rom_image* img = rom_image_load_buffer(buf, size);
 
-  if(!nes->rom) {
+  if(!img) {
     LOGF("ROM load failed");
     return false;
   }
 
+  bool ok = nes_load_rom_image(nes, img);
+  rom_image_release(img);
+
+  return ok;
+}
+
+// share an already loaded image, the NES takes its own reference
+bool nes_load_rom_image(struct NES* nes, struct rom_image* img)
+{
+  struct nes_arena* arena = (struct nes_arena*)nes;
+
+  // drop any previous ROM
+  cow_release(nes->cow);
+  if(nes->rom) rom_destroy(nes->rom);
+
+  rom_init(&arena->rom, img, nes, &arena->map, arena->sram, arena->chr_ram);
+  nes->rom = &arena->rom;
+  nes_bind_pages(arena);
+
   return true;
 }
 
@@ -96,7 +285,7 @@ void nes_run(struct NES* nes)
   nes_powerup(nes);
   nes->is_active = true;
 
-  printf("PC     OP  \tNAM  TYPE\tINFO\n");
+  if(nes->cpu->trace) printf("PC     OP  \tNAM  TYPE\tINFO\n");
   while(nes->is_active) {
     nes_tick(nes);
   }
@@ -104,17 +293,53 @@ void nes_run(struct NES* nes)
   return;
 }
 
+// run until the PPU starts the next frame (or the NES stops)
+void nes_run_frame(struct NES* nes)
+{
+  u32 frame = nes->ppu->frame;
+
+  while(nes->is_active && nes->ppu->frame == frame) {
+    nes_tick(nes);
+  }
+}
+
+#ifdef NESTORAMA_INSTRUMENT
+// called once the PPU started a new frame
+void nes_instrument_frame(struct NES* nes)
+{
+  struct mapper* map = nes->rom->map;
+
+  nes->inst.count[INST_BANK_SWITCHES] += map->bank_switches;
+  map->bank_switches = 0;
+
+  instrument_frame(&nes->inst, nes->ppu->frame);
+}
+#endif
+
+// runs one CPU instruction, then lets the other chips catch up on the
+// cycles it took
 void nes_tick(struct NES* nes)
 {
+  u32 ticks = nes->cpu->ticks;
+  INST(struct instrument_mark m);
+  INST(instrument_mark(&nes->inst, &m));
+
+  cpu_6502_tick(nes->cpu);
+  INST(instrument_lap(&nes->inst, INST_TIME_CPU, &m));
+
+  u32 cycles = nes->cpu->ticks - ticks;
+
   // PPU ticks at 3 times CPU rate
-  for(int i = 0; i < 3; ++i)
-    ppu_2C02_tick(nes->ppu);
+  ppu_2C02_run(nes->ppu, cycles * 3);
+  INST(instrument_lap(&nes->inst, INST_TIME_PPU, &m));
 
   // APU ticks at 1 times CPU rate
-  for(int i = 0; i < 1; ++i)
-    apu_tick(nes->apu);
+  apu_run(nes->apu, cycles);
+  INST(instrument_lap(&nes->inst, INST_TIME_APU, &m));
 
-  cpu_6502_tick(nes->cpu);
+  INST(++nes->inst.count[INST_INSTRUCTIONS]);
+  INST(++nes->inst.count[INST_APU_SYNCS]);
+  INST(if(nes->ppu->frame != nes->inst.frame) nes_instrument_frame(nes));
 }
 
 
@@ -128,26 +353,49 @@ void nes_inspect(struct NES* nes)
   if(nes->rom) rom_inspect(nes->rom);
 }
 
+// copy a page of CPU memory to OAM, the CPU is stalled for 513 cycles
+static void nes_oam_dma(struct NES* nes, u8 page)
+{
+  struct _2C02* ppu = nes->ppu;
+  INST(struct instrument_mark m);
+  INST(instrument_mark(&nes->inst, &m));
+
+  for(int i = 0; i < 0x100; ++i)
+    ppu->oam[(u8)(ppu->r.oam_addr + i)] = nes_fetch_memory(nes, (page << 8) | i);
+
+  nes->cpu->ticks += 513;
+
+  INST(instrument_lap(&nes->inst, INST_TIME_DMA, &m));
+  INST(++nes->inst.count[INST_DMA]);
+}
+
 // the bitwise ANDing in set_memory and fetch_memory are to compensate for memory mirroring
 u8 nes_fetch_memory(struct NES* nes, u16 addr)
 {
   // Low memory
   if(addr < 0x2000) {
+    INST(++nes->inst.count[INST_BUS_RAM]);
     return nes->mem->lowmem[addr & 0x7FF];
   }
 
   // PPU registers
   if(addr < 0x4000) {
+    INST(++nes->inst.count[INST_BUS_PPU]);
     return ppu_2C02_get_register(nes->ppu, addr & 0x07);
   }
 
   // APU registers
   if(addr < 0x4018) {
+    INST(++nes->inst.count[INST_BUS_APU]);
+    if(addr == 0x4015) return apu_read_status(nes->apu);
+    if(addr >= 0x4016) return controller_read(nes, addr & 1);
+
     return nes->mem->apureg[addr & 0x7];
   }
 
   // ROM memory
   else {
+    INST(++nes->inst.count[INST_BUS_CART]);
     return rom_fetch_memory(nes->rom, addr);
   }
 }
@@ -157,21 +405,32 @@ void nes_set_memory(struct NES* nes, u16 addr, u8 value)
 
   // Low memory
   if(addr < 0x2000) {
+    INST(++nes->inst.count[INST_BUS_RAM]);
     nes->mem->lowmem[addr & 0x7FF] = value;
   }
 
   // PPU registers
   else if(addr < 0x4000) {
+    INST(++nes->inst.count[INST_BUS_PPU]);
     ppu_2C02_set_register(nes->ppu, addr & 0x07, value);
   }
 
   // APU registers
   else if(addr < 0x4018) {
+    INST(++nes->inst.count[INST_BUS_APU]);
     nes->mem->apureg[addr & 0x17] = value;
+
+    if(addr == 0x4014)
+      nes_oam_dma(nes, value);
+    else if(addr == 0x4016)
+      controller_write(nes, value);
+    else
+      apu_write(nes->apu, addr, value);
   }
 
   // ROM memory
   else {
+    INST(++nes->inst.count[INST_BUS_CART]);
     rom_set_memory(nes->rom, addr, value);
   }
 }
@@ -0,0 +1,128 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* embedding API, see nestorama.h */
+
+#include "nestorama.h"
+#include "def.h"
+#include "2C02.h"
+#include "apu.h"
+#include "nes.h"
+#include "obs.h"
+#include "state.h"
+
+#include <string.h>
+
+struct nestorama {
+  struct NES* nes;
+  u8* rom;              // our copy of the image, which the NES borrows
+  struct obs obs;
+};
+
+struct nestorama* nestorama_create(const void* rom, size_t size)
+{
+  if(size > UINT32_MAX) return NULL;
+
+  struct nestorama* n = malloc(sizeof(struct nestorama));
+  if(!n) return NULL;
+
+  n->rom = malloc(size);
+  n->nes = nes_create();
+
+  if(!n->rom || !n->nes || !nes_load_rom_buffer(n->nes, memcpy(n->rom, rom, size), size)) {
+    if(n->nes) nes_free(n->nes);
+    free(n->rom);
+    free(n);
+    return NULL;
+  }
+
+  nes_powerup(n->nes);
+  n->nes->is_active = true;
+
+  return n;
+}
+
+void nestorama_destroy(struct nestorama* n)
+{
+  if(!n) return;
+
+  nes_free(n->nes);
+  free(n->rom);
+  free(n);
+}
+
+void nestorama_reset(struct nestorama* n)
+{
+  nes_reset(n->nes);
+  n->nes->apu->sample_count = 0;
+  n->nes->is_active = true;
+}
+
+int nestorama_step_frame(struct nestorama* n, uint8_t input)
+{
+  struct NES* nes = n->nes;
+
+  nes->input[0] = input;
+  nes->apu->sample_count = 0;
+
+  nes_run_frame(nes);
+
+  return nes->is_active;
+}
+
+const uint8_t* nestorama_framebuffer(struct nestorama* n)
+{
+  return n->nes->ppu->framebuffer;
+}
+
+const uint8_t* nestorama_ram(struct nestorama* n)
+{
+  return n->nes->mem->lowmem;
+}
+
+const int16_t* nestorama_audio(struct nestorama* n, size_t* count)
+{
+  *count = n->nes->apu->sample_count;
+  return n->nes->apu->samples;
+}
+
+uint64_t nestorama_state_hash(struct nestorama* n)
+{
+  return nes_state_hash(n->nes);
+}
+
+size_t nestorama_observation_size(unsigned width, unsigned height, unsigned depth)
+{
+  return obs_ring_size(width, height, depth);
+}
+
+int nestorama_observe(struct nestorama* n, uint8_t* ring, unsigned width, unsigned height,
+                      unsigned depth, int format)
+{
+  n->nes->ppu->obs = NULL;
+
+  if(!ring) return 1;
+  if(!obs_init(&n->obs, ring, width, height, depth, format)) return 0;
+
+  n->nes->ppu->obs = &n->obs;
+  return 1;
+}
+
+const uint8_t* nestorama_observation(struct nestorama* n)
+{
+  return n->nes->ppu->obs ? obs_stack(&n->obs) : NULL;
+}
@@ -0,0 +1,188 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* observations, see obs.h */
+
+#include "obs.h"
+
+#include <string.h>
+
+#ifdef __x86_64__
+#include <tmmintrin.h>
+#endif
+
+/* Composite levels of the 2C02 in volts, per color level (bits 4 - 5).
+   Hue 0 stays at the high level, hue 13 at the low level, hues 14 and 15
+   are black and the rest alternate between both, so their luma is the
+   average. See http://wiki.nesdev.com/w/index.php/NTSC_video */
+static void obs_init_luma(u8* luma)
+{
+  static const float low[4]  = { 0.228f, 0.312f, 0.552f, 0.880f };
+  static const float high[4] = { 0.616f, 0.840f, 1.100f, 1.100f };
+  const float black = 0.312f, white = 1.100f;
+
+  for(int i = 0; i < 64; ++i) {
+    int hue = i & 0x0F, level = i >> 4;
+    float v;
+
+    if(hue == 0)       v = high[level];
+    else if(hue == 13) v = low[level];
+    else if(hue > 13)  v = black;
+    else               v = (low[level] + high[level]) / 2;
+
+    v = (v - black) / (white - black);
+    luma[i] = v <= 0 ? 0 : v >= 1 ? 255 : (u8)(v * 255 + 0.5f);
+  }
+}
+
+static void obs_luma_row(const u8* luma, const u8* src, u8* dst)
+{
+  for(u32 x = 0; x < PPU_WIDTH; ++x) dst[x] = luma[src[x] & 0x3F];
+}
+
+#ifdef __x86_64__
+/* The same, 16 pixels at a time: pshufb looks up the low nibble in each of
+   the four 16 entry quarters of the table, the high bits pick the quarter */
+__attribute__ ((target ("ssse3")))
+static void obs_luma_row_ssse3(const u8* luma, const u8* src, u8* dst)
+{
+  const __m128i* table = (const __m128i*)luma;
+  __m128i quarter[4], low = _mm_set1_epi8(0x0F), high = _mm_set1_epi8(0x03);
+
+  for(int i = 0; i < 4; ++i) quarter[i] = _mm_loadu_si128(table + i);
+
+  for(u32 x = 0; x < PPU_WIDTH; x += 16) {
+    __m128i i = _mm_loadu_si128((const __m128i*)(src + x));
+    __m128i nibble = _mm_and_si128(i, low);
+    __m128i q = _mm_and_si128(_mm_srli_epi16(i, 4), high);
+    __m128i out = _mm_setzero_si128();
+
+    for(int k = 0; k < 4; ++k) {
+      __m128i hit = _mm_cmpeq_epi8(q, _mm_set1_epi8(k));
+      out = _mm_or_si128(out, _mm_and_si128(hit, _mm_shuffle_epi8(quarter[k], nibble)));
+    }
+
+    _mm_storeu_si128((__m128i*)(dst + x), out);
+  }
+}
+#endif
+
+size_t obs_ring_size(u32 width, u32 height, u32 depth)
+{
+  return (size_t)2 * depth * width * height;
+}
+
+// ring has to hold obs_ring_size bytes and is cleared here
+bool obs_init(struct obs* o, u8* ring, u32 width, u32 height, u32 depth,
+              enum obs_format format)
+{
+  if(!ring || !depth || !width || !height || width > PPU_WIDTH || height > PPU_HEIGHT ||
+     format > OBS_INDEX) {
+    LOGF("Observations have to be between 1x1 and %dx%d", PPU_WIDTH, PPU_HEIGHT);
+    return false;
+  }
+
+  memset(o, 0, sizeof(struct obs));
+
+  o->ring = ring;
+  o->depth = depth;
+  o->width = width;
+  o->height = height;
+  o->format = format;
+
+  obs_init_luma(o->luma);
+
+  o->luma_row = obs_luma_row;
+#ifdef __x86_64__
+  if(__builtin_cpu_supports("ssse3")) o->luma_row = obs_luma_row_ssse3;
+#endif
+
+  for(u32 i = 0; i <= width; ++i)
+    o->x0[i] = i * PPU_WIDTH / width;
+
+  for(u32 i = 0; i <= height; ++i)
+    o->y0[i] = i * PPU_HEIGHT / height;
+
+  memset(ring, 0, obs_ring_size(width, height, depth));
+
+  return true;
+}
+
+/* Area average, done separably: the source rows of an output row are summed
+   across the full width first (a plain vertical add the compiler vectorizes),
+   then runs of 3 - 4 columns of that sum are reduced. */
+static void obs_gray(struct obs* o, const u8* fb, u8* out)
+{
+  u16 sum[PPU_WIDTH];
+  u8  row[PPU_WIDTH];
+
+  for(u32 oy = 0; oy < o->height; ++oy) {
+    u32 rows = o->y0[oy + 1] - o->y0[oy];
+
+    memset(sum, 0, sizeof(sum));
+
+    for(u32 y = o->y0[oy]; y < o->y0[oy + 1]; ++y) {
+      const u8* src = fb + y * PPU_WIDTH;
+
+      o->luma_row(o->luma, src, row);
+      for(u32 x = 0; x < PPU_WIDTH; ++x) sum[x] += row[x];
+    }
+
+    for(u32 ox = 0; ox < o->width; ++ox) {
+      u32 total = 0, area = (o->x0[ox + 1] - o->x0[ox]) * rows;
+
+      for(u32 x = o->x0[ox]; x < o->x0[ox + 1]; ++x) total += sum[x];
+
+      out[ox] = (total + area / 2) / area;
+    }
+
+    out += o->width;
+  }
+}
+
+// color indices can't be averaged, take the one nearest the center
+static void obs_index(struct obs* o, const u8* fb, u8* out)
+{
+  for(u32 oy = 0; oy < o->height; ++oy) {
+    const u8* src = fb + (o->y0[oy] + o->y0[oy + 1]) / 2 * PPU_WIDTH;
+
+    for(u32 ox = 0; ox < o->width; ++ox)
+      out[ox] = src[(o->x0[ox] + o->x0[ox + 1]) / 2] & 0x3F;
+
+    out += o->width;
+  }
+}
+
+void obs_push(struct obs* o, const u8* framebuffer)
+{
+  size_t size = (size_t)o->width * o->height;
+  u8* slot = o->ring + (o->frames % o->depth) * size;
+
+  if(o->format == OBS_GRAY)
+    obs_gray(o, framebuffer, slot);
+  else
+    obs_index(o, framebuffer, slot);
+
+  memcpy(slot + o->depth * size, slot, size);
+  o->frames++;
+}
+
+// the last depth frames, oldest first
+const u8* obs_stack(struct obs* o)
+{
+  return o->ring + (o->frames % o->depth) * (size_t)o->width * o->height;
+}
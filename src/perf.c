@@ -0,0 +1,158 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* hardware performance counters, see perf.h */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "perf.h"
+
+const char* const perf_names[PERF_COUNTERS] = {
+  "instructions", "cycles", "branch_misses", "l1d_misses", "llc_misses"
+};
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct { u32 type; u64 config; } perf_events[PERF_COUNTERS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                        PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES }
+};
+
+// returns the number of counters that could be opened
+u32 perf_open(struct perf* p)
+{
+  memset(p, 0, sizeof(struct perf));
+
+  for(int i = 0; i < PERF_COUNTERS; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+    if(p->fd[i] < 0) {
+      LOGF("Counter %s isn't available", perf_names[i]);
+      continue;
+    }
+
+    p->page[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, p->fd[i], 0);
+    if(p->page[i] == MAP_FAILED) p->page[i] = NULL;
+
+    ++p->count;
+  }
+
+  return p->count;
+}
+
+void perf_close(struct perf* p)
+{
+  for(int i = 0; i < PERF_COUNTERS; ++i) {
+    if(p->page[i]) munmap(p->page[i], sysconf(_SC_PAGESIZE));
+    if(p->fd[i] >= 0) close(p->fd[i]);
+
+    p->fd[i] = -1;
+    p->page[i] = NULL;
+  }
+
+  p->count = 0;
+}
+
+// the seqlock protocol of perf_event_mmap_page, false if rdpmc can't be used
+static bool perf_rdpmc(struct perf_event_mmap_page* pc, u64* value)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  u32 seq;
+  u64 count;
+
+  do {
+    seq = pc->lock;
+    __asm__ volatile("" ::: "memory");
+
+    u32 index = pc->index;
+    if(!pc->cap_user_rdpmc || !index) return false;
+
+    u32 lo, hi;
+    __asm__ volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (index - 1));
+
+    u32 width = pc->pmc_width;
+    count = (u64)hi << 32 | lo;
+    count = (u64)((int64_t)(count << (64 - width)) >> (64 - width));
+    count += pc->offset;
+
+    __asm__ volatile("" ::: "memory");
+  } while(pc->lock != seq);
+
+  *value = count;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// current values, 0 for counters that aren't open
+void perf_read(struct perf* p, u64* values)
+{
+  for(int i = 0; i < PERF_COUNTERS; ++i) {
+    values[i] = 0;
+
+    if(p->fd[i] < 0) continue;
+    if(p->page[i] && perf_rdpmc(p->page[i], &values[i])) continue;
+
+    if(read(p->fd[i], &values[i], sizeof(u64)) != sizeof(u64)) values[i] = 0;
+  }
+}
+
+#else
+
+u32 perf_open(struct perf* p)
+{
+  for(int i = 0; i < PERF_COUNTERS; ++i) {
+    p->fd[i] = -1;
+    p->page[i] = NULL;
+  }
+
+  p->count = 0;
+  return 0;
+}
+
+void perf_close(struct perf* p)
+{
+}
+
+void perf_read(struct perf* p, u64* values)
+{
+  memset(values, 0, PERF_COUNTERS * sizeof(u64));
+}
+
+#endif
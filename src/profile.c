@@ -0,0 +1,342 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* guest profiler, see profile.h */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "6502.h"
+#include "nes.h"
+#include "rom.h"
+
+#define LOOP_MAX     0x400   // longest backward jump taken for a loop
+#define ROUTINE_MAX  0x1000  // farthest an RTS is looked for
+#define BODY_MAX     4       // loops up to this many instructions are shown
+
+// a loop, routine or instruction of the report
+struct hot {
+  u64 cycles;
+  u32 first, last;     // table indices
+  u32 count;           // routines: call sites
+};
+
+struct profile* profile_create(struct NES* nes)
+{
+  struct rom_image* img = nes->rom->img;
+
+  struct profile* p = malloc(sizeof(struct profile));
+  memset(p, 0, sizeof(struct profile));
+
+  p->nes = nes;
+  p->prg = img->prg;
+  p->prg_size = img->prg_size;
+  p->size = 0x8000 + ((img->prg_size + 0x1FFF) >> 13 << 15);
+  p->cycles = calloc(p->size, sizeof(u64));
+
+  return p;
+}
+
+void profile_free(struct profile* p)
+{
+  free(p->cycles);
+  free(p);
+}
+
+void profile_clear(struct profile* p)
+{
+  memset(p->cycles, 0, p->size * sizeof(u64));
+  p->total = 0;
+}
+
+static u16 profile_addr(u32 i)
+{
+  return i < 0x8000 ? i : 0x8000 | (i & 0x7FFF);
+}
+
+// byte k of the instruction counted at i, from the bank it ran in; code in
+// RAM is read as it is now
+static u8 profile_byte(struct profile* p, u32 i, u32 k)
+{
+  u32 addr = profile_addr(i) + k;
+
+  if(i >= 0x8000) {
+    u32 offset = ((i >> 15) - 1) * 0x2000 + (i & 0x1FFF) + k;
+    return offset < p->prg_size ? p->prg[offset] : 0;
+  }
+
+  if(addr < 0x2000)
+    return p->nes->mem->lowmem[addr & 0x7FF];
+
+  if(addr >= 0x6000 && addr < 0x8000)
+    return p->nes->rom->map->sram_pages[(addr >> 10) & 7][addr & 0x3FF];
+
+  return 0;
+}
+
+// operand addresses and branch / jump targets
+static u16 profile_word(struct profile* p, u32 i)
+{
+  return create_u16(profile_byte(p, i, 1), profile_byte(p, i, 2));
+}
+
+static u16 profile_target(struct profile* p, u32 i)
+{
+  return profile_addr(i) + 2 + (int8_t)profile_byte(p, i, 1);
+}
+
+static int profile_disassemble(struct profile* p, u32 i, char* buf, size_t size)
+{
+  u8 bytes[3] = { profile_byte(p, i, 0), profile_byte(p, i, 1), profile_byte(p, i, 2) };
+  return cpu_6502_disassemble(bytes, profile_addr(i), buf, size);
+}
+
+static u64 profile_sum(struct profile* p, u32 first, u32 last)
+{
+  u64 sum = 0;
+
+  for(u32 i = first; i <= last; ++i)
+    sum += p->cycles[i];
+
+  return sum;
+}
+
+// the counter of the instruction at addr, for a jump from index from: the
+// same bank if addr is in the same 8K window, else the bank that ran most
+// at addr
+static bool profile_resolve(struct profile* p, u32 from, u16 addr, u32* index)
+{
+  if(addr < 0x8000) {
+    *index = addr;
+    return true;
+  }
+
+  if(from >= 0x8000 && (addr >> 13) == (profile_addr(from) >> 13)) {
+    *index = (from & ~0x7FFFu) + (addr & 0x7FFF);
+    return true;
+  }
+
+  u64 best = 0;
+
+  for(u32 i = 0x8000 + (addr & 0x7FFF); i < p->size; i += 0x8000) {
+    if(p->cycles[i] > best) {
+      best = p->cycles[i];
+      *index = i;
+    }
+  }
+
+  return best > 0;
+}
+
+static int profile_by_cycles(const void* a, const void* b)
+{
+  const struct hot* x = a;
+  const struct hot* y = b;
+
+  return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+static int profile_by_range(const void* a, const void* b)
+{
+  const struct hot* x = a;
+  const struct hot* y = b;
+
+  if(x->first != y->first) return x->first < y->first ? -1 : 1;
+  return x->last < y->last ? -1 : x->last > y->last;
+}
+
+// sorted by range, identical ranges merged, then by cycles
+static u32 profile_unique(struct hot* hot, u32 count)
+{
+  u32 n = 0;
+
+  qsort(hot, count, sizeof(struct hot), profile_by_range);
+
+  for(u32 i = 0; i < count; ++i) {
+    if(n && hot[n - 1].first == hot[i].first && hot[n - 1].last == hot[i].last)
+      hot[n - 1].count += hot[i].count;
+    else
+      hot[n++] = hot[i];
+  }
+
+  qsort(hot, n, sizeof(struct hot), profile_by_cycles);
+
+  return n;
+}
+
+// the columns every section starts with, bank "--" below $8000
+static void profile_header(FILE* fp, const char* title, const char* columns)
+{
+  fprintf(fp, "\n%s:\n  %14s %7s  bank  %s\n", title, "cycles", "%", columns);
+}
+
+static void profile_line(struct profile* p, struct hot* h, FILE* fp)
+{
+  fprintf(fp, "  %14llu %6.2f%%", (unsigned long long)h->cycles,
+          p->total ? 100.0 * h->cycles / p->total : 0.0);
+
+  if(h->first < 0x8000)
+    fprintf(fp, "  --    ");
+  else
+    fprintf(fp, "  %02X    ", (h->first >> 15) - 1);
+}
+
+static void profile_loops(struct profile* p, struct hot* hot, FILE* fp, u32 top)
+{
+  u32 count = 0;
+
+  // every executed branch or JMP back to itself or before
+  for(u32 i = 0; i < p->size; ++i) {
+    if(!p->cycles[i]) continue;
+
+    u8 op = profile_byte(p, i, 0);
+    u16 addr = profile_addr(i), target;
+
+    if(opcode_modes[op] == MODE_REL)
+      target = profile_target(p, i);
+    else if(op == 0x4C)
+      target = profile_word(p, i);
+    else
+      continue;
+
+    if(target > addr || addr - target > LOOP_MAX || (target ^ addr) & 0x8000) continue;
+
+    hot[count].first = i - (addr - target);
+    hot[count].last = i;
+    hot[count].count = 1;
+    hot[count].cycles = profile_sum(p, hot[count].first, i);
+    ++count;
+  }
+
+  count = profile_unique(hot, count);
+
+  profile_header(fp, "Hot loops", "range        body");
+
+  for(u32 k = 0; k < count && k < top; ++k) {
+    char body[128];
+    int len = 0, n = 0;
+
+    for(u32 i = hot[k].first; i <= hot[k].last && n <= BODY_MAX; ++n) {
+      if(!p->cycles[i]) {
+        ++i;
+        --n;
+        continue;
+      }
+
+      if(n == BODY_MAX) {
+        snprintf(body + len, sizeof(body) - len, "; ...");
+        break;
+      }
+
+      if(n) len += snprintf(body + len, sizeof(body) - len, "; ");
+      len += profile_disassemble(p, i, body + len, sizeof(body) - len);
+      i += cpu_6502_length(profile_byte(p, i, 0));
+    }
+
+    profile_line(p, &hot[k], fp);
+    fprintf(fp, "$%04X-$%04X  %s\n", profile_addr(hot[k].first), profile_addr(hot[k].last), body);
+  }
+}
+
+static void profile_routines(struct profile* p, struct hot* hot, FILE* fp, u32 top)
+{
+  u32 count = 0;
+
+  // the targets of every executed JSR, up to the first executed RTS or RTI
+  for(u32 i = 0; i < p->size; ++i) {
+    u32 entry;
+
+    if(!p->cycles[i] || profile_byte(p, i, 0) != 0x20) continue;
+    if(!profile_resolve(p, i, profile_word(p, i), &entry)) continue;
+
+    u32 end = entry, limit = entry | 0x7FFF;
+    if(entry < 0x8000) limit = 0x7FFF;
+    if(limit > entry + ROUTINE_MAX) limit = entry + ROUTINE_MAX;
+
+    for(; end < limit; ++end) {
+      u8 op = profile_byte(p, end, 0);
+      if(p->cycles[end] && (op == 0x60 || op == 0x40)) break;
+    }
+
+    hot[count].first = entry;
+    hot[count].last = end;
+    hot[count].count = 1;
+    hot[count].cycles = profile_sum(p, entry, end);
+    ++count;
+  }
+
+  count = profile_unique(hot, count);
+
+  profile_header(fp, "Hot routines (entry to the first RTS)", "entry  call sites");
+
+  for(u32 k = 0; k < count && k < top; ++k) {
+    profile_line(p, &hot[k], fp);
+    fprintf(fp, "$%04X  %u\n", profile_addr(hot[k].first), hot[k].count);
+  }
+}
+
+static void profile_instructions(struct profile* p, struct hot* hot, FILE* fp, u32 top)
+{
+  u32 count = 0;
+
+  for(u32 i = 0; i < p->size; ++i) {
+    if(!p->cycles[i]) continue;
+
+    hot[count].first = hot[count].last = i;
+    hot[count].cycles = p->cycles[i];
+    ++count;
+  }
+
+  qsort(hot, count, sizeof(struct hot), profile_by_cycles);
+
+  profile_header(fp, "Hot instructions", "addr   instruction");
+
+  for(u32 k = 0; k < count && k < top; ++k) {
+    char text[32];
+    profile_disassemble(p, hot[k].first, text, sizeof(text));
+
+    profile_line(p, &hot[k], fp);
+    fprintf(fp, "$%04X  %s\n", profile_addr(hot[k].first), text);
+  }
+}
+
+void profile_report(struct profile* p, FILE* fp, u32 top)
+{
+  u32 executed = 0;
+
+  p->total = 0;
+
+  for(u32 i = 0; i < p->size; ++i) {
+    p->total += p->cycles[i];
+    executed += p->cycles[i] != 0;
+  }
+
+  fprintf(fp, "Guest profile: %llu cycles at %u addresses\n",
+          (unsigned long long)p->total, executed);
+
+  // at most one entry per executed instruction in each section
+  struct hot* hot = malloc((executed + 1) * sizeof(struct hot));
+  memset(hot, 0, (executed + 1) * sizeof(struct hot));
+
+  profile_loops(p, hot, fp, top);
+  profile_routines(p, hot, fp, top);
+  profile_instructions(p, hot, fp, top);
+
+  free(hot);
+}
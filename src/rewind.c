@@ -0,0 +1,234 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/* rewind buffer, see rewind.h */
+
+#include "rewind.h"
+#include "nes.h"
+#include "state.h"
+
+#include <string.h>
+
+/*
+  Deltas are coded as a sequence of runs, each starting with one byte:
+
+    0x00 - 0x7F   n + 1 literal (nonzero) XOR bytes follow
+    0x80 - 0xFF   (n & 0x7F) + 1 zero bytes, nothing follows
+
+  Decoding XORs straight into the destination and simply skips zero runs.
+*/
+#define RLE_MAX_RUN 128
+#define RLE_WORST(size) ((size) + (size) / RLE_MAX_RUN + 1)
+
+static u64 load64(const u8* p)
+{
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static u32 rle_xor_encode(const u8* a, const u8* b, u32 size, u8* out)
+{
+  u8* o = out;
+  u32 i = 0;
+
+  while(i < size) {
+    u32 start = i;
+
+    // equal bytes, a word at a time while possible
+    while(i + 8 <= size && load64(a + i) == load64(b + i)) i += 8;
+    while(i < size && a[i] == b[i]) i++;
+
+    for(u32 run = i - start; run; ) {
+      u32 n = run > RLE_MAX_RUN ? RLE_MAX_RUN : run;
+      *o++ = 0x80 | (n - 1);
+      run -= n;
+    }
+
+    start = i;
+    while(i < size && a[i] != b[i] && i - start < RLE_MAX_RUN) i++;
+
+    if(i > start) {
+      *o++ = i - start - 1;
+      for(u32 j = start; j < i; ++j) *o++ = a[j] ^ b[j];
+    }
+  }
+
+  return o - out;
+}
+
+static void rle_xor_decode(const u8* in, u32 size, u8* dst)
+{
+  const u8* end = in + size;
+
+  while(in < end) {
+    u8 c = *in++;
+
+    if(c & 0x80) {
+      dst += (c & 0x7F) + 1;
+    } else {
+      for(u32 n = c + 1; n; --n) *dst++ ^= *in++;
+    }
+  }
+}
+
+// budget covers everything the rewind buffer allocates
+struct rewind* rewind_create(struct NES* nes, u32 budget, u32 interval)
+{
+  u32 state_size = nes_state_size(nes);
+  u32 fixed = 2 * state_size + RLE_WORST(state_size);
+  u32 max_entries = budget / 256 > 16 ? budget / 256 : 16;
+  u32 meta = max_entries * sizeof(struct rewind_entry);
+
+  if(budget < fixed + meta + RLE_WORST(state_size)) {
+    LOGF("Rewind budget of %u bytes is too small, need at least %u",
+         budget, fixed + meta + RLE_WORST(state_size));
+    return NULL;
+  }
+
+  struct rewind* rw = malloc(sizeof(struct rewind));
+  memset(rw, 0, sizeof(struct rewind));
+
+  rw->nes = nes;
+  rw->interval = interval ? interval : 1;
+  rw->state_size = state_size;
+
+  rw->current = malloc(state_size);
+  rw->next = malloc(state_size);
+  rw->packed = malloc(RLE_WORST(state_size));
+
+  rw->ring_size = budget - fixed - meta;
+  rw->ring = malloc(rw->ring_size);
+
+  rw->max_entries = max_entries;
+  rw->entries = malloc(meta);
+
+  rewind_clear(rw);
+
+  return rw;
+}
+
+void rewind_free(struct rewind* rw)
+{
+  free(rw->current);
+  free(rw->next);
+  free(rw->packed);
+  free(rw->ring);
+  free(rw->entries);
+  free(rw);
+}
+
+void rewind_clear(struct rewind* rw)
+{
+  rw->have_current = false;
+  rw->frames = 0;
+  rw->write_pos = 0;
+  rw->first = rw->count = 0;
+}
+
+static void rewind_drop_oldest(struct rewind* rw)
+{
+  rw->first = (rw->first + 1) % rw->max_entries;
+  rw->count--;
+}
+
+static void rewind_store(struct rewind* rw, const u8* data, u32 size)
+{
+  // can't ever fit, and history can't have holes in it
+  if(size > rw->ring_size) {
+    rw->count = rw->first = rw->write_pos = 0;
+    return;
+  }
+
+  u32 pos = rw->write_pos;
+  if(pos + size > rw->ring_size) {
+    pos = 0;
+
+    // wrapping around, the oldest entries are the ones past the write
+    // position, the space they leave at the end of the ring is lost
+    while(rw->count && rw->entries[rw->first].offset >= rw->write_pos)
+      rewind_drop_oldest(rw);
+  }
+
+  // entries after the write position are the oldest ones, in order, so
+  // only the oldest can be in the way
+  while(rw->count) {
+    struct rewind_entry* old = &rw->entries[rw->first];
+
+    if(old->offset >= pos + size || old->offset + old->size <= pos) break;
+    rewind_drop_oldest(rw);
+  }
+
+  if(rw->count == rw->max_entries) rewind_drop_oldest(rw);
+
+  struct rewind_entry* e = &rw->entries[(rw->first + rw->count) % rw->max_entries];
+  e->offset = pos;
+  e->size = size;
+  rw->count++;
+
+  memcpy(rw->ring + pos, data, size);
+  rw->write_pos = pos + size;
+}
+
+// call once per emulated frame, takes a snapshot every interval frames
+void rewind_push(struct rewind* rw)
+{
+  if(rw->have_current && ++rw->frames < rw->interval) return;
+
+  rw->frames = 0;
+  nes_save_state(rw->nes, rw->next, rw->state_size);
+
+  if(rw->have_current) {
+    u32 size = rle_xor_encode(rw->current, rw->next, rw->state_size, rw->packed);
+    rewind_store(rw, rw->packed, size);
+  }
+
+  u8* tmp = rw->current;
+  rw->current = rw->next;
+  rw->next = tmp;
+  rw->have_current = true;
+}
+
+/* Go back one snapshot (one frame with an interval of 1). If the NES has
+   run past the newest snapshot, this first returns to that snapshot.
+   Returns false once there is no history left. */
+bool rewind_step_back(struct rewind* rw)
+{
+  if(!rw->have_current) return false;
+
+  if(rw->frames == 0) {
+    if(!rw->count) return false;
+
+    struct rewind_entry* e = &rw->entries[(rw->first + rw->count - 1) % rw->max_entries];
+    rle_xor_decode(rw->ring + e->offset, e->size, rw->current);
+
+    rw->write_pos = e->offset;
+    rw->count--;
+  }
+
+  rw->frames = 0;
+  return nes_load_state(rw->nes, rw->current, rw->state_size);
+}
+
+u32 rewind_frames_available(struct rewind* rw)
+{
+  if(!rw->have_current) return 0;
+
+  return rw->count * rw->interval + rw->frames;
+}
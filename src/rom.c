@@ -16,66 +16,278 @@
 */
 
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "rom.h"
+#include "2C02.h"
 #include "ines.h"
 #include "mapper.h"
+#include "nes.h"
 
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-struct ROM* rom_load_file(FILE* fp, struct NES* nes)
+// pointers to every bank_size bank of data, padded to a power of two
+static u8** rom_bank_table(const u8* data, u32 size, u32 bank_size, u32* mask)
 {
+  u32 count = size / bank_size, n = 1;
+  while(n < count) n <<= 1;
 
-  struct ROM* rom = malloc(sizeof(struct ROM));
-  memset(rom, 0, sizeof(struct ROM));
+  u8** table = malloc(n * sizeof(u8*));
 
-  rom->nes = nes;
+  for(u32 i = 0; i < n; ++i) {
+    table[i] = (u8*)data + (i % count) * bank_size;
+  }
+
+  *mask = n - 1;
+  return table;
+}
 
-  fseek(fp, 0, SEEK_END);
-  long fsize = ftell(fp);
-  rewind(fp);
+static void rom_image_build_banks(struct rom_image* img)
+{
+  free(img->prg_banks);
+  free(img->chr_banks);
 
-  LOGF("Loading ROM: %ld bytes", fsize);
+  img->prg_banks = rom_bank_table(img->prg, img->prg_size, ROM_BANK_SIZE, &img->prg_mask);
+  img->chr_banks = img->chr_size
+    ? rom_bank_table(img->chr, img->chr_size, VROM_BANK_SIZE, &img->chr_mask)
+    : NULL;
+}
+
+static void rom_image_release_storage(struct rom_image* img)
+{
+  switch(img->storage) {
+  case ROM_MAPPED:
+    munmap(img->data, img->data_size);
+    break;
+  case ROM_HEAP:
+    free(img->data);
+    break;
+  case ROM_BORROWED:
+    break;
+  }
+
+  img->data = NULL;
+}
+
+// takes ownership of data (according to storage), even on failure
+static struct rom_image* rom_image_load(u8* data, u32 size, enum rom_storage storage)
+{
+  struct rom_image* img = malloc(sizeof(struct rom_image));
+  memset(img, 0, sizeof(struct rom_image));
+
+  img->refs = 1;
+  img->data = data;
+  img->data_size = size;
+  img->storage = storage;
+
+  LOGF("Loading ROM: %u bytes", size);
   LOGF("Trying to determine ROM type.");
 
   // check for iNES
-  char hdr[4] = {0};
-  fread(hdr, 1, 4, fp);
-  if(!memcmp(hdr, INES_HEADER, 4)) {
+  if(size >= 4 && !memcmp(data, INES_HEADER, 4)) {
     LOGF("This ROM appears to be an iNES file");
 
-    rewind(fp);
-
-    if(!ines_rom_load_file(fp, rom)) goto fail;
+    if(!ines_image_load_buffer(data, size, img)) goto fail;
 
   } else {
     LOGF("Can't determine this ROM's file type");
     goto fail;
   }
 
-  rom->map = mapper_create(rom);
+  rom_image_build_banks(img);
 
-  return rom;
+  return img;
  fail:
-  free(rom);
+  rom_image_release_storage(img);
+  free(img);
   LOGF("Failed to load ROM, aborting");
 
   return NULL;
 }
 
+// far beyond any real cartridge, keeps sizes (and doubling them) within a u32
+#define ROM_MAX_SIZE (1u << 30)
+
+// Regular files are mapped read only and shared through the page cache, so
+// loading the same ROM many times costs neither copies nor extra memory.
+struct rom_image* rom_image_load_file(FILE* fp)
+{
+  struct stat st;
+  int fd = fileno(fp);
+
+  if(fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    if(st.st_size >= ROM_MAX_SIZE) {
+      LOGF("ROM is too big (%lld bytes)", (long long)st.st_size);
+      return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(data != MAP_FAILED) {
+      return rom_image_load(data, st.st_size, ROM_MAPPED);
+    }
+
+    LOGF("Couldn't mmap ROM, falling back to reading it");
+  }
+
+  // pipes and friends can't be mapped, so slurp them onto the heap
+  u32 size = 0, cap = 0x10000;
+  u8* data = malloc(cap);
+  size_t read;
+
+  if(!data) {
+    LOGF("Couldn't allocate memory for the ROM");
+    return NULL;
+  }
+
+  while((read = fread(data + size, 1, cap - size, fp)) > 0) {
+    size += read;
+
+    if(size == cap) {
+      u8* grown = cap < ROM_MAX_SIZE ? realloc(data, cap * 2) : NULL;
+
+      if(!grown) {
+        LOGF("ROM is too big or couldn't be read into memory");
+        free(data);
+        return NULL;
+      }
+
+      data = grown;
+      cap *= 2;
+    }
+  }
+
+  return rom_image_load(data, size, ROM_HEAP);
+}
+
+// buf isn't copied, it has to stay alive (and unchanged) until the last
+// reference to the image is released
+struct rom_image* rom_image_load_buffer(const u8* buf, u32 size)
+{
+  return rom_image_load((u8*)buf, size, ROM_BORROWED);
+}
 
-void rom_free(struct ROM* rom)
+// images may be shared between threads, so the count is kept atomically
+struct rom_image* rom_image_retain(struct rom_image* img)
 {
-  free(rom->map);
-  free(rom);
+  __atomic_fetch_add(&img->refs, 1, __ATOMIC_RELAXED);
+  return img;
+}
+
+void rom_image_release(struct rom_image* img)
+{
+  if(__atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  rom_image_release_storage(img);
+  free(img->prg_banks);
+  free(img->chr_banks);
+  free(img);
+}
+
+// Overwrite part of the file image (offset is relative to the start of the
+// file, so patches apply as they would to the file on disk). Mapped images
+// are private mappings, so only the pages actually touched get copied.
+//
+// Every NES sharing the image sees the patch, and borrowed buffers get moved
+// to the heap, so patch before handing the image to any NES.
+bool rom_image_patch(struct rom_image* img, u32 offset, const u8* data, u32 size)
+{
+  if(offset > img->data_size || size > img->data_size - offset) {
+    LOGF("Patch of 0x%X bytes at 0x%X is out of bounds", size, offset);
+    return false;
+  }
+
+  switch(img->storage) {
+  case ROM_MAPPED:
+    if(mprotect(img->data, img->data_size, PROT_READ | PROT_WRITE)) {
+      LOGF("Couldn't make ROM mapping writable");
+      return false;
+    }
+    break;
+
+  case ROM_BORROWED: {
+    u8* copy = malloc(img->data_size);
+    memcpy(copy, img->data, img->data_size);
+
+    img->prg = copy + (img->prg - img->data);
+    if(img->chr)     img->chr     = copy + (img->chr - img->data);
+    if(img->trainer) img->trainer = copy + (img->trainer - img->data);
+
+    img->data = copy;
+    img->storage = ROM_HEAP;
+
+    rom_image_build_banks(img);
+    break;
+  }
+
+  case ROM_HEAP:
+    break;
+  }
+
+  memcpy(img->data + offset, data, size);
+  return true;
+}
+
+/* Plug a (possibly shared) image into a NES. Nothing is allocated, the
+   mapper and the 0x2000 bytes each of sram and chr_ram come from the NES'
+   arena; chr_ram is only used by boards without CHR ROM. */
+void rom_init(struct ROM* rom, struct rom_image* img, struct NES* nes,
+              struct mapper* map, u8* sram, u8* chr_ram)
+{
+  memset(rom, 0, sizeof(struct ROM));
+
+  rom->nes = nes;
+  rom->img = rom_image_retain(img);
+  rom->hdr = img->hdr;
+
+  nes->mem->rom_size = img->prg_size;
+  nes->mem->rom = (u8*)img->prg;
+
+  if(img->chr_size) {
+    nes->mem->vrom_size = img->chr_size;
+    nes->mem->vrom = (u8*)img->chr;
+  } else {
+    rom->chr_ram = chr_ram;
+    memset(chr_ram, 0, 0x2000);
+    nes->mem->vrom_size = 0x2000;
+    nes->mem->vrom = rom->chr_ram;
+
+    for(int i = 0; i < 8; ++i) {
+      rom->chr_ram_banks[i] = rom->chr_ram + i * VROM_BANK_SIZE;
+    }
+  }
+
+  ppu_2C02_set_mirroring(nes->ppu, rom->hdr.mirroring);
+
+  rom->map = map;
+  mapper_init(map, rom, sram);
+
+  if(img->trainer) {
+    memcpy(rom->map->sram_pages[4], img->trainer, 0x200);
+  }
+}
+
+void rom_destroy(struct ROM* rom)
+{
+  struct memory* mem = rom->nes->mem;
+
+  mem->rom = mem->vrom = NULL;
+  mem->rom_size = mem->vrom_size = 0;
+
+  rom_image_release(rom->img);
+  rom->img = NULL;
+  rom->map = NULL;
 }
 
 
 void rom_inspect(struct ROM* rom)
 {
-  printf("ROM = { PRG ROM=0x%X, CHR ROM=0x%X, PRG RAM=%s, format=%s mapper=%d }\n",
+  printf("ROM = { PRG ROM=0x%X, CHR ROM=0x%X, PRG RAM=%s, format=%s mapper=%d (%s) }\n",
          rom->hdr.prg_rom_count * 0x4000, rom->hdr.chr_rom_count * 0x2000,
          rom->hdr.has_prg_ram ? "YES" : "NO", rom->hdr.format == NTSC ? "NTSC" : "PAL",
-         rom->map->num);
+         rom->map->num, rom->map->ops->name);
 }
 
 
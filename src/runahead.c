@@ -0,0 +1,91 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* run-ahead, see runahead.h */
+
+#include "runahead.h"
+#include "6502.h"
+#include "2C02.h"
+#include "apu.h"
+#include "nes.h"
+#include "state.h"
+
+#include <string.h>
+
+// a ROM has to be loaded, the state size depends on it
+struct runahead* runahead_create(struct NES* nes, u32 frames)
+{
+  struct runahead* ra = malloc(sizeof(struct runahead));
+  memset(ra, 0, sizeof(struct runahead));
+
+  ra->nes = nes;
+  ra->frames = frames;
+  ra->state_size = nes_state_size(nes);
+  ra->state = malloc(ra->state_size);
+
+  return ra;
+}
+
+void runahead_free(struct runahead* ra)
+{
+  free(ra->state);
+  free(ra);
+}
+
+void runahead_run_frame(struct runahead* ra)
+{
+  struct NES* nes = ra->nes;
+
+  if(!ra->frames) {
+    nes_run_frame(nes);
+    return;
+  }
+
+  bool trace = nes->cpu->trace;
+  struct profile* profile = nes->cpu->profile;
+  struct tracebuf* tracebuf = nes->cpu->tracebuf;
+
+  // the real frame, only its sound is kept
+  nes->ppu->suppress_output = true;
+  nes_run_frame(nes);
+  nes->ppu->suppress_output = false;
+
+  if(!nes->is_active || !nes_save_state(nes, ra->state, ra->state_size))
+    return;
+
+  // the speculative frames, only the last one is drawn
+  nes->apu->suppress_output = true;
+  nes->cpu->trace = false;
+  nes->cpu->profile = NULL;
+  nes->cpu->tracebuf = NULL;
+
+  for(u32 i = 0; i < ra->frames && nes->is_active; ++i) {
+    nes->ppu->suppress_output = (i + 1 < ra->frames);
+    nes_run_frame(nes);
+  }
+
+  nes->ppu->suppress_output = false;
+  nes->apu->suppress_output = false;
+  nes->cpu->trace = trace;
+  nes->cpu->profile = profile;
+  nes->cpu->tracebuf = tracebuf;
+
+  // looking ahead may have crashed the game, the real timeline hasn't (the
+  // state restores is_active as well)
+  nes_load_state(nes, ra->state, ra->state_size);
+}
@@ -0,0 +1,311 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* multi instance runner, see runner.h */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "runner.h"
+#include "nes.h"
+
+#include <string.h>
+
+// tasks stays NULL if this fails
+static bool deque_init(struct runner_deque* d, u32 capacity)
+{
+  d->tasks = malloc(capacity * sizeof(u32));
+  if(!d->tasks) return false;
+
+  pthread_mutex_init(&d->lock, NULL);
+  d->capacity = capacity;
+  d->head = d->tail = 0;
+  return true;
+}
+
+static void deque_destroy(struct runner_deque* d)
+{
+  pthread_mutex_destroy(&d->lock);
+  free(d->tasks);
+}
+
+static void deque_push(struct runner_deque* d, u32 task)
+{
+  pthread_mutex_lock(&d->lock);
+  d->tasks[d->tail++ % d->capacity] = task;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// the owner's end
+static bool deque_pop(struct runner_deque* d, u32* task)
+{
+  pthread_mutex_lock(&d->lock);
+
+  bool found = d->head != d->tail;
+  if(found) *task = d->tasks[--d->tail % d->capacity];
+
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// the thieves' end
+static bool deque_steal(struct runner_deque* d, u32* task)
+{
+  pthread_mutex_lock(&d->lock);
+
+  bool found = d->head != d->tail;
+  if(found) *task = d->tasks[d->head++ % d->capacity];
+
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static bool runner_next_task(struct runner* r, struct runner_worker* w, u32* task)
+{
+  if(deque_pop(&w->deque, task)) return true;
+
+  // tasks are only queued at the start of a batch, so once every deque has
+  // been found empty, everything left is already running
+  for(u32 i = 1; i < r->threads; ++i) {
+    if(deque_steal(&r->workers[(w->id + i) % r->threads].deque, task)) {
+      w->steals++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void* runner_worker_main(void* arg)
+{
+  struct runner_worker* w = arg;
+  struct runner* r = w->runner;
+  u32 seen = 0;
+
+  for(;;) {
+    pthread_mutex_lock(&r->lock);
+
+    while(r->generation == seen && !r->quit)
+      pthread_cond_wait(&r->start, &r->lock);
+
+    seen = r->generation;
+    bool quit = r->quit;
+
+    pthread_mutex_unlock(&r->lock);
+
+    if(quit) break;
+
+    u32 task;
+    while(runner_next_task(r, w, &task)) {
+      struct NES* nes = r->nes[task];
+
+      // frames is set before any task of the batch is queued
+      for(u32 f = r->frames; f && nes->is_active; --f)
+        nes_run_frame(nes);
+
+      if(__atomic_sub_fetch(&r->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->done);
+        pthread_mutex_unlock(&r->lock);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// stops the r->threads running workers and frees whatever of the first
+// `workers` workers and r->instances instances was set up
+static void runner_teardown(struct runner* r, u32 workers)
+{
+  pthread_mutex_lock(&r->lock);
+  r->quit = true;
+  pthread_cond_broadcast(&r->start);
+  pthread_mutex_unlock(&r->lock);
+
+  // a worker may still be looking for work in the others' deques
+  for(u32 i = 0; i < r->threads; ++i)
+    pthread_join(r->workers[i].thread, NULL);
+
+  for(u32 i = 0; r->workers && i < workers; ++i) {
+    if(r->workers[i].deque.tasks) deque_destroy(&r->workers[i].deque);
+  }
+
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->start);
+  pthread_cond_destroy(&r->done);
+
+  for(u32 i = 0; i < r->instances; ++i)
+    nes_free(r->nes[i]);
+
+  free(r->workers);
+  free(r->nes);
+  free(r);
+}
+
+// every instance shares img, they start powered up. NULL if any of it
+// can't be set up
+struct runner* runner_create(struct rom_image* img, u32 instances, u32 threads)
+{
+  if(!instances) return NULL;
+  if(!threads) threads = 1;
+
+  struct runner* r = calloc(1, sizeof(struct runner));
+  if(!r) return NULL;
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->start, NULL);
+  pthread_cond_init(&r->done, NULL);
+
+  // r->instances and r->threads count what was set up so far
+  r->nes = calloc(instances, sizeof(struct NES*));
+  r->workers = calloc(threads, sizeof(struct runner_worker));
+  if(!r->nes || !r->workers) goto fail;
+
+  for(u32 i = 0; i < instances; ++i) {
+    struct NES* nes = nes_create();
+    if(!nes) goto fail;
+
+    r->nes[r->instances++] = nes;
+    if(!nes_load_rom_image(nes, img)) goto fail;
+
+    nes_powerup(nes);
+    nes->is_active = true;
+  }
+
+  for(u32 i = 0; i < threads; ++i) {
+    struct runner_worker* w = &r->workers[i];
+
+    w->runner = r;
+    w->id = i;
+    if(!deque_init(&w->deque, instances)) goto fail;
+  }
+
+  for(; r->threads < threads; ++r->threads) {
+    struct runner_worker* w = &r->workers[r->threads];
+    if(pthread_create(&w->thread, NULL, runner_worker_main, w)) goto fail;
+  }
+
+  return r;
+
+fail:
+  LOGF("Couldn't set up the runner");
+  runner_teardown(r, threads);
+  return NULL;
+}
+
+void runner_free(struct runner* r)
+{
+  runner_teardown(r, r->threads);
+}
+
+// step every instance `frames` frames, blocks until all are done
+void runner_run(struct runner* r, u32 frames)
+{
+  r->frames = frames;
+  __atomic_store_n(&r->pending, r->instances, __ATOMIC_RELEASE);
+
+  for(u32 i = 0; i < r->instances; ++i)
+    deque_push(&r->workers[i % r->threads].deque, i);
+
+  pthread_mutex_lock(&r->lock);
+
+  r->generation++;
+  pthread_cond_broadcast(&r->start);
+
+  while(__atomic_load_n(&r->pending, __ATOMIC_ACQUIRE))
+    pthread_cond_wait(&r->done, &r->lock);
+
+  pthread_mutex_unlock(&r->lock);
+}
+
+u64 runner_steals(struct runner* r)
+{
+  u64 steals = 0;
+
+  for(u32 i = 0; i < r->threads; ++i)
+    steals += r->workers[i].steals;
+
+  return steals;
+}
+
+struct runner_pool {
+  u32 count;
+  u32 next;            // next index to take, atomic
+  u32 done;            // tasks run, atomic
+
+  runner_init_fn init;
+  runner_task_fn task;
+  void* ctx;
+};
+
+static void* runner_pool_worker(void* arg)
+{
+  struct runner_pool* p = arg;
+  struct NES* nes = nes_create();
+
+  // leaves the tasks to the other threads
+  if(!nes || (p->init && !p->init(nes, p->ctx))) {
+    LOGF("Couldn't set up an NES for a worker");
+    if(nes) nes_free(nes);
+    return NULL;
+  }
+
+  for(;;) {
+    u32 i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+    if(i >= p->count) break;
+
+    p->task(nes, i, p->ctx);
+    __atomic_add_fetch(&p->done, 1, __ATOMIC_RELAXED);
+  }
+
+  nes_free(nes);
+  return NULL;
+}
+
+// see runner.h
+u32 runner_for_each(u32 count, u32 threads, runner_init_fn init,
+                    runner_task_fn task, void* ctx)
+{
+  struct runner_pool p = {
+    .count = count,
+    .next = 0,
+    .done = 0,
+    .init = init,
+    .task = task,
+    .ctx = ctx
+  };
+
+  if(!count) return 0;
+  if(threads > count) threads = count;
+
+  pthread_t* thread = threads ? malloc(threads * sizeof(pthread_t)) : NULL;
+  u32 started = 0;
+
+  for(; thread && started < threads; ++started) {
+    if(pthread_create(&thread[started], NULL, runner_pool_worker, &p)) break;
+  }
+
+  // no threads at all, do it here
+  if(!started) runner_pool_worker(&p);
+
+  for(u32 i = 0; i < started; ++i)
+    pthread_join(thread[i], NULL);
+
+  free(thread);
+  return p.done;
+}
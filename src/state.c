@@ -0,0 +1,439 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/* save states, see state.h for the format */
+
+#include "state.h"
+#include "6502.h"
+#include "2C02.h"
+#include "apu.h"
+#include "cow.h"
+#include "mapper.h"
+#include "nes.h"
+#include "rom.h"
+#include "hash.h"
+
+#include <string.h>
+
+#define HEADER_SIZE 0x10
+#define CPU_SIZE    16
+#define PPU_SIZE    24
+#define INPUT_SIZE  4
+#define APU_SIZE    78
+#define VRAM_SIZE   (0x1000 + 0x20 + 0x100)
+
+enum state_flags {
+  STATE_CHR_RAM = 1 << 0,
+  STATE_PRG_RAM = 1 << 1
+};
+
+static void put16(u8* p, u16 v) { p[0] = v; p[1] = v >> 8; }
+static void put32(u8* p, u32 v) { put16(p, v); put16(p + 2, v >> 16); }
+static u16  get16(const u8* p)  { return create_u16(p[0], p[1]); }
+static u32  get32(const u8* p)  { return get16(p) | (u32)get16(p + 2) << 16; }
+
+static u32 state_size(struct ROM* rom, bool chr_ram)
+{
+  return HEADER_SIZE + CPU_SIZE + PPU_SIZE + 0x800 + 0x18 + INPUT_SIZE + APU_SIZE +
+    1 + rom->map->ops->state_size + 0x2000 + VRAM_SIZE +
+    (chr_ram ? 0x2000 : 0);
+}
+
+static void save_cpu(struct _6502* cpu, u8* p)
+{
+  p[0] = cpu->r.a;
+  p[1] = cpu->r.x;
+  p[2] = cpu->r.y;
+  p[3] = cpu->r.sp;
+  put16(p + 4, cpu->r.pc);
+  p[6] = flag_to_u8(cpu->r.flags);
+  p[7] = cpu->intr.nmi;
+  p[8] = cpu->intr.reset;
+  p[9] = cpu->intr.brk;
+  p[10] = cpu->intr.irq_sources;
+  p[11] = !cpu->nes->is_active;
+  put32(p + 12, cpu->ticks);
+}
+
+static void save_ppu(struct _2C02* ppu, u8* p)
+{
+  p[0] = *(u8*)&ppu->r.ctrl;
+  p[1] = *(u8*)&ppu->r.mask;
+  p[2] = *(u8*)&ppu->r.status;
+  p[3] = ppu->r.oam_addr;
+  p[4] = ppu->r.oam_data;
+  p[5] = ppu->r.ppu_scroll;
+  p[6] = ppu->r.ppu_addr;
+  p[7] = ppu->r.ppu_data;
+  put16(p + 8,  ppu->dot);
+  put16(p + 10, ppu->scanline);
+  put32(p + 12, ppu->frame);
+  put16(p + 16, ppu->v);
+  put16(p + 18, ppu->t);
+  p[20] = ppu->x;
+  p[21] = ppu->w;
+  p[22] = ppu->read_buffer;
+  p[23] = ppu->mirroring;
+}
+
+static void save_envelope(const struct apu_envelope* env, u8* p)
+{
+  p[0] = env->start;
+  p[1] = env->loop;
+  p[2] = env->constant;
+  p[3] = env->volume;
+  p[4] = env->divider;
+  p[5] = env->decay;
+}
+
+static void load_envelope(struct apu_envelope* env, const u8* p)
+{
+  env->start    = p[0];
+  env->loop     = p[1];
+  env->constant = p[2];
+  env->volume   = p[3];
+  env->divider  = p[4];
+  env->decay    = p[5];
+}
+
+static void save_apu(const struct apu_registers* r, u8* p)
+{
+  for(int i = 0; i < 2; ++i, p += 20) {
+    const struct apu_pulse* c = &r->pulse[i];
+    p[0] = c->enabled;
+    p[1] = c->duty;
+    p[2] = c->step;
+    put16(p + 3, c->period);
+    put16(p + 5, c->timer);
+    p[7] = c->length;
+    save_envelope(&c->env, p + 8);
+    p[14] = c->sweep_enabled;
+    p[15] = c->sweep_negate;
+    p[16] = c->sweep_reload;
+    p[17] = c->sweep_period;
+    p[18] = c->sweep_shift;
+    p[19] = c->sweep_divider;
+  }
+
+  const struct apu_triangle* t = &r->triangle;
+  p[0] = t->enabled;
+  p[1] = t->control;
+  p[2] = t->step;
+  put16(p + 3, t->period);
+  put16(p + 5, t->timer);
+  p[7] = t->length;
+  p[8] = t->linear;
+  p[9] = t->linear_reload;
+  p[10] = t->linear_start;
+  p += 11;
+
+  const struct apu_noise* n = &r->noise;
+  p[0] = n->enabled;
+  p[1] = n->mode;
+  put16(p + 2, n->shift);
+  put16(p + 4, n->period);
+  put16(p + 6, n->timer);
+  p[8] = n->length;
+  save_envelope(&n->env, p + 9);
+  p += 15;
+
+  p[0] = r->five_step;
+  p[1] = r->irq_inhibit;
+  p[2] = r->frame_irq;
+  p[3] = r->odd;
+  put32(p + 4, r->frame_cycle);
+  put32(p + 8, r->sample_phase);
+}
+
+static void load_apu(struct apu_registers* r, const u8* p)
+{
+  for(int i = 0; i < 2; ++i, p += 20) {
+    struct apu_pulse* c = &r->pulse[i];
+    c->enabled = p[0];
+    c->duty    = p[1];
+    c->step    = p[2];
+    c->period  = get16(p + 3);
+    c->timer   = get16(p + 5);
+    c->length  = p[7];
+    load_envelope(&c->env, p + 8);
+    c->sweep_enabled = p[14];
+    c->sweep_negate  = p[15];
+    c->sweep_reload  = p[16];
+    c->sweep_period  = p[17];
+    c->sweep_shift   = p[18];
+    c->sweep_divider = p[19];
+  }
+
+  struct apu_triangle* t = &r->triangle;
+  t->enabled = p[0];
+  t->control = p[1];
+  t->step    = p[2];
+  t->period  = get16(p + 3);
+  t->timer   = get16(p + 5);
+  t->length  = p[7];
+  t->linear        = p[8];
+  t->linear_reload = p[9];
+  t->linear_start  = p[10];
+  p += 11;
+
+  struct apu_noise* n = &r->noise;
+  n->enabled = p[0];
+  n->mode    = p[1];
+  n->shift   = get16(p + 2);
+  n->period  = get16(p + 4);
+  n->timer   = get16(p + 6);
+  n->length  = p[8];
+  load_envelope(&n->env, p + 9);
+  p += 15;
+
+  r->five_step    = p[0];
+  r->irq_inhibit  = p[1];
+  r->frame_irq    = p[2];
+  r->odd          = p[3];
+  r->frame_cycle  = get32(p + 4);
+  r->sample_phase = get32(p + 8);
+}
+
+u32 nes_state_size(struct NES* nes)
+{
+  return state_size(nes->rom, nes->rom->chr_ram != NULL);
+}
+
+// returns the number of bytes written, or 0 if buf is too small
+u32 nes_save_state(struct NES* nes, u8* buf, u32 size)
+{
+  struct ROM* rom = nes->rom;
+  struct _6502* cpu = nes->cpu;
+  struct _2C02* ppu = nes->ppu;
+
+  u32 needed = nes_state_size(nes);
+  if(size < needed) return 0;
+
+  u8* p = buf;
+
+  // header
+  memcpy(p, STATE_MAGIC, 4);
+  put16(p + 4, STATE_VERSION);
+  p[6] = rom->map->num;
+  p[7] = (rom->chr_ram ? STATE_CHR_RAM : 0) | (rom->hdr.has_prg_ram ? STATE_PRG_RAM : 0);
+  put32(p + 8,  rom->img->prg_size);
+  put32(p + 12, rom->img->chr_size);
+  p += HEADER_SIZE;
+
+  // CPU
+  save_cpu(cpu, p);
+  p += CPU_SIZE;
+
+  // PPU
+  save_ppu(ppu, p);
+  p += PPU_SIZE;
+
+  // RAM
+  memcpy(p, nes->mem->lowmem, 0x800);
+  p += 0x800;
+  memcpy(p, nes->mem->apureg, 0x18);
+  p += 0x18;
+
+  // controllers
+  p[0] = nes->strobe;
+  p[1] = nes->shift[0];
+  p[2] = nes->shift[1];
+  p[3] = 0;
+  p += INPUT_SIZE;
+
+  // APU
+  save_apu(&nes->apu->r, p);
+  p += APU_SIZE;
+
+  // mapper
+  *p = mapper_serialize(rom->map, p + 1, false);
+  p += 1 + *p;
+  for(int i = 0; i < 8; ++i)
+    memcpy(p + i * COW_PAGE_SIZE, rom->map->sram_pages[i], COW_PAGE_SIZE);
+  p += 0x2000;
+
+  // PPU memory
+  for(int i = 0; i < 4; ++i)
+    memcpy(p + i * COW_PAGE_SIZE, ppu->vram_pages[i], COW_PAGE_SIZE);
+  memcpy(p + 0x1000, ppu->palette, 0x20);
+  memcpy(p + 0x1020, ppu->oam, 0x100);
+  p += VRAM_SIZE;
+
+  if(rom->chr_ram) {
+    for(int i = 0; i < 8; ++i)
+      memcpy(p + i * COW_PAGE_SIZE, rom->chr_ram_banks[i], COW_PAGE_SIZE);
+    p += 0x2000;
+  }
+
+  return p - buf;
+}
+
+// nothing is changed unless the whole state checks out
+bool nes_load_state(struct NES* nes, const u8* buf, u32 size)
+{
+  struct ROM* rom = nes->rom;
+  struct _6502* cpu = nes->cpu;
+  struct _2C02* ppu = nes->ppu;
+
+  if(size < HEADER_SIZE || memcmp(buf, STATE_MAGIC, 4)) {
+    LOGF("Not a save state");
+    return false;
+  }
+
+  if(get16(buf + 4) != STATE_VERSION) {
+    LOGF("Save state version %d isn't supported (expected %d)", get16(buf + 4), STATE_VERSION);
+    return false;
+  }
+
+  bool chr_ram = buf[7] & STATE_CHR_RAM;
+
+  if(buf[6] != rom->map->num || get32(buf + 8) != rom->img->prg_size ||
+     get32(buf + 12) != rom->img->chr_size || chr_ram != (rom->chr_ram != NULL)) {
+    LOGF("Save state was made with a different ROM");
+    return false;
+  }
+
+  if(size < state_size(rom, chr_ram) ||
+     buf[HEADER_SIZE + CPU_SIZE + PPU_SIZE + 0x818 + INPUT_SIZE + APU_SIZE] !=
+     rom->map->ops->state_size) {
+    LOGF("Save state is truncated or corrupt");
+    return false;
+  }
+
+  rom->hdr.has_prg_ram = buf[7] & STATE_PRG_RAM;
+
+  // pages shared with forks are overwritten below, once private they are
+  // contiguous in the arena again
+  nes_unshare(nes);
+
+  const u8* p = buf + HEADER_SIZE;
+
+  // CPU
+  cpu->r.a  = p[0];
+  cpu->r.x  = p[1];
+  cpu->r.y  = p[2];
+  cpu->r.sp = p[3];
+  cpu->r.pc = get16(p + 4);
+  cpu->r.flags = u8_to_flag(p[6]);
+  cpu->intr.nmi   = p[7];
+  cpu->intr.reset = p[8];
+  cpu->intr.brk   = p[9];
+  cpu->intr.irq_sources = p[10];
+  nes->is_active  = !p[11];
+  cpu->ticks = get32(p + 12);
+  p += CPU_SIZE;
+
+  // PPU
+  *(u8*)&ppu->r.ctrl   = p[0];
+  *(u8*)&ppu->r.mask   = p[1];
+  *(u8*)&ppu->r.status = p[2];
+  ppu->r.oam_addr   = p[3];
+  ppu->r.oam_data   = p[4];
+  ppu->r.ppu_scroll = p[5];
+  ppu->r.ppu_addr   = p[6];
+  ppu->r.ppu_data   = p[7];
+  ppu->dot      = get16(p + 8);
+  ppu->scanline = get16(p + 10);
+  ppu->frame    = get32(p + 12);
+  ppu->v = get16(p + 16);
+  ppu->t = get16(p + 18);
+  ppu->x = p[20];
+  ppu->w = p[21];
+  ppu->read_buffer = p[22];
+  ppu_2C02_set_mirroring(ppu, p[23]);
+  p += PPU_SIZE;
+
+  // RAM
+  memcpy(nes->mem->lowmem, p, 0x800);
+  p += 0x800;
+  memcpy(nes->mem->apureg, p, 0x18);
+  p += 0x18;
+
+  // controllers
+  nes->strobe   = p[0];
+  nes->shift[0] = p[1];
+  nes->shift[1] = p[2];
+  p += INPUT_SIZE;
+
+  // APU
+  load_apu(&nes->apu->r, p);
+  p += APU_SIZE;
+
+  // mapper
+  mapper_serialize(rom->map, (u8*)p + 1, true);
+  p += 1 + *p;
+  nes->cow->dirty = ~0u;
+  memcpy(rom->map->sram_pages[0], p, 0x2000);
+  p += 0x2000;
+
+  // PPU memory
+  memcpy(ppu->vram_pages[0], p, 0x1000);
+  memcpy(ppu->palette, p + 0x1000, 0x20);
+  memcpy(ppu->oam, p + 0x1020, 0x100);
+  p += VRAM_SIZE;
+
+  if(chr_ram) {
+    memcpy(rom->chr_ram, p, 0x2000);
+  }
+
+  return true;
+}
+
+/* Hash of everything a save state holds, hashed in place instead of
+   serialized, so equal states hash equal. The pages of SRAM, VRAM and CHR
+   RAM are hashed one by one and only when written since the last call (see
+   struct cow); the rest is small enough to hash every time. */
+u64 nes_state_hash(struct NES* nes)
+{
+  struct ROM* rom = nes->rom;
+  struct _2C02* ppu = nes->ppu;
+  u8 regs[CPU_SIZE + PPU_SIZE + APU_SIZE + 3 + 1 + MAPPER_STATE_SIZE];
+
+  save_cpu(nes->cpu, regs);
+  save_ppu(ppu, regs + CPU_SIZE);
+  save_apu(&nes->apu->r, regs + CPU_SIZE + PPU_SIZE);
+
+  u8* p = regs + CPU_SIZE + PPU_SIZE + APU_SIZE;
+  p[0] = nes->strobe;
+  p[1] = nes->shift[0];
+  p[2] = nes->shift[1];
+  p[3] = mapper_serialize(rom->map, p + 4, false);
+
+  u64 h = hash_bytes(regs, CPU_SIZE + PPU_SIZE + APU_SIZE + 4 + p[3], HASH_SEED);
+  h = hash_bytes(nes->mem->lowmem, 0x800, h);
+  h = hash_bytes(nes->mem->apureg, 0x18, h);
+
+  h = hash_bytes(ppu->palette, 0x20, h);
+  h = hash_bytes(ppu->oam, 0x100, h);
+
+  struct cow* cow = nes->cow;
+
+  for(u32 i = 0; i < COW_PAGES; ++i) {
+    if(!cow->slot[i]) continue;
+
+    if(cow->dirty & 1u << i)
+      cow->hash[i] = hash_bytes(*cow->slot[i], COW_PAGE_SIZE, HASH_SEED);
+
+    h = hash_mix(h, cow->hash[i]);
+  }
+
+  cow->dirty = 0;
+
+  return h;
+}
@@ -0,0 +1,164 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* frame time statistics, see stats.h */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "apu.h"
+
+static int frame_stats_listen(const char* path)
+{
+  struct sockaddr_un addr;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    LOGF("Socket path %s is too long", path);
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) return -1;
+
+  // a socket left over from an earlier run, but never anything else
+  struct stat st;
+
+  if(!lstat(path, &st)) {
+    if(!S_ISSOCK(st.st_mode)) {
+      LOGF("%s exists and isn't a socket", path);
+      close(fd);
+      return -1;
+    }
+
+    unlink(path);
+  }
+
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 4) ||
+     fcntl(fd, F_SETFL, O_NONBLOCK)) {
+    LOGF("Couldn't listen on %s", path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// NULL for no control socket
+struct frame_stats* frame_stats_create(const char* socket_path)
+{
+  struct frame_stats* s = malloc(sizeof(struct frame_stats));
+  memset(s, 0, sizeof(struct frame_stats));
+
+  s->listener = -1;
+
+  if(socket_path) {
+    s->listener = frame_stats_listen(socket_path);
+
+    if(s->listener < 0) {
+      free(s);
+      return NULL;
+    }
+
+    s->path = malloc(strlen(socket_path) + 1);
+    strcpy(s->path, socket_path);
+  }
+
+  return s;
+}
+
+void frame_stats_free(struct frame_stats* s)
+{
+  if(s->listener >= 0) {
+    close(s->listener);
+    unlink(s->path);
+  }
+
+  free(s->path);
+  free(s);
+}
+
+// the samples a frame made were just queued at now (ns)
+void frame_stats_audio(struct frame_stats* s, u32 samples, u64 now)
+{
+  u64 played = 0;
+
+  if(s->audio_playing) {
+    played = (now - s->audio_start) * APU_SAMPLE_RATE / 1000000000ull;
+
+    if(played >= s->audio_queued) {
+      ++s->underruns;
+
+      s->audio_playing = false;
+      s->audio_queued = played = 0;
+    }
+  }
+
+  s->audio_queued += samples;
+
+  if(!s->audio_playing && s->audio_queued >= STATS_AUDIO_BUFFER) {
+    s->audio_playing = true;
+    s->audio_start = now;
+  }
+
+  histogram_record(&s->audio, s->audio_queued - played);
+}
+
+void frame_stats_report(struct frame_stats* s, FILE* fp)
+{
+  fprintf(fp, "%llu frames, %llu audio underruns\n", (unsigned long long)s->emulate.total,
+          (unsigned long long)s->underruns);
+
+  histogram_print(&s->emulate, fp, "emulate", "ms", 1e6);
+  histogram_print(&s->present, fp, "present", "ms", 1e6);
+  histogram_print(&s->audio, fp, "audio", "ms", APU_SAMPLE_RATE / 1000.0);
+}
+
+// answers one waiting client, if any, with the report
+void frame_stats_poll(struct frame_stats* s)
+{
+  if(s->listener < 0) return;
+
+  int fd = accept(s->listener, NULL, NULL);
+  if(fd < 0) return;
+
+  char* text = NULL;
+  size_t size = 0;
+  FILE* fp = open_memstream(&text, &size);
+
+  if(fp) {
+    frame_stats_report(s, fp);
+    fclose(fp);
+
+    // a client gone already mustn't take the emulator down with SIGPIPE
+    send(fd, text, size, MSG_NOSIGNAL);
+    free(text);
+  }
+
+  close(fd);
+}
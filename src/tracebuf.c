@@ -0,0 +1,65 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* instruction trace buffer, see tracebuf.h */
+
+#include "tracebuf.h"
+#include "6502.h"
+
+#include <string.h>
+
+struct tracebuf* tracebuf_create(u32 capacity, tracebuf_flush_fn flush, void* ctx)
+{
+  struct tracebuf* t = malloc(sizeof(struct tracebuf));
+  memset(t, 0, sizeof(struct tracebuf));
+
+  t->records = malloc(capacity * sizeof(struct trace_record));
+  t->capacity = capacity;
+  t->flush = flush;
+  t->ctx = ctx;
+
+  return t;
+}
+
+void tracebuf_free(struct tracebuf* t)
+{
+  free(t->records);
+  free(t);
+}
+
+void tracebuf_flush(struct tracebuf* t)
+{
+  if(t->count) t->flush(t, t->ctx);
+  t->count = 0;
+}
+
+/* C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7 */
+int tracebuf_format(const struct trace_record* r, char* buf, size_t size)
+{
+  char bytes[9] = "", text[32];
+  u32 length = cpu_6502_length(r->op[0]);
+  int n = 0;
+
+  for(u32 i = 0; i < length; ++i)
+    n += sprintf(bytes + n, n ? " %02X" : "%02X", r->op[i]);
+
+  cpu_6502_disassemble(r->op, r->pc, text, sizeof(text));
+
+  return snprintf(buf, size, "%04X  %-8s  %-31s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%u",
+                  r->pc, bytes, text, r->a, r->x, r->y, r->p, r->sp, r->scanline, r->dot,
+                  r->cycles);
+}
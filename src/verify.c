@@ -0,0 +1,140 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* parallel movie verification, see verify.h */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "verify.h"
+#include "2C02.h"
+#include "movie.h"
+#include "nes.h"
+#include "runner.h"
+#include "state.h"
+
+#include <string.h>
+
+struct verify_job {
+  struct movie* m;
+  struct rom_image* img;
+
+  u32 segments;
+  u32 desync;          // first frame that didn't match, atomic min
+};
+
+// frames start - end of segment s
+static void verify_bounds(struct movie* m, u32 s, u32* start, u32* end)
+{
+  *start = s ? m->checkpoint[s - 1].frame : 0;
+  *end = s < m->checkpoints ? m->checkpoint[s].frame : m->frames;
+}
+
+static void verify_desync(struct verify_job* job, u32 frame)
+{
+  u32 seen = __atomic_load_n(&job->desync, __ATOMIC_RELAXED);
+
+  while(frame < seen &&
+        !__atomic_compare_exchange_n(&job->desync, &seen, frame, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// returns the first frame of the segment that didn't match, or end
+static u32 verify_segment(struct verify_job* job, struct NES* nes, u32 s)
+{
+  struct movie* m = job->m;
+  u32 start, end;
+
+  verify_bounds(m, s, &start, &end);
+
+  if(!s) {
+    nes_powerup(nes);
+    nes->is_active = true;
+  } else {
+    struct movie_checkpoint* c = &m->checkpoint[s - 1];
+
+    // a checkpoint that doesn't match its recorded hash can't be trusted
+    if(!nes_load_state(nes, c->state, c->size) ||
+       (start && nes_state_hash(nes) != m->frame[start - 1].hash)) return start;
+  }
+
+  for(u32 i = start; i < end; ++i) {
+    // a desync before this segment makes the rest moot
+    if(__atomic_load_n(&job->desync, __ATOMIC_RELAXED) < i) return end;
+
+    nes->input[0] = m->frame[i].input[0];
+    nes->input[1] = m->frame[i].input[1];
+
+    nes_run_frame(nes);
+
+    if(nes_state_hash(nes) != m->frame[i].hash) return i;
+  }
+
+  return end;
+}
+
+// once per thread
+static bool verify_init(struct NES* nes, void* arg)
+{
+  struct verify_job* job = arg;
+
+  if(!nes_load_rom_image(nes, job->img)) return false;
+
+  nes->ppu->suppress_output = true;
+  return true;
+}
+
+static void verify_task(struct NES* nes, u32 s, void* arg)
+{
+  struct verify_job* job = arg;
+  u32 start, end;
+
+  verify_bounds(job->m, s, &start, &end);
+
+  u32 frame = verify_segment(job, nes, s);
+  if(frame < end) verify_desync(job, frame);
+}
+
+bool verify_movie(struct movie* m, struct rom_image* img, u32 threads,
+                  struct verify_result* result)
+{
+  struct verify_job job = {
+    .m = m,
+    .img = img,
+    .segments = m->checkpoints + 1,
+    .desync = m->frames
+  };
+
+  memset(result, 0, sizeof(struct verify_result));
+  result->segments = job.segments;
+
+  if(m->rom_hash != movie_rom_hash(img)) {
+    LOGF("Movie was recorded with a different ROM");
+    result->error = true;
+    return false;
+  }
+
+  // fewer only if no thread could set up an NES
+  if(runner_for_each(job.segments, threads, verify_init, verify_task, &job) < job.segments) {
+    result->error = true;
+    return false;
+  }
+
+  result->frames = job.desync;
+  result->ok = job.desync == m->frames;
+
+  return result->ok;
+}
@@ -0,0 +1,137 @@
+/*
+ * This file is part of Nestorama.
+ *
+ * Nestorama is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Nestorama is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Nestorama.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Rewind buffer test, run by make check. RAM is scribbled over between
+   snapshots so the deltas vary from a few bytes to a few K, with a budget
+   small enough that the ring wraps many times. No delta may be written
+   over one that is still live. Every push records the full save state,
+   and every step back must load exactly the state recorded for that
+   snapshot. Steps back, some of them through all of the history,
+   are interleaved with the pushes so it gets cut and regrown across the
+   wrap point too. */
+
+#include "def.h"
+#include "nes.h"
+#include "rewind.h"
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PUSHES 3000
+#define BUDGET (128 * 1024)
+
+static u32 seed = 1;
+
+static u32 next_random(u32 n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % n;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc != 2) {
+    fprintf(stderr, "Usage: rewind NESROM\n");
+    return 2;
+  }
+
+  struct NES* nes = nes_create();
+  FILE* fp = fopen(argv[1], "rb");
+
+  if(!fp || !nes_load_rom(nes, fp)) {
+    fprintf(stderr, "Couldn't load %s\n", argv[1]);
+    return 2;
+  }
+  fclose(fp);
+  nes_powerup(nes);
+
+  struct rewind* rw = rewind_create(nes, BUDGET, 1);
+  if(!rw) return 2;
+
+  u32 size = nes_state_size(nes);
+  u8* states = malloc((u64)PUSHES * size);
+  u8* state = malloc(size);
+  if(!states || !state) return 2;
+
+  // states[0 .. depth) is the history as pushed, rewind reaches the newest ones
+  u32 depth = 0, wraps = 0, steps = 0;
+
+  for(u32 i = 0; i < PUSHES; ++i) {
+    u32 last_pos = rw->write_pos;
+
+    for(u32 n = next_random(next_random(8) ? 64 : 3000); n; --n)
+      nes->mem->lowmem[next_random(0x800)] ^= 1 + next_random(0xFF);
+
+    rewind_push(rw);
+    nes_save_state(nes, states + (u64)depth++ * size, size);
+
+    if(rw->write_pos < last_pos) wraps++;
+
+    // the newest delta must not have been written over anything still live
+    if(rw->count) {
+      struct rewind_entry* e = &rw->entries[(rw->first + rw->count - 1) % rw->max_entries];
+
+      for(u32 j = 0; j + 1 < rw->count; ++j) {
+        struct rewind_entry* o = &rw->entries[(rw->first + j) % rw->max_entries];
+
+        if(o->offset < e->offset + e->size && e->offset < o->offset + o->size) {
+          fprintf(stderr, "push %u: delta at %u overwrote one at %u\n", i, e->offset, o->offset);
+          return 1;
+        }
+      }
+    }
+
+    if(next_random(16)) continue;
+
+    // now and then all the way back, through the wrap point
+    for(u32 back = next_random(32) ? 1 + next_random(8) : PUSHES; back; --back) {
+      u32 available = rewind_frames_available(rw);
+
+      if(!rewind_step_back(rw)) {
+        if(available) {
+          fprintf(stderr, "push %u: step back failed with %u frames left\n", i, available);
+          return 1;
+        }
+        break;
+      }
+
+      if(available > depth - 1) {
+        fprintf(stderr, "push %u: %u frames available from %u snapshots\n", i, available, depth);
+        return 1;
+      }
+
+      depth--;
+      steps++;
+      nes_save_state(nes, state, size);
+
+      if(memcmp(state, states + (u64)(depth - 1) * size, size)) {
+        fprintf(stderr, "push %u: stepped back to a state that was never saved\n", i);
+        return 1;
+      }
+    }
+  }
+
+  printf("rewind: %u pushes, %u steps back, %u wraps, ok\n", PUSHES, steps, wraps);
+
+  free(states);
+  free(state);
+  rewind_free(rw);
+  nes_free(nes);
+
+  return wraps < 3;
+}